@@ -0,0 +1,303 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aho_corasick.h"
+#include "events.h"
+#include "log.h"
+#include "memsearch.h"
+
+/*
+ * Aho-Corasick multi-pattern matching
+ *
+ * All substring patterns (static and environment events) are added
+ * at init and then compiled into a single automaton, so that a
+ * message is scanned only once, no matter how many rules there are.
+ *
+ * The automaton is a full DFA (i.e., failure links are resolved at
+ * build time), one row per trie node. To keep the table small, bytes
+ * are mapped into classes first: each byte that appears in some
+ * pattern has its own class, and all the others share class 0.
+ *
+ * States are 32-bit, and the table is sized after the actual amount
+ * of trie nodes (the distinct prefixes of all patterns), so there is
+ * no cap on the amount of rules, or on their length, other than
+ * memory.
+ *
+ * With only a few patterns, though, the DFA (one table lookup per
+ * byte) loses to searching each pattern with the vectorized memmem
+ * (memsearch.c), which also stops at the first occurrence.
+ */
+
+/* Up to this many patterns, search them one by one. */
+#ifndef AC_MEMMEM_MAX
+#define AC_MEMMEM_MAX 8
+#endif
+
+static struct ac_pattern {
+	const char *str;
+	size_t len;
+	int on_body; /* Only matches inside the message body. */
+	int next;    /* Next pattern ending at the same state, or -1. */
+} *patterns;
+static int num_patterns;
+static int max_patterns;
+
+static struct ac_hits always_hits; /* Empty patterns. */
+static size_t hit_words;           /* Words per hit set. */
+
+static unsigned char byte_class[256];
+static unsigned num_classes;
+
+static uint32_t *delta;  /* Transitions: [state * num_classes + class]. */
+static uint32_t *fail;   /* Failure links, only used while building.    */
+static uint32_t *dict;   /* Nearest suffix state with output, 0 if none. */
+static int      *out;    /* First pattern ending at the state, or -1.   */
+static unsigned  num_states;
+
+static inline void hits_set(struct ac_hits *h, int id) {
+	h->bits[id / AC_WORD_BITS] |= 1UL << (id % AC_WORD_BITS);
+}
+
+/**
+ * @brief Adds a new substring pattern to be matched.
+ *
+ * @param str     Pattern, must outlive the automaton.
+ * @param on_body If non-zero, the pattern only matches inside
+ *                the message body.
+ *
+ * @return Returns the pattern id, to be checked with ac_hit().
+ */
+int ac_add_pattern(const char *str, int on_body)
+{
+	struct ac_pattern *p;
+
+	if (num_patterns == max_patterns) {
+		max_patterns = max_patterns ? max_patterns * 2 : 32;
+		if (!(p = realloc(patterns, max_patterns * sizeof(*patterns))))
+			panic("Unable to allocate substring patterns!\n");
+		patterns = p;
+	}
+
+	patterns[num_patterns].str     = str;
+	patterns[num_patterns].len     = strlen(str);
+	patterns[num_patterns].on_body = on_body;
+	patterns[num_patterns].next    = -1;
+	return num_patterns++;
+}
+
+/**
+ * @brief Inserts the pattern @p id into the trie.
+ */
+static void trie_insert(int id)
+{
+	const unsigned char *c = (const unsigned char *)patterns[id].str;
+	unsigned s = 0;
+	uint32_t *t;
+
+	for (size_t i = 0; i < patterns[id].len; i++) {
+		t = &delta[s * num_classes + byte_class[c[i]]];
+		if (!*t)
+			*t = num_states++;
+		s = *t;
+	}
+
+	patterns[id].next = out[s];
+	out[s] = id;
+}
+
+/**
+ * @brief Compares the patterns at @p a and @p b (ids), by string.
+ */
+static int pattern_cmp(const void *a, const void *b)
+{
+	return strcmp(patterns[*(const int *)a].str, patterns[*(const int *)b].str);
+}
+
+/**
+ * @brief Counts the states of the trie of all the (non-empty)
+ * patterns: the root, plus one per distinct prefix. With the
+ * patterns sorted, each one only adds the prefixes it does not
+ * share with the previous one.
+ *
+ * @return Returns the amount of states.
+ */
+static size_t count_states(void)
+{
+	const char *prev = "";
+	size_t states = 1;
+	size_t lcp;
+	int *ids;
+	int i;
+
+	if (!(ids = malloc(num_patterns * sizeof(*ids))))
+		panic("Unable to allocate the substring automaton!\n");
+	for (i = 0; i < num_patterns; i++)
+		ids[i] = i;
+	qsort(ids, num_patterns, sizeof(*ids), pattern_cmp);
+
+	for (i = 0; i < num_patterns; i++) {
+		for (lcp = 0; prev[lcp] && prev[lcp] == patterns[ids[i]].str[lcp]; lcp++);
+		states += patterns[ids[i]].len - lcp;
+		prev    = patterns[ids[i]].str;
+	}
+	free(ids);
+	return states;
+}
+
+/**
+ * @brief Compiles all the added patterns into the automaton, must
+ * be called once, after all patterns were added.
+ */
+void ac_build(void)
+{
+	unsigned head, tail;
+	uint32_t *queue;
+	size_t max_states;
+	size_t mem;
+	unsigned s, u, f;
+
+	hit_words = (num_patterns + AC_WORD_BITS - 1) / AC_WORD_BITS;
+	if (!hit_words)
+		hit_words = 1;
+	ac_hits_init(&always_hits);
+
+	for (int i = 0; i < num_patterns; i++) {
+		if (!patterns[i].len) {
+			hits_set(&always_hits, i);
+			continue;
+		}
+		for (size_t j = 0; j < patterns[i].len; j++)
+			byte_class[(unsigned char)patterns[i].str[j]] = 1;
+	}
+
+	/* Nothing to match, ac_scan() only reports empty patterns. */
+	max_states = count_states();
+	if (max_states == 1)
+		return;
+
+	/* Byte classes, 0 for bytes not used by any pattern. */
+	num_classes = 1;
+	for (int i = 0; i < 256; i++)
+		if (byte_class[i])
+			byte_class[i] = num_classes++;
+
+	if ((uint64_t)max_states > UINT32_MAX || max_states > SIZE_MAX / num_classes /
+		sizeof(*delta))
+	{
+		panic("Substring patterns are too long (%zu states)!\n", max_states);
+	}
+
+	delta = calloc(max_states * num_classes, sizeof(*delta));
+	fail  = calloc(max_states, sizeof(*fail));
+	dict  = calloc(max_states, sizeof(*dict));
+	out   = malloc(max_states * sizeof(*out));
+	queue = malloc(max_states * sizeof(*queue));
+	if (!delta || !fail || !dict || !out || !queue)
+		panic("Unable to allocate the substring automaton!\n");
+
+	memset(out, -1, max_states * sizeof(*out));
+	num_states = 1;
+
+	for (int i = 0; i < num_patterns; i++)
+		if (patterns[i].len)
+			trie_insert(i);
+
+	/*
+	 * BFS over the trie: since the root never has a transition back
+	 * to itself, a 0 in the trie means 'no child'. Missing transitions
+	 * are then filled with the ones from the failure state, which is
+	 * always shallower, and thus already complete.
+	 */
+	head = tail = 0;
+	for (unsigned c = 0; c < num_classes; c++)
+		if ((u = delta[c]))
+			queue[tail++] = u;
+
+	while (head < tail) {
+		s = queue[head++];
+		for (unsigned c = 0; c < num_classes; c++) {
+			u = delta[s * num_classes + c];
+			f = delta[fail[s] * num_classes + c];
+			if (!u) {
+				delta[s * num_classes + c] = f;
+				continue;
+			}
+			fail[u] = f;
+			dict[u] = (out[f] >= 0) ? f : dict[f];
+			queue[tail++] = u;
+		}
+	}
+
+	free(queue);
+	free(fail);
+	fail = NULL;
+
+	mem = num_states * (num_classes * sizeof(*delta) + sizeof(*dict) +
+		sizeof(*out)) + num_patterns * sizeof(*patterns);
+
+	log_msg("Substring automaton: %d pattern(s), %u states, "
+			"%u byte classes, %zu KiB\n\n", num_patterns, num_states,
+			num_classes, (mem + 1023) / 1024);
+}
+
+/**
+ * @brief Initializes the hit set @p h, big enough for all the
+ * patterns: must be called after ac_build(), once per log event
+ * buffer.
+ */
+void ac_hits_init(struct ac_hits *h)
+{
+	if (!(h->bits = calloc(hit_words, sizeof(*h->bits))))
+		panic("Unable to allocate substring hits!\n");
+}
+
+/**
+ * @brief Scans the log event @p ev once, and saves the set of
+ * all matched substring patterns into ev->substr_hits.
+ *
+ * @param ev Log event to be scanned.
+ */
+void ac_scan(struct log_event *ev)
+{
+	const unsigned char *msg = (const unsigned char *)ev->msg;
+	size_t body_off = ev->hdr.body.off;
+	struct ac_pattern *p;
+	unsigned s, t;
+	size_t off;
+	int id;
+
+	memcpy(ev->substr_hits.bits, always_hits.bits,
+		hit_words * sizeof(*always_hits.bits));
+	if (!delta)
+		return;
+
+	if (num_patterns <= AC_MEMMEM_MAX) {
+		for (id = 0; id < num_patterns; id++) {
+			p   = &patterns[id];
+			off = p->on_body ? body_off : 0;
+			if (p->len && ms_memmem(ev->msg + off, ev->len - off, p->str, p->len))
+				hits_set(&ev->substr_hits, id);
+		}
+		return;
+	}
+
+	s = 0;
+	for (size_t i = 0; i < ev->len; i++) {
+		s = delta[s * num_classes + byte_class[msg[i]]];
+		t = (out[s] >= 0) ? s : dict[s];
+
+		for (; t; t = dict[t]) {
+			for (id = out[t]; id >= 0; id = p->next) {
+				p = &patterns[id];
+				if (!p->on_body || i + 1 - p->len >= body_off)
+					hits_set(&ev->substr_hits, id);
+			}
+		}
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef AHO_CORASICK_H
+#define AHO_CORASICK_H
+
+	#include <limits.h>
+	#include <stddef.h>
+
+	#define AC_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+	/*
+	 * Set of matched patterns, one bit per pattern id, sized after
+	 * all patterns are known: see ac_hits_init().
+	 */
+	struct ac_hits {
+		unsigned long *bits;
+	};
+
+	#define ac_hit(h, id) \
+		(((h)->bits[(id) / AC_WORD_BITS] >> ((id) % AC_WORD_BITS)) & 1)
+
+	struct log_event;
+
+	extern int ac_add_pattern(const char *str, int on_body);
+	extern void ac_build(void);
+	extern void ac_hits_init(struct ac_hits *h);
+	extern void ac_scan(struct log_event *ev);
+
+#endif /* AHO_CORASICK_H */
@@ -7,11 +7,23 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "aho_corasick.h"
+#include "breaker.h"
+#include "dedup.h"
+#include "digest.h"
 #include "events.h"
 #include "env_events.h"
+#include "forward.h"
 #include "log.h"
-#include "notifiers.h"
+#include "memsearch.h"
+#include "notify_queue.h"
+#include "outbox.h"
+#include "ratelimit.h"
+#include "re.h"
+#include "stats.h"
 #include "syslog.h"
+#include "syslog_tcp.h"
+#include "workers.h"
 
 /*
  * Alertik
@@ -21,24 +33,12 @@ static void *handle_messages(void *p)
 {
 	((void)p);
 
-	int handled = 0;
 	struct log_event ev = {0};
 
+	/* Matching and notifying happen in the workers, see workers.c. */
 	while (syslog_pop_msg_from_fifo(&ev) >= 0) {
-		print_log_event(&ev);
-
-		if (!is_within_notify_threshold()) {
-			log_msg("ignoring, reason: too many notifications!\n");
-			continue;
-		}
-
-		handled  = process_static_event(&ev);
-		handled += process_environment_event(&ev);
-
-		if (handled)
-			update_notify_last_sent();
-		else
-			log_msg("> Not handled!\n");
+		workers_dispatch(&ev);
+		syslog_release_msg(&ev);
 	}
 	return NULL;
 }
@@ -47,7 +47,6 @@ int main(void)
 {
 	pthread_t handler;
 	int ret;
-	int fd;
 
 	log_init();
 
@@ -55,6 +54,7 @@ int main(void)
 		"Alertik (" GIT_HASH ") (built at " __DATE__ " " __TIME__ ")\n");
 	log_msg("     (https://github.com/Theldus/alertik)\n");
 	log_msg("-------------------------------------------------\n");
+	log_msg("Substring search: %s\n", ms_impls_str[ms_init()]);
 
 	ret  = init_static_events();
 	ret += init_environment_events();
@@ -62,14 +62,30 @@ int main(void)
 		panic("No event was configured, please configure at least one\n"
 		      "before proceeding!\n");
 
-	syslog_init_forward();
-
-	fd = syslog_create_udp_socket();
+	ac_build();
+	if ((ret = rule_regset_build()) < 0)
+		log_msg("Unable to build regex sets, matching rules one by one!\n");
+	else if (ret)
+		log_msg("Regex sets: %d rule(s)\n\n", ret);
+	forward_init();
+	rl_init();
+	notify_queue_init();
+	breaker_init();
+	outbox_init();
+	digest_init();
+	dedup_init();
+	workers_init();
+	stats_init();
+
+	syslog_init_receivers();
+	syslog_tcp_init();
 	if (pthread_create(&handler, NULL, handle_messages, NULL))
 		panic_errno("Unable to create hanler thread!");
 
-	log_msg("Waiting for messages at :%d (UDP)...\n", SYSLOG_PORT);
+	syslog_start_receivers();
+	log_msg("Waiting for messages at :%d...\n", SYSLOG_PORT);
 
-	while (syslog_enqueue_new_upd_msg(fd) >= 0);
+	/* The main thread is also the first receiver. */
+	while (syslog_enqueue_new_upd_msg(0) >= 0);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,261 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "breaker.h"
+#include "log.h"
+#include "notifiers.h"
+#include "stats.h"
+#include "syslog.h"
+
+/*
+ * Circuit breakers
+ *
+ * Each notifier has a circuit breaker: after BREAKER_FAILURES
+ * consecutive failed requests (see notify_retryable()), it opens, and
+ * the notifier is not used for BREAKER_SECS seconds: its alerts go
+ * through its fallback notifier instead (<NOTIFIER>_FALLBACK, if
+ * any), or wait in the outbox. Then, it half-opens: a single request
+ * is sent as a probe, and its outcome either closes the breaker
+ * again, or opens it for another BREAKER_SECS.
+ *
+ * So, a dead webhook costs a handful of timeouts, and not one per
+ * alert, while the other notifiers keep working as usual.
+ */
+
+static const char *const states_str[BRK_STATES] = {
+	"closed", "open", "half-open"
+};
+
+static struct breaker {
+	int    state;
+	int    failures;  /* Consecutive failures.           */
+	int    probing;   /* Probe in flight, if half-open.  */
+	time_t opened;    /* Monotonic secs.                 */
+	int    fallback;  /* Notifier index, -1 if none.     */
+
+	/* Statistics. */
+	stat_t opens;
+	stat_t half_opens;
+	stat_t closes;
+	stat_t short_circuits; /* Requests not sent, while open.  */
+	stat_t fallbacks;      /* Requests sent through fallback. */
+} breakers[NUM_NOTIFIERS];
+
+static int max_failures;
+static unsigned open_secs;
+
+static pthread_mutex_t brk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Returns the current monotonic time, in seconds.
+ */
+static time_t now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * @brief Dumps the breakers statistics, for each notifier that ever
+ * opened its breaker.
+ */
+static void breaker_dump_stats(void)
+{
+	struct breaker *b;
+	int state;
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		b = &breakers[i];
+		if (!stat_get(b->opens))
+			continue;
+
+		pthread_mutex_lock(&brk_mutex);
+			state = b->state;
+		pthread_mutex_unlock(&brk_mutex);
+
+		log_msg("  %-8s state: %s, opened/half-opened/closed: %lu / %lu / %lu, "
+			"short-circuited: %lu, through fallback: %lu\n", notifiers_str[i],
+			states_str[state], stat_get(b->opens), stat_get(b->half_opens),
+			stat_get(b->closes), stat_get(b->short_circuits),
+			stat_get(b->fallbacks));
+	}
+}
+
+/**
+ * @brief Checks whether the notifier @p notif_idx might send a
+ * request now: if closed, or if half-open and no probe is in flight
+ * (the request then becomes the probe). Must be called with the
+ * mutex held.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+static int allow(int notif_idx, time_t now)
+{
+	struct breaker *b = &breakers[notif_idx];
+
+	if (b->state == BRK_OPEN && now - b->opened >= (time_t)open_secs) {
+		b->state   = BRK_HALF_OPEN;
+		b->probing = 0;
+		stat_inc(b->half_opens);
+		log_msg("> Circuit for %s half-open, probing...\n",
+			notifiers_str[notif_idx]);
+	}
+
+	if (b->state == BRK_CLOSED)
+		return 1;
+	if (b->state == BRK_HALF_OPEN && !b->probing) {
+		b->probing = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Chooses the notifier through which a request meant for
+ * @p notif_idx should be sent: itself if its breaker allows it,
+ * otherwise its fallback, if any and allowed.
+ *
+ * @return Returns the notifier index, or -1 if the request should
+ * not be sent now.
+ */
+int breaker_route(int notif_idx)
+{
+	struct breaker *b = &breakers[notif_idx];
+	time_t now;
+	int idx;
+
+	if (!max_failures)
+		return notif_idx;
+
+	now = now_secs();
+	pthread_mutex_lock(&brk_mutex);
+		if (allow(notif_idx, now))
+			idx = notif_idx;
+		else if (b->fallback >= 0 && allow(b->fallback, now))
+			idx = b->fallback;
+		else
+			idx = -1;
+	pthread_mutex_unlock(&brk_mutex);
+
+	if (idx != notif_idx)
+		stat_inc(b->short_circuits);
+	if (idx >= 0 && idx != notif_idx)
+		stat_inc(b->fallbacks);
+	return idx;
+}
+
+/**
+ * @brief Accounts the outcome of a request of the notifier
+ * @p notif_idx, @p ok if it succeeded, opening or closing its
+ * breaker as needed.
+ */
+void breaker_result(int notif_idx, int ok)
+{
+	struct breaker *b = &breakers[notif_idx];
+	int failures;
+
+	if (!max_failures)
+		return;
+
+	pthread_mutex_lock(&brk_mutex);
+		failures   = ++b->failures;
+		b->probing = 0;
+
+		if (ok) {
+			b->failures = 0;
+			if (b->state != BRK_CLOSED) {
+				b->state = BRK_CLOSED;
+				stat_inc(b->closes);
+				log_msg("> Circuit for %s closed, back to normal\n",
+					notifiers_str[notif_idx]);
+			}
+		}
+
+		else if (b->state == BRK_HALF_OPEN ||
+			(b->state == BRK_CLOSED && failures >= max_failures))
+		{
+			b->state  = BRK_OPEN;
+			b->opened = now_secs();
+			stat_inc(b->opens);
+			log_msg("> Circuit for %s open after %d failure(s), for %us\n",
+				notifiers_str[notif_idx], failures, open_secs);
+		}
+	pthread_mutex_unlock(&brk_mutex);
+}
+
+/**
+ * @brief Gives back the request allowed by breaker_route() for the
+ * notifier @p notif_idx, that was not sent after all (failed locally,
+ * such as a full queue): it says nothing about the endpoint, so it is
+ * not accounted, but a half-open breaker might probe again.
+ */
+void breaker_release(int notif_idx)
+{
+	if (!max_failures)
+		return;
+
+	pthread_mutex_lock(&brk_mutex);
+		breakers[notif_idx].probing = 0;
+	pthread_mutex_unlock(&brk_mutex);
+}
+
+/**
+ * @brief Reads the BREAKER_FAILURES, BREAKER_SECS and
+ * <NOTIFIER>_FALLBACK environment vars (if any): must be called
+ * after the notifiers were set up.
+ */
+void breaker_init(void)
+{
+	struct notifier *fb;
+	char var[64];
+	char *env;
+	int i, j;
+
+	max_failures = syslog_get_env_int("BREAKER_FAILURES",
+		BREAKER_FAILURES_DEFAULT, 0, BREAKER_FAILURES_MAX);
+	open_secs    = syslog_get_env_int("BREAKER_SECS",
+		BREAKER_SECS_DEFAULT, 1, BREAKER_SECS_MAX);
+
+	if (!max_failures) {
+		log_msg("Circuit breakers: disabled\n\n");
+		return;
+	}
+
+	log_msg("Circuit breakers: open after %d failures, for %us\n",
+		max_failures, open_secs);
+
+	for (i = 0; i < NUM_NOTIFIERS; i++) {
+		breakers[i].fallback = -1;
+
+		snprintf(var, sizeof var, "%s_FALLBACK", notifiers_env[i]);
+		if (!notifiers[i].ready || !(env = getenv(var)))
+			continue;
+
+		for (j = 0; j < NUM_NOTIFIERS; j++)
+			if (!strcmp(env, notifiers_str[j]))
+				break;
+		if (j == NUM_NOTIFIERS || j == i)
+			panic("Invalid %s (%s)!\n", var, env);
+
+		/* Try to setup notifier if not yet. */
+		fb = &notifiers[j];
+		fb->setup(fb);
+
+		breakers[i].fallback = j;
+		log_msg("  %-8s falls back to %s\n", notifiers_str[i],
+			notifiers_str[j]);
+	}
+	log_msg("\n");
+
+	stats_register("breaker", breaker_dump_stats);
+}
@@ -0,0 +1,28 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+	/* Default (and maximum) consecutive failures to open, 0 disables. */
+	#define BREAKER_FAILURES_DEFAULT 5
+	#define BREAKER_FAILURES_MAX     1000
+
+	/* Default (and maximum) time open, before probing, in secs. */
+	#define BREAKER_SECS_DEFAULT     30
+	#define BREAKER_SECS_MAX         3600
+
+	/* Breaker states. */
+	#define BRK_CLOSED    0 /* Sending as usual.            */
+	#define BRK_OPEN      1 /* Not sending.                 */
+	#define BRK_HALF_OPEN 2 /* Sending a single probe.      */
+	#define BRK_STATES    3
+
+	extern int breaker_route(int notif_idx);
+	extern void breaker_result(int notif_idx, int ok);
+	extern void breaker_release(int notif_idx);
+	extern void breaker_init(void);
+
+#endif /* BREAKER_H */
@@ -0,0 +1,254 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "log.h"
+#include "notifiers.h"
+#include "stats.h"
+#include "str.h"
+#include "syslog.h"
+#include "workers.h"
+
+/*
+ * Alert deduplication
+ *
+ * Routers often log the very same line over and over, so each alert
+ * has a key: its rule and the data it extracted from the message
+ * (regex captures, or the MAC address and interface of a WiFi login
+ * attempt). The first alert of a key is sent as usual, and its
+ * repeats within the next DEDUP_WINDOW seconds only bump a counter:
+ * once the window is over, a single summary is sent, such as:
+ *
+ *   <first alert> (seen 37 times in 300s)
+ *
+ * Keys live in a fixed-size, open addressing table (DEDUP_SLOTS,
+ * linear probing), from which a thread evicts them once per second
+ * as their window ends. If the table is full, alerts are simply not
+ * deduplicated.
+ */
+
+struct dd_entry {
+	uint64_t key;          /* 0 if free.                 */
+	uint64_t alert;        /* Alert key, as given.       */
+	time_t   first;        /* Monotonic secs.            */
+	unsigned count;        /* Alerts, including the first. */
+	int      rl_id;
+	unsigned notifiers;    /* Notifiers mask.            */
+	char     text[DEDUP_TEXT_LEN]; /* First alert.        */
+};
+
+static struct dd_entry *table;
+static unsigned num_slots; /* Power of 2. */
+static unsigned num_used;
+static unsigned window;
+
+static pthread_mutex_t dd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics. */
+static stat_t suppressed; /* Repeats, not sent.            */
+static stat_t summaries;  /* Summaries sent.               */
+static stat_t table_full; /* Alerts not deduplicated.      */
+
+/**
+ * @brief Returns the current monotonic time, in seconds.
+ */
+static time_t now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * @brief Dumps the dedup statistics.
+ */
+static void dedup_dump_stats(void)
+{
+	unsigned used;
+
+	pthread_mutex_lock(&dd_mutex);
+		used = num_used;
+	pthread_mutex_unlock(&dd_mutex);
+
+	log_msg("  tracked (slots) : %u (%u)\n", used, num_slots);
+	log_msg("  suppressed      : %lu\n", stat_get(suppressed));
+	log_msg("  summaries       : %lu\n", stat_get(summaries));
+	log_msg("  table full      : %lu\n", stat_get(table_full));
+}
+
+/**
+ * @brief Mixes the rule @p rl_id into the alert @p key, and spreads
+ * its bits, for the table index.
+ */
+static uint64_t mix_key(uint64_t key, int rl_id)
+{
+	key ^= (uint64_t)(rl_id + 1) * 0x9e3779b97f4a7c15ULL;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key ? key : 1;
+}
+
+/**
+ * @brief Removes the entry at @p i, moving back the entries after
+ * it that would no longer be found otherwise (no tombstones).
+ */
+static void dd_remove(unsigned i)
+{
+	unsigned mask = num_slots - 1;
+	unsigned j    = i;
+	unsigned home;
+
+	while (1) {
+		j = (j + 1) & mask;
+		if (!table[j].key)
+			break;
+
+		/* Moves it if its home slot is not in (i, j]. */
+		home = table[j].key & mask;
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].key = 0;
+	num_used--;
+}
+
+/**
+ * @brief Checks whether the alert @p msg, with key @p key, of the
+ * rule @p rl_id, was already sent (through @p notifiers) within the
+ * window: if so, counts it, otherwise starts tracking it.
+ *
+ * @return Returns 1 if a repeat (not to be sent), 0 otherwise.
+ */
+int dedup_seen(uint64_t key, int rl_id, unsigned notifiers, const char *msg)
+{
+	unsigned mask = num_slots - 1;
+	uint64_t alert = key;
+	struct dd_entry *e;
+	unsigned i, n;
+
+	if (!window)
+		return 0;
+
+	key = mix_key(key, rl_id);
+
+	pthread_mutex_lock(&dd_mutex);
+		for (i = key & mask, n = 0; n < num_slots; n++, i = (i + 1) & mask) {
+			e = &table[i];
+			if (!e->key)
+				break;
+			if (e->key == key && e->rl_id == rl_id) {
+				e->count++;
+				pthread_mutex_unlock(&dd_mutex);
+				stat_inc(suppressed);
+				return 1;
+			}
+		}
+
+		if (n == num_slots) {
+			pthread_mutex_unlock(&dd_mutex);
+			stat_inc(table_full);
+			return 0;
+		}
+
+		e->key       = key;
+		e->alert     = alert;
+		e->first     = now_secs();
+		e->count     = 1;
+		e->rl_id     = rl_id;
+		e->notifiers = notifiers;
+		snprintf(e->text, sizeof e->text, "%s", msg);
+		num_used++;
+	pthread_mutex_unlock(&dd_mutex);
+	return 0;
+}
+
+/**
+ * @brief Dedup thread: once per second, evicts the alerts whose
+ * window is over, and sends the summary of the repeated ones.
+ */
+static void *dedup_thread(void *p)
+{
+	((void)p);
+	char names[NOTIFIERS_NAMES_LEN];
+	struct str_ab summary;
+	struct dd_entry e;
+	time_t now;
+	unsigned i;
+
+	while (1) {
+		sleep(1);
+		now = now_secs();
+
+		for (i = 0; i < num_slots; ) {
+			pthread_mutex_lock(&dd_mutex);
+				if (!table[i].key || now - table[i].first < (time_t)window) {
+					pthread_mutex_unlock(&dd_mutex);
+					i++;
+					continue;
+				}
+				/* Another entry might move into i, so check it again. */
+				e = table[i];
+				dd_remove(i);
+			pthread_mutex_unlock(&dd_mutex);
+
+			if (e.count < 2)
+				continue;
+
+			ab_init(&summary);
+			if (ab_append_fmt(&summary, "%s (seen %u times in %lds)", e.text,
+				e.count, (long)(now - e.first)))
+			{
+				continue;
+			}
+
+			log_msg("> Alert through %s repeated %u times, sending summary\n",
+				notifiers_names(e.notifiers, names), e.count);
+			stat_inc(summaries);
+			workers_emit(e.rl_id, e.notifiers, e.alert, summary.buff);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reads the DEDUP_WINDOW and DEDUP_SLOTS environment vars
+ * (if any), and starts the dedup thread, unless disabled.
+ */
+void dedup_init(void)
+{
+	pthread_t thread;
+	unsigned slots;
+
+	window = syslog_get_env_int("DEDUP_WINDOW", DEDUP_WINDOW_DEFAULT, 0,
+		DEDUP_WINDOW_MAX);
+	slots  = syslog_get_env_int("DEDUP_SLOTS", DEDUP_SLOTS_DEFAULT, 1,
+		DEDUP_SLOTS_MAX);
+
+	if (!window) {
+		log_msg("Dedup: disabled\n\n");
+		return;
+	}
+
+	for (num_slots = 1; num_slots < slots; num_slots *= 2);
+	if (!(table = calloc(num_slots, sizeof(*table))))
+		panic("Unable to allocate the dedup table!\n");
+
+	log_msg("Dedup: %us window, %u slots (%zu KiB)\n\n", window, num_slots,
+		(num_slots * sizeof(*table) + 1023) / 1024);
+
+	stats_register("dedup", dedup_dump_stats);
+	if (pthread_create(&thread, NULL, dedup_thread, NULL))
+		panic_errno("Unable to create dedup thread!");
+}
@@ -0,0 +1,46 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	/* Default (and maximum) window, in seconds, 0 disables dedup. */
+	#define DEDUP_WINDOW_DEFAULT 300
+	#define DEDUP_WINDOW_MAX     86400
+
+	/* Default (and maximum) amount of alerts tracked at once. */
+	#define DEDUP_SLOTS_DEFAULT  512
+	#define DEDUP_SLOTS_MAX      65536
+
+	/* Maximum length of the alert text kept for the summary. */
+	#define DEDUP_TEXT_LEN       192
+
+	/* Initial value of an alert key. */
+	#define DEDUP_KEY_INIT 0xcbf29ce484222325ULL
+
+	/**
+	 * @brief Adds the @p len bytes at @p s (such as a regex capture)
+	 * to the alert @p key (FNV-1a), and returns the new key.
+	 */
+	static inline uint64_t dedup_key(uint64_t key, const char *s, size_t len)
+	{
+		while (len--) {
+			key ^= (unsigned char)*s++;
+			key *= 0x100000001b3ULL;
+		}
+		/* Field separator. */
+		key ^= 0xff;
+		key *= 0x100000001b3ULL;
+		return key;
+	}
+
+	extern int dedup_seen(uint64_t key, int rl_id, unsigned notifiers,
+		const char *msg);
+	extern void dedup_init(void);
+
+#endif /* DEDUP_H */
@@ -0,0 +1,303 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "digest.h"
+#include "log.h"
+#include "notifiers.h"
+#include "outbox.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "str.h"
+#include "syslog.h"
+
+/*
+ * Notification digests
+ *
+ * Alerts over their rate limit (see ratelimit.c) are not dropped,
+ * but coalesced per notifier: once DIGEST_WINDOW seconds have passed
+ * since the first of them (or DIGEST_MAX alerts were collected, if
+ * sooner), a single notification summarizes them all, such as:
+ *
+ *   12 alerts in the last 60s: 9x EVENT0 from 4 sources, 3x EVENT2
+ *   - <first alert>
+ *   - <second alert>
+ *   - <third alert>
+ *   (+9 more)
+ *
+ * The sources of a rule are its distinct alert keys (see dedup.h),
+ * i.e., the distinct data extracted from its alerts, such as the IP
+ * of a failed login. Rules that extract nothing have no sources. Up
+ * to DIGEST_KEYS of them are counted per digest, in a small open
+ * addressing table: past that, the count is a lower bound ('4+').
+ *
+ * Digests are sent from their own thread, which checks the windows
+ * once per second, and are not rate limited themselves: there is at
+ * most one per notifier and window.
+ */
+
+struct digest_rule {
+	int      rl_id;
+	unsigned count;
+	unsigned sources;             /* Distinct alert keys.         */
+	int      capped;              /* Whether keys were left out.  */
+};
+
+static struct digest {
+	unsigned count;               /* Alerts so far, 0 if empty.   */
+	struct timespec first;        /* First alert (window start).  */
+	struct digest_rule rules[DIGEST_RULES];
+	int      num_rules;
+	unsigned others;              /* Alerts from unlisted rules.  */
+	char     samples[DIGEST_SAMPLES_MAX][DIGEST_SAMPLE_LEN];
+	int      num_samples;
+	uint64_t keys[DIGEST_KEYS];   /* Rule and alert keys, 0 if free. */
+	unsigned num_keys;
+
+	/* Statistics. */
+	stat_t alerts;
+	stat_t sent;
+	stat_t failed;
+} digests[NUM_NOTIFIERS];
+
+static unsigned window;
+static unsigned max_alerts;
+static int max_samples;
+
+static pthread_mutex_t digest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Dumps the digest statistics, for each notifier used so far.
+ */
+static void digest_dump_stats(void)
+{
+	struct digest *d;
+	unsigned pending;
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		d = &digests[i];
+		if (!stat_get(d->alerts))
+			continue;
+
+		pthread_mutex_lock(&digest_mutex);
+			pending = d->count;
+		pthread_mutex_unlock(&digest_mutex);
+
+		log_msg("  %-14s alerts/digests: %lu / %lu, failed: %lu, "
+			"pending: %u\n", notifiers_str[i], stat_get(d->alerts),
+			stat_get(d->sent), stat_get(d->failed), pending);
+	}
+}
+
+/**
+ * @brief Counts the alert key @p key as a source of the rule @p r of
+ * the digest @p d, unless already there. The table is kept at most
+ * 3/4 full.
+ */
+static void add_source(struct digest *d, struct digest_rule *r,
+	uint64_t key)
+{
+	unsigned mask = DIGEST_KEYS - 1;
+	unsigned i;
+
+	/* Rule, into the key: spread, for the table index. */
+	key ^= (uint64_t)(r->rl_id + 1) * 0x9e3779b97f4a7c15ULL;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key  = key ? key : 1;
+
+	for (i = key & mask; d->keys[i]; i = (i + 1) & mask)
+		if (d->keys[i] == key)
+			return;
+
+	if (d->num_keys >= DIGEST_KEYS / 4 * 3) {
+		r->capped = 1;
+		return;
+	}
+	d->keys[i] = key;
+	d->num_keys++;
+	r->sources++;
+}
+
+/**
+ * @brief Coalesces the alert @p msg, from the rule @p rl_id and with
+ * the alert key @p key, into the digest of the notifier @p notif_idx.
+ *
+ * @return Returns 0 if coalesced, -1 if digests are disabled.
+ */
+int digest_add(int rl_id, uint64_t key, int notif_idx, const char *msg)
+{
+	struct digest *d = &digests[notif_idx];
+	int i;
+
+	if (!window)
+		return -1;
+
+	pthread_mutex_lock(&digest_mutex);
+		if (!d->count++)
+			clock_gettime(CLOCK_MONOTONIC, &d->first);
+
+		for (i = 0; i < d->num_rules; i++)
+			if (d->rules[i].rl_id == rl_id)
+				break;
+
+		if (i < d->num_rules)
+			d->rules[i].count++;
+		else if (i < DIGEST_RULES) {
+			d->rules[i].rl_id   = rl_id;
+			d->rules[i].count   = 1;
+			d->rules[i].sources = 0;
+			d->rules[i].capped  = 0;
+			d->num_rules++;
+		}
+		else
+			d->others++;
+
+		/* Nothing extracted, no source. */
+		if (i < DIGEST_RULES && key != DEDUP_KEY_INIT)
+			add_source(d, &d->rules[i], key);
+
+		if (d->num_samples < max_samples)
+			snprintf(d->samples[d->num_samples++], DIGEST_SAMPLE_LEN,
+				"%s", msg);
+	pthread_mutex_unlock(&digest_mutex);
+
+	stat_inc(d->alerts);
+	return 0;
+}
+
+/**
+ * @brief Formats the digest @p d, spanning @p secs seconds, into
+ * @p ab, and empties it.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int build_digest(struct digest *d, unsigned secs, struct str_ab *ab)
+{
+	struct digest_rule *r;
+	int ret;
+	int i;
+
+	ab_init(ab);
+	ret = ab_append_fmt(ab, "%u alert%s in the last %us:", d->count,
+		(d->count > 1) ? "s" : "", secs);
+
+	for (i = 0; !ret && i < d->num_rules; i++) {
+		r   = &d->rules[i];
+		ret = ab_append_fmt(ab, "%s %ux %s", i ? "," : "", r->count,
+			rl_rule_name(r->rl_id));
+		if (!ret && r->sources) {
+			ret = ab_append_fmt(ab, " from %u%s source%s", r->sources,
+				r->capped ? "+" : "", (r->sources > 1) ? "s" : "");
+		}
+	}
+	if (!ret && d->others)
+		ret = ab_append_fmt(ab, ", %ux others", d->others);
+
+	for (i = 0; !ret && i < d->num_samples; i++)
+		ret = ab_append_fmt(ab, "\n- %s", d->samples[i]);
+	if (!ret && d->count > (unsigned)d->num_samples)
+		ret = ab_append_fmt(ab, "\n(+%u more)", d->count - d->num_samples);
+
+	d->count       = 0;
+	d->num_rules   = 0;
+	d->others      = 0;
+	d->num_samples = 0;
+	if (d->num_keys) {
+		memset(d->keys, 0, sizeof(d->keys));
+		d->num_keys = 0;
+	}
+	return ret ? -1 : 0;
+}
+
+/**
+ * @brief Digest thread: once per second, sends the digests whose
+ * window is over, or that are full.
+ */
+static void *digest_thread(void *p)
+{
+	((void)p);
+	struct timespec now;
+	struct str_ab msg;
+	struct digest *d;
+	unsigned count;
+	unsigned secs;
+	int ret;
+
+	while (1) {
+		sleep(1);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (int i = 0; i < NUM_NOTIFIERS; i++) {
+			d = &digests[i];
+
+			pthread_mutex_lock(&digest_mutex);
+				secs = now.tv_sec - d->first.tv_sec;
+				if (!d->count || (secs < window && d->count < max_alerts)) {
+					pthread_mutex_unlock(&digest_mutex);
+					continue;
+				}
+				count = d->count;
+				ret   = build_digest(d, secs ? secs : 1, &msg);
+			pthread_mutex_unlock(&digest_mutex);
+
+			if (ret < 0) {
+				log_msg("Unable to build the digest of %u alerts for %s!\n",
+					count, notifiers_str[i]);
+				stat_inc(d->failed);
+				continue;
+			}
+
+			log_msg("> Sending digest of %u alert(s) through %s\n", count,
+				notifiers_str[i]);
+
+			if (outbox_send(i, msg.buff) < 0) {
+				log_msg("unable to send the digest through %s\n",
+					notifiers_str[i]);
+				stat_inc(d->failed);
+			}
+			else
+				stat_inc(d->sent);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reads the DIGEST_WINDOW, DIGEST_MAX and DIGEST_SAMPLES
+ * environment vars (if any) and starts the digest thread, unless
+ * digests are disabled.
+ */
+void digest_init(void)
+{
+	pthread_t thread;
+
+	window      = syslog_get_env_int("DIGEST_WINDOW", DIGEST_WINDOW_DEFAULT,
+		0, DIGEST_WINDOW_MAX);
+	max_alerts  = syslog_get_env_int("DIGEST_MAX", DIGEST_MAX_DEFAULT,
+		1, DIGEST_MAX_MAX);
+	max_samples = syslog_get_env_int("DIGEST_SAMPLES", DIGEST_SAMPLES_DEFAULT,
+		0, DIGEST_SAMPLES_MAX);
+
+	if (!window) {
+		log_msg("Digests: disabled, alerts over the rate limits are dropped\n\n");
+		return;
+	}
+
+	log_msg("Digests: every %us or %u alerts, with %d sample(s)\n\n",
+		window, max_alerts, max_samples);
+
+	stats_register("digest", digest_dump_stats);
+	if (pthread_create(&thread, NULL, digest_thread, NULL))
+		panic_errno("Unable to create digest thread!");
+}
@@ -0,0 +1,34 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+	#include <stdint.h>
+
+	/* Default (and maximum) window, in seconds, 0 disables digests. */
+	#define DIGEST_WINDOW_DEFAULT  60
+	#define DIGEST_WINDOW_MAX      3600
+
+	/* Default (and maximum) amount of alerts per digest. */
+	#define DIGEST_MAX_DEFAULT     100
+	#define DIGEST_MAX_MAX         10000
+
+	/* Default (and maximum) amount of sample alerts per digest. */
+	#define DIGEST_SAMPLES_DEFAULT 3
+	#define DIGEST_SAMPLES_MAX     5
+
+	/* Maximum length of each sample, and of rules listed. */
+	#define DIGEST_SAMPLE_LEN      160
+	#define DIGEST_RULES           8
+
+	/* Distinct alert keys (sources) counted per digest, power of 2. */
+	#define DIGEST_KEYS            256
+
+	extern int digest_add(int rl_id, uint64_t key, int notif_idx,
+		const char *msg);
+	extern void digest_init(void);
+
+#endif /* DIGEST_H */
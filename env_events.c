@@ -13,8 +13,12 @@
 #include "log.h"
 #include "events.h"
 #include "env_events.h"
+#include "dedup.h"
 #include "notifiers.h"
+#include "ratelimit.h"
 #include "str.h"
+#include "syslog_parse.h"
+#include "workers.h"
 
 /*
  * Environment events
@@ -27,9 +31,14 @@
 #define MATCH_TYPES_LEN 2
 static const char *const match_types[] = {"substr", "regex"};
 
-/* Environment events list. */
+/* Event match parts. */
+#define MATCH_ON_LEN 2
+static const char *const match_on[] = {"msg", "body"};
+
+/* Environment events list, and its index. */
 static int num_env_events;
-struct env_event env_events[MAX_ENV_EVENTS] = {0};
+static struct env_event *env_events;
+static struct rule_index env_index;
 
 /**
  * Safe string-to-int routine that takes into account:
@@ -84,6 +93,22 @@ static char *get_event_str(int ev_num, char *str)
 	return env;
 }
 
+/**
+ * @brief Retrieves the optional event string from the environment
+ * variables.
+ *
+ * @param ev_num Event number.
+ * @param str    String identifier.
+ *
+ * @return Returns the event string, or NULL if not set.
+ */
+static char *get_event_opt_str(int ev_num, char *str)
+{
+	char ev[64] = {0};
+	snprintf(ev, sizeof ev - 1, "EVENT%d_%s", ev_num, str);
+	return getenv(ev);
+}
+
 /**
  * @brief Retrieves the index of the event from the environment variables.
  *
@@ -105,6 +130,24 @@ get_event_idx(int ev_num, char *str, const char *const *str_list, int size)
 	panic("String parameter (%s) invalid for %s\n", env, str);
 }
 
+/**
+ * @brief Retrieves the notifiers of the event from the environment
+ * variables, a comma-separated list (like 'Telegram,Slack').
+ *
+ * @param ev_num Event number.
+ *
+ * @return Returns the notifiers mask.
+ */
+static unsigned get_event_notifiers(int ev_num)
+{
+	char *env = get_event_str(ev_num, "NOTIFIER");
+	unsigned mask;
+
+	if (notifiers_parse(env, &mask) < 0)
+		panic("String parameter (%s) invalid for NOTIFIER\n", env);
+	return mask;
+}
+
 /**
  * @brief Handles match replacement in the event mask message.
  *
@@ -113,7 +156,7 @@ get_event_idx(int ev_num, char *str, const char *const *str_list, int size)
  * @param e_msk   End of the mask message.
  * @param pmatch  Array of regex matches.
  * @param env     Pointer to the environment event.
- * @param log_ev  Pointer to the log event.
+ * @param subject Matched string (whole message or body).
  *
  * @return Returns 1 if the replacement was handled, 0 otherwise.
  */
@@ -122,7 +165,7 @@ static int handle_match_replacement(
 	const char **c_msk, const char *e_msk,
 	regmatch_t *pmatch,
 	struct env_event *env,
-	struct log_event *log_ev)
+	const char *subject)
 {
 	const char *c = *c_msk;
 	const char *e =  e_msk;
@@ -152,7 +195,7 @@ static int handle_match_replacement(
 	off = pmatch[match].rm_so;
 	len = pmatch[match].rm_eo - off;
 
-	if (ab_append_str(notif_message, log_ev->msg + off, len) < 0)
+	if (ab_append_str(notif_message, subject + off, len) < 0)
 		return 0;
 
 	return 1;
@@ -164,7 +207,7 @@ static int handle_match_replacement(
  *
  * @param env       Pointer to the environment event.
  * @param pmatch    Array of regex matches.
- * @param log_ev    Pointer to the log event.
+ * @param subject   Matched string (whole message or body).
  * @param buf       Buffer to store the masked message.
  * @param buf_size  Size of the buffer.
  *
@@ -172,7 +215,7 @@ static int handle_match_replacement(
  */
 static int
 create_masked_message(struct env_event *env, regmatch_t *pmatch,
-	struct log_event *log_ev, struct str_ab *notif_message)
+	const char *subject, struct str_ab *notif_message)
 {
 	const char *c_msk, *e_msk;
 
@@ -216,7 +259,7 @@ create_masked_message(struct env_event *env, regmatch_t *pmatch,
 		{
 			c_msk++;
 			if (!handle_match_replacement(notif_message, &c_msk, e_msk,
-				pmatch, env, log_ev))
+				pmatch, env, subject))
 			{
 				break;
 			}
@@ -227,6 +270,38 @@ create_masked_message(struct env_event *env, regmatch_t *pmatch,
 	return (*c_msk == '\0');
 }
 
+/**
+ * @brief Returns the part of the log event @p ev that the
+ * environment event @p env_ev matches against.
+ */
+static inline const char *
+event_subject(const struct env_event *env_ev, const struct log_event *ev)
+{
+	if (env_ev->ev_match_on == MATCH_ON_BODY)
+		return ev->msg + ev->hdr.body.off;
+	return ev->msg;
+}
+
+/**
+ * @brief Returns the dedup key of a match of the environment event
+ * @p env_ev on @p subject: its capture groups, if any.
+ */
+static uint64_t
+capture_key(const struct env_event *env_ev, const char *subject,
+	const regmatch_t *pmatch)
+{
+	uint64_t key = DEDUP_KEY_INIT;
+
+	for (size_t i = 1; i <= env_ev->regex.re_nsub && i < MAX_MATCHES; i++) {
+		if (pmatch[i].rm_so < 0)
+			key = dedup_key(key, "", 0);
+		else
+			key = dedup_key(key, subject + pmatch[i].rm_so,
+				pmatch[i].rm_eo - pmatch[i].rm_so);
+	}
+	return key;
+}
+
 /**
  * @brief Handles a log event with a regex match.
  *
@@ -240,24 +315,35 @@ static int handle_regex(struct log_event *ev, int idx_env)
 	char time_str[32]               = {0};
 	regmatch_t pmatch[MAX_MATCHES]  = {0};
 	struct str_ab notif_message;
-	struct notifier *self;
+	const char *subject;
 
+	char names[NOTIFIERS_NAMES_LEN];
 	int ret;
-	int notif_idx;
 	struct env_event *env_ev;
 
 	env_ev    = &env_events[idx_env];
-	notif_idx = env_ev->ev_notifier_idx;
-	self      = &notifiers[notif_idx];
 
-	if (regexec(&env_ev->regex, ev->msg, MAX_MATCHES, pmatch, 0) == REG_NOMATCH)
+	if (!prefilter_pass(&env_ev->pf, ev))
+		return 0;
+
+	/* Combined automaton: a single pass for all regex rules. */
+	if (!rule_regset_pass(&env_ev->regex, &ev->regex_hits, ev->msg,
+		ev->msg + ev->hdr.body.off))
+	{
+		return 0;
+	}
+
+	subject   = event_subject(env_ev, ev);
+
+	if (rule_regexec(&env_ev->regex, subject, MAX_MATCHES, pmatch) == REG_NOMATCH)
 		return 0;
 
 	log_msg("> Environment event detected!\n");
 	log_msg(">   type         : regex\n");
 	log_msg(">   expr         : %s\n",  env_ev->ev_match_str);
 	log_msg(">   amnt sub expr: %zu\n", env_ev->regex.re_nsub);
-	log_msg(">   notifier     : %s\n",  notifiers_str[notif_idx]);
+	log_msg(">   notifier     : %s\n",
+		notifiers_names(env_ev->ev_notifiers, names));
 
 	ab_init(&notif_message);
 
@@ -265,7 +351,7 @@ static int handle_regex(struct log_event *ev, int idx_env)
 	 * the message.
 	 */
 	if (env_ev->regex.re_nsub) {
-		if (!create_masked_message(env_ev, pmatch, ev, &notif_message)) {
+		if (!create_masked_message(env_ev, pmatch, subject, &notif_message)) {
 			log_msg("Unable to create masked message!\n");
 			return 0;
 		}
@@ -287,11 +373,8 @@ static int handle_regex(struct log_event *ev, int idx_env)
 			return 0;
 	}
 
-	if (self->send_notification(self, notif_message.buff) < 0) {
-		log_msg("unable to send the notification through %s\n",
-			notifiers_str[notif_idx]);
-	}
-
+	worker_notify(env_ev->rl_id, env_ev->ev_notifiers,
+		capture_key(env_ev, subject, pmatch), notif_message.buff);
 	return 1;
 }
 
@@ -306,23 +389,20 @@ static int handle_regex(struct log_event *ev, int idx_env)
 static int handle_substr(struct log_event *ev, int idx_env)
 {
 	int ret;
-	int notif_idx;
 	char time_str[32] = {0};
+	char names[NOTIFIERS_NAMES_LEN];
 
-	struct notifier *self;
 	struct env_event *env_ev;
 	struct str_ab notif_message;
 
 	env_ev    = &env_events[idx_env];
-	notif_idx = env_ev->ev_notifier_idx;
-	self      = &notifiers[notif_idx];
 
-	if (!strstr(ev->msg, env_ev->ev_match_str))
+	if (!ac_hit(&ev->substr_hits, env_ev->ac_id))
 		return 0;
 
 	log_msg("> Environment event detected!\n");
 	log_msg(">   type: substr, match: (%s), notifier: %s\n",
-		env_ev->ev_match_str, notifiers_str[notif_idx]);
+		env_ev->ev_match_str, notifiers_names(env_ev->ev_notifiers, names));
 
 	ab_init(&notif_message);
 
@@ -336,11 +416,8 @@ static int handle_substr(struct log_event *ev, int idx_env)
 	if (ret)
 		return 0;
 
-	if (self->send_notification(self, notif_message.buff) < 0) {
-		log_msg("unable to send the notification through %s\n",
-			notifiers_str[notif_idx]);
-	}
-
+	worker_notify(env_ev->rl_id, env_ev->ev_notifiers, DEDUP_KEY_INIT,
+		notif_message.buff);
 	return 1;
 }
 
@@ -355,14 +432,21 @@ static int handle_substr(struct log_event *ev, int idx_env)
  */
 int process_environment_event(struct log_event *ev)
 {
-	int i;
+	const int *ids;
+	int i, n;
 	int handled;
 
-	for (i = 0, handled = 0; i < num_env_events; i++) {
-		if (env_events[i].ev_match_type == EVNT_SUBSTR)
-			handled += handle_substr(ev, i);
+	if (!num_env_events)
+		return 0;
+
+	/* Only the events whose topic, host and severity apply. */
+	n = rule_index_lookup(&env_index, ev, &ids);
+
+	for (i = 0, handled = 0; i < n; i++) {
+		if (env_events[ids[i]].ev_match_type == EVNT_SUBSTR)
+			handled += handle_substr(ev, ids[i]);
 		else
-			handled += handle_regex(ev, i);
+			handled += handle_regex(ev, ids[i]);
 	}
 	return handled;
 }
@@ -376,7 +460,9 @@ int process_environment_event(struct log_event *ev)
 */
 int init_environment_events(void)
 {
-	struct notifier *self;
+	char names[NOTIFIERS_NAMES_LEN];
+	const char *err;
+	char name[32];
 	char *tmp;
 	tmp = getenv("ENV_EVENTS");
 
@@ -385,22 +471,44 @@ int init_environment_events(void)
 		return (0);
 	}
 
-	if (num_env_events >= MAX_ENV_EVENTS)
-		panic("Environment ENV_EVENTS exceeds the maximum supported (%d/%d)\n",
-			num_env_events, MAX_ENV_EVENTS);
+	if (!(env_events = calloc(num_env_events, sizeof(*env_events))))
+		panic("Unable to allocate %d environment events!\n", num_env_events);
 
 	log_msg("%d environment event(s) found, registering...\n", num_env_events);
 	for (int i = 0; i < num_env_events; i++) {
 		/* EVENTn_MATCH_TYPE. */
 		env_events[i].ev_match_type   = get_event_idx(i, "MATCH_TYPE",
 			match_types, MATCH_TYPES_LEN);
-		/* EVENTn_NOTIFIER. */
-		env_events[i].ev_notifier_idx = get_event_idx(i, "NOTIFIER",
-			notifiers_str, NUM_NOTIFIERS);
+		/* EVENTn_NOTIFIER, one or more. */
+		env_events[i].ev_notifiers    = get_event_notifiers(i);
 		/* EVENTn_MATCH_STR. */
 		env_events[i].ev_match_str    = get_event_str(i, "MATCH_STR");
 		/* EVENTn_MASK_MSG. */
 		env_events[i].ev_mask_msg     = get_event_str(i, "MASK_MSG");
+
+		/* EVENTn_MATCH_ON (optional). */
+		env_events[i].ev_match_on = MATCH_ON_MSG;
+		if (get_event_opt_str(i, "MATCH_ON"))
+			env_events[i].ev_match_on = get_event_idx(i, "MATCH_ON",
+				match_on, MATCH_ON_LEN);
+
+		/* EVENTn_REGEX_ENGINE (optional). */
+		env_events[i].ev_regex_engine = RE_ENGINE_DEFAULT;
+		if (get_event_opt_str(i, "REGEX_ENGINE"))
+			env_events[i].ev_regex_engine = get_event_idx(i, "REGEX_ENGINE",
+				re_engines_str, RE_ENGINES_LEN);
+
+		/* EVENTn_SEVERITY (optional). */
+		env_events[i].filter.max_severity = -1;
+		if ((tmp = get_event_opt_str(i, "SEVERITY"))) {
+			env_events[i].filter.max_severity = syslog_parse_severity(tmp);
+			if (env_events[i].filter.max_severity < 0)
+				panic("String parameter (%s) invalid for SEVERITY\n", tmp);
+		}
+
+		/* EVENTn_TOPIC and EVENTn_HOST (optional). */
+		env_events[i].filter.topic = get_event_opt_str(i, "TOPIC");
+		env_events[i].filter.host  = get_event_opt_str(i, "HOST");
 	}
 
 	log_msg("Environment events summary:\n");
@@ -410,24 +518,60 @@ int init_environment_events(void)
 				match_types[env_events[i].ev_match_type]);
 		log_msg("EVENT%d_MATCH_STR:  %s\n", i, env_events[i].ev_match_str);
 		log_msg("EVENT%d_NOTIFIER:   %s\n", i,
-				notifiers_str[env_events[i].ev_notifier_idx]);
-		log_msg("EVENT%d_MASK_MSG:   %s\n\n", i, env_events[i].ev_mask_msg);
-
-		/* Try to setup notifier if not yet. */
-		self = &notifiers[env_events[i].ev_notifier_idx];
-		self->setup(self);
+				notifiers_names(env_events[i].ev_notifiers, names));
+		log_msg("EVENT%d_MASK_MSG:   %s\n", i, env_events[i].ev_mask_msg);
+		log_msg("EVENT%d_MATCH_ON:   %s\n", i,
+				match_on[env_events[i].ev_match_on]);
+		log_msg("EVENT%d_SEVERITY:   %s\n", i,
+				env_events[i].filter.max_severity < 0 ? "any" :
+				severities_str[env_events[i].filter.max_severity]);
+		log_msg("EVENT%d_TOPIC:      %s\n", i,
+				env_events[i].filter.topic ? env_events[i].filter.topic : "any");
+		log_msg("EVENT%d_HOST:       %s\n\n", i,
+				env_events[i].filter.host ? env_events[i].filter.host : "any");
+
+		/* Try to setup notifiers if not yet. */
+		notifiers_setup(env_events[i].ev_notifiers);
+
+		snprintf(name, sizeof name, "EVENT%d", i);
+		env_events[i].rl_id = rl_rule_add(name);
+
+		/* Substrings all go into the same automaton. */
+		if (env_events[i].ev_match_type == EVNT_SUBSTR) {
+			env_events[i].ac_id = ac_add_pattern(env_events[i].ev_match_str,
+				env_events[i].ev_match_on == MATCH_ON_BODY);
+		}
 
 		/* If regex, compile it first. */
-		if (env_events[i].ev_match_type == EVNT_REGEX) {
-			if (regcomp(
+		else if (env_events[i].ev_match_type == EVNT_REGEX) {
+			if (rule_regcomp(
 			    &env_events[i].regex,
 			    env_events[i].ev_match_str,
-			    REG_EXTENDED))
+			    env_events[i].ev_regex_engine,
+			    env_events[i].ev_match_on == MATCH_ON_BODY ?
+			        RE_SUBJECT_BODY : RE_SUBJECT_MSG,
+			    &err))
 			{
 				panic("Unable to compile regex (%s) for EVENT%d!!!",
 					env_events[i].ev_match_str, i);
 			}
+
+			if (err)
+				log_msg("EVENT%d: builtin regex engine: %s, using libc\n",
+					i, err);
+			log_msg("EVENT%d_REGEX_ENGINE: %s\n\n", i,
+				re_engines_str[env_events[i].regex.engine]);
+
+			prefilter_init(&env_events[i].pf, name,
+				env_events[i].ev_match_str,
+				env_events[i].ev_match_on == MATCH_ON_BODY);
 		}
+
+		rule_index_add(&env_index, i, &env_events[i].filter);
 	}
+
+	rule_index_build(&env_index, "environment events");
+	log_msg("Environment events table: %zu KiB\n\n",
+		(num_env_events * sizeof(*env_events) + 1023) / 1024);
 	return 1;
 }
@@ -6,17 +6,27 @@
 #ifndef ENV_EVENTS_H
 #define ENV_EVENTS_H
 
-	#include <regex.h>
+	#include "prefilter.h"
+	#include "re.h"
+	#include "rule_index.h"
 
-	#define MAX_ENV_EVENTS  16
+	/* Which part of the message the event matches against. */
+	#define MATCH_ON_MSG  0
+	#define MATCH_ON_BODY 1
 	struct log_event;
 
 	struct env_event {
 		int         ev_match_type;     /* whether regex or str.     */
-		int         ev_notifier_idx;   /* Telegram, Discord...      */
+		unsigned    ev_notifiers;      /* Telegram, Discord...      */
 		const char *ev_match_str;      /* regex str or substr here. */
 		const char *ev_mask_msg;       /* Mask message to be sent.  */
-		regex_t    regex;              /* Compiled regex.           */
+		int         ev_match_on;       /* Whole message or body.    */
+		int         ac_id;             /* Substring pattern id.     */
+		int         rl_id;             /* Rate limit bucket.        */
+		int         ev_regex_engine;   /* libc or builtin.          */
+		struct rule_filter filter;     /* Topic, host and severity. */
+		struct rule_regex regex;       /* Compiled regex.           */
+		struct prefilter pf;           /* Regex literal prefilter.  */
 	};
 
 	extern int init_environment_events(void);
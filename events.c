@@ -10,9 +10,13 @@
 #include <string.h>
 #include <time.h>
 #include "events.h"
+#include "dedup.h"
+#include "memsearch.h"
 #include "notifiers.h"
+#include "ratelimit.h"
 #include "log.h"
 #include "str.h"
+#include "workers.h"
 
 /*
  * Static events
@@ -22,7 +26,6 @@
 
 /* Misc. */
 #define MAX_MATCHES 32
-static regmatch_t pmatch[MAX_MATCHES];
 
 /* Handlers. */
 static void handle_wifi_login_attempts(struct log_event *, int);
@@ -33,11 +36,14 @@ struct static_event static_events[NUM_EVENTS] = {
 		.hnd             = handle_wifi_login_attempts,
 		.ev_match_type   = EVNT_SUBSTR,
 		.enabled         = 0,
-		.ev_notifier_idx = NOTIFY_IDX_TELE
+		.ev_notifiers    = NOTIFIER_BIT(NOTIFY_IDX_TELE)
 	},
 	/* Add new handlers here. */
 };
 
+/* Enabled events index. */
+static struct rule_index static_index;
+
 /**
  * @brief Retrieves the event string from the environment variables.
  *
@@ -57,24 +63,21 @@ static char *get_event_str(long ev_num, char *str)
 }
 
 /**
- * @brief Retrieves the index of the event from the environment variables.
+ * @brief Retrieves the notifiers of the event from the environment
+ * variables, a comma-separated list (like 'Telegram,Slack').
  *
- * @param ev_num    Event number.
- * @param str       String identifier.
- * @param str_list  List of strings to match against.
- * @param size      Size of the string list.
+ * @param ev_num Event number.
  *
- * @return Returns the index of the matching event.
+ * @return Returns the notifiers mask.
  */
-static int
-get_event_idx(long ev_num, char *str, const char *const *str_list, int size)
+static unsigned get_event_notifiers(long ev_num)
 {
-	char *env = get_event_str(ev_num, str);
-	for (int i = 0; i < size; i++) {
-		if (!strcmp(env, str_list[i]))
-			return i;
-	}
-	panic("String parameter (%s) invalid for %s\n", env, str);
+	char *env = get_event_str(ev_num, "NOTIFIER");
+	unsigned mask;
+
+	if (notifiers_parse(env, &mask) < 0)
+		panic("String parameter (%s) invalid for NOTIFIER\n", env);
+	return mask;
 }
 
 /**
@@ -87,27 +90,35 @@ get_event_idx(long ev_num, char *str, const char *const *str_list, int size)
  */
 int process_static_event(struct log_event *ev)
 {
-	int i;
+	int i, n;
 	int handled;
+	const int *ids;
+	const char *body;
 	struct static_event *sta_ev;
+	regmatch_t pmatch[MAX_MATCHES];
 
-	for (i = 0, handled = 0; i < NUM_EVENTS; i++) {
-		/* Skip not enabled events. */
-		if (!static_events[i].enabled)
-			continue;
+	/* Static events only care about the message itself. */
+	body = ev->msg + ev->hdr.body.off;
 
-		sta_ev = &static_events[i];
+	/* Enabled events only, whose topic applies. */
+	n = rule_index_lookup(&static_index, ev, &ids);
 
-		if (static_events[i].ev_match_type == EVNT_SUBSTR) {
-			if (strstr(ev->msg, static_events[i].ev_match_str)) {
-				static_events[i].hnd(ev, i);
+	for (i = 0, handled = 0; i < n; i++) {
+		sta_ev = &static_events[ids[i]];
+
+		if (sta_ev->ev_match_type == EVNT_SUBSTR) {
+			if (ac_hit(&ev->substr_hits, sta_ev->ac_id)) {
+				sta_ev->hnd(ev, ids[i]);
 				handled += 1;
 			}
 		}
 
 		else {
-			if (regexec(&sta_ev->regex, ev->msg, MAX_MATCHES, pmatch, 0)) {
-				static_events[i].hnd(ev, i);
+			if (prefilter_pass(&sta_ev->pf, ev) &&
+				rule_regset_pass(&sta_ev->regex, &ev->regex_hits, ev->msg, body) &&
+				!rule_regexec(&sta_ev->regex, body, MAX_MATCHES, pmatch))
+			{
+				sta_ev->hnd(ev, ids[i]);
 				handled += 1;
 			}
 		}
@@ -123,8 +134,11 @@ int process_static_event(struct log_event *ev)
 */
 int init_static_events(void)
 {
-	struct notifier *self;
+	struct rule_filter filter = {.max_severity = -1};
+	char names[NOTIFIERS_NAMES_LEN];
+	const char *err;
 	char *ptr, *end;
+	char name[32];
 	long ev;
 
 	/* Check for: STATIC_EVENTS_ENABLED=0,3,5,2... */
@@ -152,9 +166,8 @@ int init_static_events(void)
 			panic("Event (%ld) is not valid!, should be between 0-%d\n",
 				ev, NUM_EVENTS - 1);
 
-		/* Try to retrieve & initialize notifier for the event. */
-		static_events[ev].ev_notifier_idx =
-			get_event_idx(ev, "NOTIFIER", notifiers_str, NUM_NOTIFIERS);
+		/* Try to retrieve & initialize notifiers for the event. */
+		static_events[ev].ev_notifiers = get_event_notifiers(ev);
 		static_events[ev].enabled = 1;
 
 		if (*end != ',' && *end != '\0')
@@ -170,24 +183,43 @@ int init_static_events(void)
 
 		log_msg("STATIC_EVENT%d         : enabled\n", i);
 		log_msg("STATIC_EVENT%d_NOTIFIER: %s\n\n",
-			i, notifiers_str[static_events[i].ev_notifier_idx]);
+			i, notifiers_names(static_events[i].ev_notifiers, names));
 
-		/* Try to setup notifier if not yet. */
-		self = &notifiers[static_events[i].ev_notifier_idx];
-		self->setup(self);
+		/* Try to setup notifiers if not yet. */
+		notifiers_setup(static_events[i].ev_notifiers);
+
+		snprintf(name, sizeof name, "STATIC_EVENT%d", i);
+		static_events[i].rl_id = rl_rule_add(name);
+
+		/* Substrings all go into the same automaton. */
+		if (static_events[i].ev_match_type == EVNT_SUBSTR)
+			static_events[i].ac_id =
+				ac_add_pattern(static_events[i].ev_match_str, 1);
 
 		/* If regex, compile it first. */
-		if (static_events[i].ev_match_type == EVNT_REGEX) {
-			if (regcomp(
+		else if (static_events[i].ev_match_type == EVNT_REGEX) {
+			if (rule_regcomp(
 			    &static_events[i].regex,
 			    static_events[i].ev_match_str,
-			    REG_EXTENDED))
+			    RE_ENGINE_DEFAULT, RE_SUBJECT_BODY, &err))
 			{
 				panic("Unable to compile regex (%s) for EVENT%d!!!",
 					static_events[i].ev_match_str, i);
 			}
+
+			if (err)
+				log_msg("STATIC_EVENT%d: builtin regex engine: %s, using libc\n",
+					i, err);
+
+			prefilter_init(&static_events[i].pf, name,
+				static_events[i].ev_match_str, 1);
 		}
+
+		filter.topic = static_events[i].ev_topic;
+		rule_index_add(&static_index, i, &filter);
 	}
+
+	rule_index_build(&static_index, "static events");
 	return 1;
 }
 
@@ -212,33 +244,30 @@ static int
 parse_login_attempt_msg(const char *msg, char *wifi_iface, char *mac_addr)
 {
 	size_t len = strlen(msg);
-	size_t tmp = 0;
-	size_t at  = 0;
+	const char *at, *sp, *colon;
 
-	/* Find '@' and the last ' '. */
-	for (at = 0; at < len && msg[at] != '@'; at++) {
-		if (msg[at] == ' ')
-			tmp = at;
-	}
+	/* Find '@' and the last ' ' before it. */
+	at = ms_memchr(msg, '@', len);
+	for (sp = at; sp && sp > msg && *sp != ' '; sp--);
 
-	if (at == len || !tmp) {
+	if (!at || sp <= msg) {
 		log_msg("unable to parse additional data, ignoring...\n");
 		return -1;
 	}
 
-	memcpy(mac_addr, msg + tmp + 1, MIN(at - tmp - 1, 32));
+	memcpy(mac_addr, sp + 1, MIN((size_t)(at - sp - 1), 32));
 
 	/*
 	 * Find network name.
 	 * Assuming that the interface name does not have ':'...
 	 */
-	for (tmp = at + 1; tmp < len && msg[tmp] != ':'; tmp++);
-	if (tmp == len) {
+	colon = ms_memchr(at + 1, ':', len - (at + 1 - msg));
+	if (!colon) {
 		log_msg("unable to find interface name!, ignoring..\n");
 		return -1;
 	}
 
-	memcpy(wifi_iface, msg + at + 1, MIN(tmp - at - 1, 32));
+	memcpy(wifi_iface, at + 1, MIN((size_t)(colon - at - 1), 32));
 	return (0);
 }
 
@@ -256,8 +285,7 @@ static void handle_wifi_login_attempts(struct log_event *ev, int idx_env)
 	char mac_addr[32]   = {0};
 	char wifi_iface[32] = {0};
 	struct str_ab notif_message;
-	struct notifier *self;
-	int notif_idx;
+	uint64_t key;
 	int ret;
 
 	log_msg("> Login attempt detected!\n");
@@ -281,13 +309,13 @@ static void handle_wifi_login_attempts(struct log_event *ev, int idx_env)
 
 	log_msg("> Retrieved info, MAC: (%s), Interface: (%s)\n", mac_addr, wifi_iface);
 
-	notif_idx = static_events[idx_env].ev_notifier_idx;
-	self      = &notifiers[notif_idx];
+	/* Repeats of the same device on the same interface. */
+	key = dedup_key(DEDUP_KEY_INIT, mac_addr, strlen(mac_addr));
+	key = dedup_key(key, wifi_iface, strlen(wifi_iface));
 
-	if (self->send_notification(self, notif_message.buff) < 0) {
-		log_msg("unable to send the notification!\n");
-		return;
-	}
+	worker_notify(static_events[idx_env].rl_id,
+		static_events[idx_env].ev_notifiers, key,
+		notif_message.buff);
 }
 
 ////////////////////////////// YOUR HANDLER HERE //////////////////////////////
@@ -8,6 +8,10 @@
 
 	#include <regex.h>
 	#include <time.h>
+	#include "aho_corasick.h"
+	#include "prefilter.h"
+	#include "re.h"
+	#include "rule_index.h"
 
 	#define MSG_MAX  2048
 	#define NUM_EVENTS  1
@@ -15,19 +19,53 @@
 	#define EVNT_SUBSTR 0
 	#define EVNT_REGEX  1
 
-	/* Log event. */
+	/* Part of a message: offset and length, from its start. */
+	struct log_span {
+		unsigned short off;
+		unsigned short len;
+	};
+
+	/*
+	 * Parsed message header (see syslog_parse.c): every field is a
+	 * span into the message itself, empty if not present, and the
+	 * numeric ones are -1 if unknown.
+	 */
+	struct log_hdr {
+		short format;           /* HDR_NONE, HDR_RFC3164... */
+		short facility;
+		short severity;         /* From PRI, or from topics. */
+		struct log_span pri;
+		struct log_span timestamp;
+		struct log_span hostname;
+		struct log_span topics; /* RouterOS, e.g: 'system,info'. */
+		struct log_span body;   /* Message itself, up to the end. */
+	};
+
+	/*
+	 * Log event: 'msg' is a view into the message queue storage,
+	 * valid until the event is released.
+	 */
 	struct log_event {
-		char   msg[MSG_MAX];
-		time_t timestamp;
+		const char *msg;
+		size_t      len;
+		time_t      timestamp;
+		unsigned    chunk; /* Queue storage. */
+		struct log_hdr hdr;
+		struct ac_hits substr_hits; /* Matched substring patterns. */
+		struct rule_hits regex_hits; /* Matched regex rules.        */
 	};
 
 	struct static_event {
 		void(*hnd)(struct log_event *, int); /* Event handler.            */
 		const char *ev_match_str;   /* Substr or regex to match.          */
+		const char *ev_topic;       /* RouterOS topic, NULL if any.       */
 		int        ev_match_type;   /* Whether substr or regex.           */
-		int        ev_notifier_idx; /* Telegram, Discord...               */
+		unsigned   ev_notifiers;    /* Telegram, Discord... (mask)        */
 		int        enabled;         /* Whether if handler enabled or not. */
-		regex_t    regex;           /* Compiled regex.                    */
+		int        ac_id;           /* Substring pattern id, if substr.   */
+		int        rl_id;           /* Rate limit bucket.                 */
+		struct rule_regex regex;    /* Compiled regex.                    */
+		struct prefilter pf;        /* Regex literal prefilter.           */
 	};
 
 	extern int process_static_event(struct log_event *ev);
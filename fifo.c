@@ -0,0 +1,684 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "fifo.h"
+#include "log.h"
+
+/*
+ * Lock-free message queue
+ *
+ * Each slot carries a sequence number (a la Vyukov's bounded queue):
+ * a slot at position 'pos' is free for the producer when seq == pos,
+ * holds a message when seq == pos + 1 and, once claimed (by advancing
+ * 'tail') and read, is handed back for the next round with
+ * seq == pos + size.
+ *
+ * Claiming through 'tail' is what allows the producers to evict old
+ * messages by themselves, without ever racing with the consumer:
+ * whoever wins the CAS owns the slot. Likewise, producers claim
+ * slots through 'head', so there can be several of them (one per
+ * receiver thread).
+ *
+ * Slots only hold the message metadata, the message itself lives in
+ * a chain of chunks, taken from (and given back to) a lock-free free
+ * list. Since the consumer owns the chunks until fifo_release(), it
+ * gets a view of the message instead of a copy.
+ */
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/* Free list head: chunk index + ABA tag. */
+#define CHUNK_IDX(h)  ((h) & FIFO_CHUNK_NIL)
+#define CHUNK_TAG(h)  (((h) + FIFO_CHUNK_NIL + 1) & ~FIFO_CHUNK_NIL)
+
+/**
+ * @brief Amount of chunks needed to store a message of length
+ * @p len (plus its NUL terminator).
+ */
+static inline unsigned chunks_for(size_t len) {
+	return (len + FIFO_CHUNK_DATA) / FIFO_CHUNK_DATA;
+}
+
+/**
+ * @brief Initializes the FIFO @p f.
+ *
+ * @param f          FIFO to be initialized.
+ * @param bytes      Memory budget for the queued messages.
+ * @param policy     Overflow policy (FIFO_DROP_NEWEST...).
+ * @param timeout_ms Max time blocked when full, for FIFO_BLOCK.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int fifo_init(struct fifo *f, size_t bytes, int policy, int timeout_ms)
+{
+	unsigned size;
+	int lanes;
+
+	memset(f, 0, sizeof(*f));
+
+	/* At least room for two messages of maximum length. */
+	f->num_chunks = bytes / FIFO_CHUNK_SIZE;
+	if (f->num_chunks < 2 * chunks_for(MSG_MAX - 1) ||
+	    f->num_chunks >= FIFO_CHUNK_NIL)
+	{
+		return -1;
+	}
+
+	f->chunks = calloc(f->num_chunks, sizeof(struct fifo_chunk));
+	if (!f->chunks)
+		return -1;
+
+	for (unsigned i = 0; i < f->num_chunks - 1; i++)
+		atomic_init(&f->chunks[i].next, i + 1);
+	atomic_init(&f->chunks[f->num_chunks - 1].next, FIFO_CHUNK_NIL);
+	atomic_init(&f->free_chunks, 0);
+	atomic_init(&f->nfree, f->num_chunks);
+
+	/*
+	 * Every queued message takes at least one chunk, so with
+	 * (at least) one slot per chunk, lanes are never full
+	 * before the storage.
+	 */
+	for (size = 2; size < f->num_chunks; size <<= 1);
+
+	/* Only the severity policy needs a separate lane. */
+	lanes = (policy == FIFO_SEVERITY) ? FIFO_LANES : 1;
+	for (int i = 0; i < lanes; i++) {
+		f->lanes[i].slots = calloc(size, sizeof(struct fifo_slot));
+		if (!f->lanes[i].slots)
+			return -1;
+		for (unsigned j = 0; j < size; j++)
+			atomic_init(&f->lanes[i].slots[j].seq, j);
+	}
+
+	f->cons_efd = eventfd(0, EFD_CLOEXEC);
+	f->prod_efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK|EFD_SEMAPHORE);
+	if (f->cons_efd < 0 || f->prod_efd < 0)
+		return -1;
+
+	f->size       = size;
+	f->policy     = policy;
+	f->timeout_ms = timeout_ms;
+	return 0;
+}
+
+/**
+ * @brief Wakes up the thread sleeping in the eventfd @p efd, if
+ * parked (as signaled by @p parked).
+ *
+ * @return Returns 1 if the thread was woken up, 0 otherwise.
+ */
+static int fifo_unpark(atomic_int *parked, int efd)
+{
+	uint64_t one = 1;
+
+	/*
+	 * Pairs with the fence in the sleeping side, which sets
+	 * 'parked' and then re-checks the queue state, so one of the
+	 * two is guaranteed to see the other.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(parked, memory_order_relaxed))
+		return 0;
+	if (!atomic_exchange(parked, 0))
+		return 0;
+
+	if (write(efd, &one, sizeof one) < 0)
+		log_errno("Unable to wake up thread...\n");
+	return 1;
+}
+
+/**
+ * @brief Wakes up all the producers waiting for room, if any.
+ */
+static void fifo_unpark_producers(struct fifo *f)
+{
+	uint64_t parked;
+
+	/*
+	 * Same as fifo_unpark(), but there might be several of them: the
+	 * eventfd is a semaphore, and each producer takes a single wakeup
+	 * from it, so there is one for each. Leftovers (from producers
+	 * that got room meanwhile) just make the next waits spurious.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	parked = atomic_load_explicit(&f->prod_parked, memory_order_relaxed);
+	if (!parked)
+		return;
+
+	if (write(f->prod_efd, &parked, sizeof parked) < 0)
+		log_errno("Unable to wake up producers...\n");
+}
+
+///////////////////////////////// CHUNKS ///////////////////////////////////////
+
+/**
+ * @brief Pops a single chunk from the free list.
+ *
+ * @return Returns the chunk index, or FIFO_CHUNK_NIL if empty.
+ */
+static unsigned chunk_pop(struct fifo *f)
+{
+	unsigned old, new, idx;
+
+	old = atomic_load(&f->free_chunks);
+	do {
+		idx = CHUNK_IDX(old);
+		if (idx == FIFO_CHUNK_NIL)
+			return FIFO_CHUNK_NIL;
+
+		/* Might be stale, but then the tag changed and the CAS fails. */
+		new = CHUNK_TAG(old) |
+			atomic_load_explicit(&f->chunks[idx].next, memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak(&f->free_chunks, &old, new));
+
+	return idx;
+}
+
+/**
+ * @brief Gives the chunk chain starting at @p first back to the
+ * free list, waking up the producer if waiting for room.
+ */
+static void chunk_free_chain(struct fifo *f, unsigned first)
+{
+	unsigned old, new, last, next;
+	unsigned n = 1;
+
+	for (last = first; (next = atomic_load_explicit(&f->chunks[last].next,
+	     memory_order_relaxed)) != FIFO_CHUNK_NIL; last = next)
+	{
+		n++;
+	}
+
+	old = atomic_load(&f->free_chunks);
+	do {
+		atomic_store_explicit(&f->chunks[last].next, CHUNK_IDX(old),
+			memory_order_relaxed);
+		new = CHUNK_TAG(old) | first;
+	} while (!atomic_compare_exchange_weak(&f->free_chunks, &old, new));
+
+	if (f->policy == FIFO_BLOCK) {
+		atomic_fetch_add(&f->nfree, n);
+		fifo_unpark_producers(f);
+	}
+}
+
+/**
+ * @brief Allocates a chain of @p n chunks.
+ *
+ * @return Returns the first chunk of the chain, or FIFO_CHUNK_NIL
+ * if there are not enough free chunks.
+ */
+static unsigned chunk_alloc_chain(struct fifo *f, unsigned n)
+{
+	unsigned first = FIFO_CHUNK_NIL;
+	unsigned last  = FIFO_CHUNK_NIL;
+	unsigned idx;
+
+	for (unsigned i = 0; i < n; i++) {
+		if ((idx = chunk_pop(f)) == FIFO_CHUNK_NIL) {
+			if (first == FIFO_CHUNK_NIL)
+				return FIFO_CHUNK_NIL;
+			if (f->policy == FIFO_BLOCK)
+				atomic_fetch_sub(&f->nfree, i);
+			chunk_free_chain(f, first);
+			return FIFO_CHUNK_NIL;
+		}
+
+		atomic_store_explicit(&f->chunks[idx].next, FIFO_CHUNK_NIL,
+			memory_order_relaxed);
+
+		if (first == FIFO_CHUNK_NIL)
+			first = idx;
+		else
+			atomic_store_explicit(&f->chunks[last].next, idx,
+				memory_order_relaxed);
+		last = idx;
+	}
+
+	if (f->policy == FIFO_BLOCK)
+		atomic_fetch_sub(&f->nfree, n);
+	return first;
+}
+
+/**
+ * @brief Copies the message @p msg of length @p len into the chunk
+ * chain starting at @p c, NUL-terminating it.
+ */
+static void
+chunk_write(struct fifo *f, unsigned c, const char *msg, size_t len)
+{
+	size_t n;
+
+	for (;;) {
+		n = MIN(len, FIFO_CHUNK_DATA);
+		memcpy(f->chunks[c].data, msg, n);
+		if (n < FIFO_CHUNK_DATA) {
+			f->chunks[c].data[n] = '\0';
+			break;
+		}
+		msg += n;
+		len -= n;
+		c    = atomic_load_explicit(&f->chunks[c].next, memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Copies the chained message starting at chunk @p c, of
+ * length @p len, into the consumer scratch buffer.
+ */
+static const char *chunk_linearize(struct fifo *f, unsigned c, size_t len)
+{
+	char *p = f->scratch;
+	size_t n;
+
+	stat_inc(f->chained);
+	while (len) {
+		n = MIN(len, FIFO_CHUNK_DATA);
+		memcpy(p, f->chunks[c].data, n);
+		p   += n;
+		len -= n;
+		c    = atomic_load_explicit(&f->chunks[c].next, memory_order_relaxed);
+	}
+	*p = '\0';
+	return f->scratch;
+}
+
+///////////////////////////////// LANES ////////////////////////////////////////
+
+/**
+ * @brief Checks if the lane @p l has a message ready to be claimed
+ * and, if so, saves its arrival stamp into @p stamp.
+ *
+ * @return Returns 1 if there is a message, 0 otherwise.
+ */
+static int lane_peek(struct fifo *f, struct fifo_lane *l, unsigned *stamp)
+{
+	struct fifo_slot *slot;
+	unsigned pos;
+
+	if (!l->slots)
+		return 0;
+
+	pos  = atomic_load_explicit(&l->tail, memory_order_relaxed);
+	slot = &l->slots[pos & (f->size - 1)];
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+		return 0;
+
+	*stamp = atomic_load_explicit(&slot->stamp, memory_order_relaxed);
+	return 1;
+}
+
+/**
+ * @brief Retrieves the lane holding the oldest message.
+ *
+ * @return Returns the lane, or NULL if the FIFO is empty.
+ */
+static struct fifo_lane *fifo_oldest_lane(struct fifo *f)
+{
+	struct fifo_lane *oldest = NULL;
+	unsigned stamp, min = 0;
+
+	for (int i = 0; i < FIFO_LANES; i++) {
+		if (!lane_peek(f, &f->lanes[i], &stamp))
+			continue;
+		if (!oldest || (int)(stamp - min) < 0) {
+			oldest = &f->lanes[i];
+			min    = stamp;
+		}
+	}
+	return oldest;
+}
+
+/**
+ * @brief Takes the oldest message of the lane @p l, saving its
+ * metadata into @p ev. The message chunks belong to the caller
+ * from now on.
+ *
+ * @param f  FIFO.
+ * @param l  Lane.
+ * @param ev Log event (without the message view).
+ *
+ * @return Returns 1 if success, 0 if the lane is empty.
+ */
+static int lane_take(struct fifo *f, struct fifo_lane *l, struct log_event *ev)
+{
+	struct fifo_slot *slot;
+	unsigned seq;
+	unsigned p;
+
+	if (!l->slots)
+		return 0;
+
+	p = atomic_load_explicit(&l->tail, memory_order_relaxed);
+	for (;;) {
+		slot = &l->slots[p & (f->size - 1)];
+		seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if ((int)(seq - (p + 1)) < 0)
+			return 0;
+
+		if (seq != p + 1) {
+			p = atomic_load_explicit(&l->tail, memory_order_relaxed);
+			continue;
+		}
+
+		if (atomic_compare_exchange_weak(&l->tail, &p, p + 1))
+			break;
+	}
+
+	ev->chunk     = slot->chunk;
+	ev->len       = slot->len;
+	ev->timestamp = slot->timestamp;
+
+	/* Slot metadata read, hand it back to the producer. */
+	atomic_store_explicit(&slot->seq, p + f->size, memory_order_release);
+	return 1;
+}
+
+/**
+ * @brief Evicts (discards) the oldest message of lane @p l.
+ *
+ * @return Returns 1 if a message was evicted, 0 if the lane is empty.
+ */
+static int lane_evict(struct fifo *f, struct fifo_lane *l)
+{
+	struct log_event ev;
+
+	if (!lane_take(f, l, &ev))
+		return 0;
+
+	chunk_free_chain(f, ev.chunk);
+	return 1;
+}
+
+///////////////////////////////// FIFO /////////////////////////////////////////
+
+/**
+ * @brief Waits until the FIFO might have room for @p n chunks, or
+ * until the @p deadline (set on the first call) expires.
+ *
+ * @return Returns 1 if there might be room, 0 if timed out.
+ */
+static int fifo_wait_room(struct fifo *f, struct timespec *deadline, unsigned n)
+{
+	struct pollfd pfd = {.fd = f->prod_efd, .events = POLLIN};
+	struct timespec now;
+	long remaining;
+	uint64_t cnt;
+	int ret = 1;
+
+	if (!deadline->tv_sec) {
+		/* Messages already pushed in this batch must be seen. */
+		fifo_wake(f);
+
+		clock_gettime(CLOCK_MONOTONIC, deadline);
+		deadline->tv_sec  += f->timeout_ms / 1000;
+		deadline->tv_nsec += (f->timeout_ms % 1000) * 1000000L;
+	}
+
+	atomic_fetch_add(&f->prod_parked, 1);
+
+	if (atomic_load(&f->nfree) >= n)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000L;
+
+	if (remaining <= 0 || !poll(&pfd, 1, remaining)) {
+		/* Timed out, but room might have been freed meanwhile. */
+		ret = (atomic_load(&f->nfree) >= n);
+	}
+	/* Takes a single wakeup, non-blocking: all might be taken already. */
+	else if (read(f->prod_efd, &cnt, sizeof cnt) < 0 && errno != EAGAIN)
+		log_errno("Unable to wait for room...\n");
+out:
+	atomic_fetch_sub(&f->prod_parked, 1);
+	return ret;
+}
+
+/**
+ * @brief Applies the overflow policy in order to make room
+ * for a new message of @p n chunks, when the FIFO is full.
+ *
+ * @param f        FIFO.
+ * @param low_prio Whether the incoming message is low-priority.
+ * @param deadline Deadline, for FIFO_BLOCK.
+ * @param n        Amount of chunks needed.
+ *
+ * @return Returns 1 if there might be room now, 0 if the
+ * incoming message should be dropped.
+ */
+static int fifo_make_room(struct fifo *f, int low_prio,
+	struct timespec *deadline, unsigned n)
+{
+	struct fifo_lane *l;
+
+	switch (f->policy) {
+	case FIFO_DROP_OLDEST:
+		if ((l = fifo_oldest_lane(f)) && lane_evict(f, l)) {
+			stat_inc(f->evicted);
+			return 1;
+		}
+		break;
+	case FIFO_SEVERITY:
+		if (lane_evict(f, &f->lanes[FIFO_LANE_LOW])) {
+			stat_inc(f->evicted_low);
+			return 1;
+		}
+		if (!low_prio && lane_evict(f, &f->lanes[FIFO_LANE_HIGH])) {
+			stat_inc(f->evicted);
+			return 1;
+		}
+		break;
+	case FIFO_BLOCK:
+		if (fifo_wait_room(f, deadline, n))
+			return 1;
+		stat_inc(f->timeouts);
+		break;
+	}
+
+	stat_inc(f->dropped);
+	return 0;
+}
+
+/**
+ * @brief Adds the message @p msg, of length @p len, into the FIFO,
+ * applying the overflow policy if full. The consumer is not woken
+ * up here, see fifo_wake().
+ *
+ * @param f         FIFO.
+ * @param msg       Message to be added.
+ * @param len       Message length.
+ * @param timestamp Message timestamp.
+ * @param low_prio  Whether the message is low-priority (only
+ *                  meaningful for FIFO_SEVERITY).
+ *
+ * @return Returns 0 if success, -1 if the message was dropped.
+ */
+int fifo_push(struct fifo *f, const char *msg, size_t len,
+	time_t timestamp, int low_prio)
+{
+	struct timespec deadline = {0};
+	struct fifo_slot *slot;
+	struct fifo_lane *l;
+	unsigned chunk;
+	unsigned head;
+	unsigned seq;
+	unsigned n;
+
+	len = MIN(len, MSG_MAX - 1);
+	n   = chunks_for(len);
+
+	while ((chunk = chunk_alloc_chain(f, n)) == FIFO_CHUNK_NIL) {
+		if (!fifo_make_room(f, low_prio, &deadline, n))
+			return -1;
+	}
+
+	chunk_write(f, chunk, msg, len);
+
+	l = &f->lanes[FIFO_LANE_HIGH];
+	if (low_prio && f->policy == FIFO_SEVERITY)
+		l = &f->lanes[FIFO_LANE_LOW];
+
+	/*
+	 * Claims the slot at 'head' (we might not be the only producer).
+	 * There is always room, but its last reader might not be done
+	 * yet.
+	 */
+	head = atomic_load_explicit(&l->head, memory_order_relaxed);
+	for (;;) {
+		slot = &l->slots[head & (f->size - 1)];
+		seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq == head) {
+			if (atomic_compare_exchange_weak(&l->head, &head, head + 1))
+				break;
+			continue;
+		}
+
+		if ((int)(seq - head) < 0)
+			sched_yield();
+		head = atomic_load_explicit(&l->head, memory_order_relaxed);
+	}
+
+	slot->chunk     = chunk;
+	slot->len       = len;
+	slot->timestamp = timestamp;
+	atomic_store_explicit(&slot->stamp,
+		atomic_fetch_add_explicit(&f->stamp, 1, memory_order_relaxed),
+		memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, head + 1, memory_order_release);
+	return 0;
+}
+
+/**
+ * @brief Wakes up the consumer, but only if it is parked.
+ * Should be called once after pushing a batch of messages.
+ *
+ * @param f FIFO.
+ */
+void fifo_wake(struct fifo *f)
+{
+	if (fifo_unpark(&f->cons_parked, f->cons_efd))
+		stat_inc(f->wakeups);
+}
+
+/**
+ * @brief Pops the oldest message from the FIFO @p f, if any,
+ * without blocking, and saves it into @p ev.
+ *
+ * Just like fifo_pop(), @p ev points to the FIFO storage, which
+ * must be handed back with fifo_release().
+ *
+ * @param f  FIFO.
+ * @param ev Target buffer to the retrieved log event.
+ *
+ * @return Returns 0 if success, -1 if the FIFO is empty.
+ */
+int fifo_try_pop(struct fifo *f, struct log_event *ev)
+{
+	struct fifo_lane *l;
+
+	/* Taking might fail if the producer evicted it meanwhile. */
+	while ((l = fifo_oldest_lane(f))) {
+		if (!lane_take(f, l, ev))
+			continue;
+
+		if (ev->len < FIFO_CHUNK_DATA)
+			ev->msg = f->chunks[ev->chunk].data;
+		else
+			ev->msg = chunk_linearize(f, ev->chunk, ev->len);
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Pops the oldest message from the FIFO @p f, waiting up
+ * to @p timeout_ms milliseconds if there is none, and saves it
+ * into @p ev.
+ *
+ * The message is not copied: @p ev points to the FIFO storage,
+ * which must be handed back with fifo_release() once done.
+ *
+ * @param f          FIFO.
+ * @param ev         Target buffer to the retrieved log event.
+ * @param timeout_ms Max time to wait, or -1 to wait forever.
+ *
+ * @return Returns 0 if success, -1 if timed out.
+ */
+int fifo_pop_timeout(struct fifo *f, struct log_event *ev, int timeout_ms)
+{
+	struct pollfd pfd = {.fd = f->cons_efd, .events = POLLIN};
+	uint64_t cnt;
+	int ret;
+
+	while (fifo_try_pop(f, ev) < 0) {
+		atomic_store_explicit(&f->cons_parked, 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (fifo_oldest_lane(f)) {
+			atomic_store_explicit(&f->cons_parked, 0, memory_order_relaxed);
+			continue;
+		}
+
+		if (timeout_ms >= 0) {
+			ret = poll(&pfd, 1, timeout_ms);
+			if (!ret) {
+				/* A wakeup racing with us is just spurious later. */
+				atomic_store_explicit(&f->cons_parked, 0,
+					memory_order_relaxed);
+				return fifo_try_pop(f, ev);
+			}
+			if (ret < 0) {
+				if (errno != EINTR)
+					panic_errno("Unable to wait for new messages");
+				continue;
+			}
+		}
+
+		/* A spurious wakeup here is harmless, we just re-check. */
+		if (read(f->cons_efd, &cnt, sizeof cnt) < 0 && errno != EINTR)
+			panic_errno("Unable to wait for new messages");
+	}
+	return 0;
+}
+
+/**
+ * @brief Pops the oldest message from the FIFO @p f, blocking
+ * if there is none, and saves it into @p ev.
+ *
+ * See fifo_pop_timeout().
+ *
+ * @param f  FIFO.
+ * @param ev Target buffer to the retrieved log event.
+ *
+ * @return Returns 0.
+ */
+int fifo_pop(struct fifo *f, struct log_event *ev) {
+	return fifo_pop_timeout(f, ev, -1);
+}
+
+/**
+ * @brief Hands back the storage of a message previously
+ * retrieved with fifo_pop().
+ *
+ * @param f  FIFO.
+ * @param ev Log event.
+ */
+void fifo_release(struct fifo *f, struct log_event *ev)
+{
+	chunk_free_chain(f, ev->chunk);
+	ev->msg = NULL;
+}
@@ -0,0 +1,101 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef FIFO_H
+#define FIFO_H
+
+	#include <stdalign.h>
+	#include <stdatomic.h>
+	#include <stdint.h>
+	#include "events.h"
+	#include "stats.h"
+
+	#define CACHE_LINE 64
+
+	/* Overflow policies, i.e., what to do when the FIFO is full. */
+	#define FIFO_DROP_NEWEST 0 /* Discard the incoming message.        */
+	#define FIFO_DROP_OLDEST 1 /* Evict the oldest queued message.     */
+	#define FIFO_BLOCK       2 /* Wait (up to a timeout) for room.     */
+	#define FIFO_SEVERITY    3 /* Evict low-priority messages first.   */
+
+	/* Priority lanes, only the severity policy uses the low lane. */
+	#define FIFO_LANE_HIGH 0
+	#define FIFO_LANE_LOW  1
+	#define FIFO_LANES     2
+
+	/*
+	 * Message storage: fixed-size chunks, so that a typical
+	 * RouterOS line (80-200 bytes) takes a single one. Longer
+	 * messages are chained through multiple chunks.
+	 */
+	#define FIFO_CHUNK_SIZE 256
+	#define FIFO_CHUNK_DATA (FIFO_CHUNK_SIZE - sizeof(atomic_uint))
+	#define FIFO_CHUNK_NIL  0xFFFFFu /* Also the max amount of chunks. */
+
+	struct fifo_chunk {
+		atomic_uint next; /* Next chunk, in the message or free list. */
+		char data[FIFO_CHUNK_DATA];
+	};
+
+	struct fifo_slot {
+		atomic_uint seq;   /* Slot state, see fifo.c.        */
+		atomic_uint stamp; /* Arrival order, across lanes.   */
+		unsigned    chunk; /* First chunk of the message.    */
+		unsigned    len;   /* Message length.                */
+		time_t      timestamp;
+	};
+
+	/*
+	 * Lock-free ring, multi-producer/single-consumer.
+	 *
+	 * 'head' is claimed by the producers and 'tail' by the consumer
+	 * (or by a producer, when evicting old messages), each one living
+	 * in its own cache line, so that both sides do not keep stealing
+	 * the line from each other. Indexes are free-running and masked
+	 * on access, thus the size must be a power of two.
+	 */
+	struct fifo_lane {
+		alignas(CACHE_LINE) atomic_uint head;
+		alignas(CACHE_LINE) atomic_uint tail;
+		struct fifo_slot *slots;
+	};
+
+	struct fifo {
+		struct fifo_lane lanes[FIFO_LANES];
+		alignas(CACHE_LINE) atomic_uint free_chunks; /* Tagged list head. */
+		atomic_uint nfree;    /* Free chunks, only for FIFO_BLOCK. */
+		alignas(CACHE_LINE) atomic_int cons_parked;  /* Consumer sleeping. */
+		alignas(CACHE_LINE) atomic_int prod_parked;  /* Producers sleeping. */
+		alignas(CACHE_LINE) atomic_uint stamp;       /* Next arrival stamp. */
+		struct fifo_chunk *chunks;
+		unsigned num_chunks;
+		int      cons_efd;    /* Consumer wakeup.                  */
+		int      prod_efd;    /* Producer wakeups (semaphore).     */
+		unsigned size;        /* Slots per lane.                   */
+		int      policy;      /* Overflow policy.                  */
+		int      timeout_ms;  /* Max time blocked, for FIFO_BLOCK. */
+		char     scratch[MSG_MAX]; /* Chained messages (consumer). */
+
+		/* Statistics. */
+		stat_t wakeups;       /* Consumer wakeups.                 */
+		stat_t dropped;       /* Incoming messages discarded.      */
+		stat_t evicted;       /* Oldest messages evicted.          */
+		stat_t evicted_low;   /* Low-priority messages evicted.    */
+		stat_t timeouts;      /* Blocked pushes that timed out.    */
+		stat_t chained;       /* Messages spanning multiple chunks. */
+	};
+
+	extern int fifo_init(struct fifo *f, size_t bytes, int policy,
+		int timeout_ms);
+	extern int fifo_push(struct fifo *f, const char *msg, size_t len,
+		time_t timestamp, int low_prio);
+	extern void fifo_wake(struct fifo *f);
+	extern int fifo_try_pop(struct fifo *f, struct log_event *ev);
+	extern int fifo_pop_timeout(struct fifo *f, struct log_event *ev,
+		int timeout_ms);
+	extern int fifo_pop(struct fifo *f, struct log_event *ev);
+	extern void fifo_release(struct fifo *f, struct log_event *ev);
+
+#endif /* FIFO_H */
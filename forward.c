@@ -0,0 +1,759 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <regex.h>
+#include <time.h>
+
+#include "events.h"
+#include "fifo.h"
+#include "forward.h"
+#include "log.h"
+#include "stats.h"
+#include "syslog.h"
+
+/*
+ * Forward Mode.
+ *
+ * Received messages are copied into one queue per forward target,
+ * each one drained by its own sender thread in batches (with
+ * sendmmsg() for UDP), so that neither the forward latency nor its
+ * errors reach the receive path, nor the other targets: if a sender
+ * falls behind, the oldest messages of its queue are evicted.
+ *
+ * TCP targets are reconnected with exponential backoff and, while
+ * down, their messages go to a bounded spill file on disk, replayed
+ * in order once the connection is back.
+ */
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/* Forward protocols. */
+#define PROTOS_LEN 3
+static const char *const protos[] = {"udp", "tcp", "tcp-octet"};
+
+/* Filter match types. */
+#define MATCH_TYPES_LEN 2
+static const char *const match_types[] = {"substr", "regex"};
+
+/* Forward targets. */
+static struct forward_target targets[MAX_FORWARD_TARGETS];
+static int num_targets;
+static int fwd_batch_size = FORWARD_BATCH_DEFAULT;
+
+/**
+ * @brief Dumps the forwarding statistics, for each target.
+ */
+static void forward_dump_stats(void)
+{
+	struct forward_target *t;
+	unsigned long syscalls;
+	unsigned long sent;
+
+	for (int i = 0; i < num_targets; i++) {
+		t        = &targets[i];
+		syscalls = stat_get(t->syscalls);
+		sent     = stat_get(t->sent);
+
+		log_msg("  target%d (%s:%s/%s)\n", i, t->host, t->port,
+			protos[t->proto]);
+		log_msg("    sent messages : %lu\n", sent);
+		log_msg("    filtered out  : %lu\n", stat_get(t->filtered));
+		log_msg("    send syscalls : %lu\n", syscalls);
+		log_msg("    avg batch size: %.2f\n",
+			syscalls ? (double)sent / syscalls : 0.0);
+		log_msg("    send errors   : %lu\n", stat_get(t->errors));
+		log_msg("    queue dropped : %lu\n", stat_get(t->fifo.dropped));
+		log_msg("    queue evicted : %lu\n", stat_get(t->fifo.evicted));
+		log_msg("    queue wakeups : %lu\n", stat_get(t->fifo.wakeups));
+
+		if (t->proto == FWD_PROTO_UDP)
+			continue;
+
+		log_msg("    sent bytes    : %lu\n", stat_get(t->bytes));
+		log_msg("    connects      : %lu\n", stat_get(t->connects));
+		log_msg("    connect fails : %lu\n", stat_get(t->connect_fails));
+		log_msg("    spilled msgs  : %lu\n", stat_get(t->spilled));
+		log_msg("    replayed msgs : %lu\n", stat_get(t->replayed));
+		log_msg("    lost msgs     : %lu\n", stat_get(t->lost));
+		log_msg("    spill backlog : %lu bytes\n", stat_get(t->backlog));
+	}
+}
+
+/**
+ * @brief Returns the current monotonic time, in milliseconds.
+ */
+static long long forward_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Sends the first @p count messages of the target @p t
+ * batch buffers, over UDP.
+ *
+ * Messages that could not be sent are counted and skipped: like
+ * syslog itself, forwarding over UDP is best-effort.
+ */
+static void forward_send(struct forward_target *t, int count)
+{
+	int ret;
+
+	for (int i = 0; i < count; ) {
+		ret = sendmmsg(t->fd, t->hdrs + i, count - i, 0);
+		stat_inc(t->syscalls);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Logs only the first of a sequence of errors. */
+			if (!t->failing)
+				log_msg("Unable to forward message to %s:%s: %s\n",
+					t->host, t->port, strerror(errno));
+			t->failing = 1;
+			stat_inc(t->errors);
+			i++;
+			continue;
+		}
+
+		t->failing = 0;
+		stat_add(t->sent, ret);
+		i += ret;
+	}
+}
+
+/**
+ * @brief Connects to the target @p t, over TCP.
+ *
+ * On failure, the next attempt is scheduled with exponential
+ * backoff, from FORWARD_BACKOFF_MIN_MS up to FORWARD_BACKOFF_MAX_MS.
+ *
+ * @return Returns 0 if connected, -1 otherwise.
+ */
+static int forward_tcp_connect(struct forward_target *t)
+{
+	struct timeval tv = {.tv_sec = FORWARD_SEND_TIMEOUT_S};
+	int fd;
+
+	fd = socket(t->addr->ai_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto fail;
+
+	/* Also bounds connect(), so a dead host does not hold us. */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (connect(fd, t->addr->ai_addr, t->addr->ai_addrlen) < 0) {
+		close(fd);
+		goto fail;
+	}
+
+	t->fd         = fd;
+	t->connected  = 1;
+	t->failing    = 0;
+	t->backoff_ms = FORWARD_BACKOFF_MIN_MS;
+	stat_inc(t->connects);
+	log_msg("Forward target %s:%s: connected\n", t->host, t->port);
+	return 0;
+
+fail:
+	if (!t->failing)
+		log_msg("Unable to connect to %s:%s: %s, retrying...\n",
+			t->host, t->port, strerror(errno));
+	t->failing    = 1;
+	t->next_retry = forward_now_ms() + t->backoff_ms;
+	t->backoff_ms = MIN(t->backoff_ms * 2, FORWARD_BACKOFF_MAX_MS);
+	stat_inc(t->connect_fails);
+	return -1;
+}
+
+/**
+ * @brief Closes the connection to the target @p t after a send
+ * error, scheduling an immediate reconnect attempt.
+ */
+static void forward_tcp_disconnect(struct forward_target *t)
+{
+	log_msg("Forward target %s:%s: disconnected: %s\n",
+		t->host, t->port, strerror(errno));
+
+	close(t->fd);
+	t->fd         = -1;
+	t->connected  = 0;
+	t->next_retry = forward_now_ms();
+	stat_inc(t->errors);
+}
+
+/**
+ * @brief Checks whether the target @p t has closed the connection
+ * (such as when restarting), so that we do not keep writing into a
+ * half-closed socket, only to lose everything once it is reset.
+ *
+ * @return Returns 1 if still connected, 0 otherwise.
+ */
+static int forward_tcp_alive(struct forward_target *t)
+{
+	char c;
+
+	if (recv(t->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) != 0)
+		return 1;
+
+	errno = ECONNRESET;
+	forward_tcp_disconnect(t);
+	return 0;
+}
+
+/**
+ * @brief Sends the first @p count messages of the target @p t
+ * batch buffers, over TCP, framed as configured.
+ *
+ * On error, the connection is closed.
+ *
+ * @return Returns the amount of messages fully sent.
+ */
+static int forward_tcp_send(struct forward_target *t, int count)
+{
+	struct iovec *iov = t->tcp_iovs;
+	struct msghdr mh  = {0};
+	size_t len;
+	ssize_t ret;
+	int first;
+	int niov;
+
+	if (!forward_tcp_alive(t))
+		return 0;
+
+	/* Two iovecs per message: octet count + msg, or msg + LF. */
+	for (int i = niov = 0; i < count; i++) {
+		len = t->iovs[i].iov_len;
+		if (t->proto == FWD_PROTO_TCP_OCTET) {
+			iov[niov].iov_base   = t->prefixes[i];
+			iov[niov++].iov_len  = snprintf(t->prefixes[i],
+				sizeof(t->prefixes[i]), "%zu ", len);
+			iov[niov].iov_base   = t->msgs[i];
+			iov[niov++].iov_len  = len;
+		} else {
+			iov[niov].iov_base   = t->msgs[i];
+			iov[niov++].iov_len  = len;
+			iov[niov].iov_base   = "\n";
+			iov[niov++].iov_len  = 1;
+		}
+	}
+
+	for (first = 0; first < niov; ) {
+		mh.msg_iov    = iov + first;
+		mh.msg_iovlen = niov - first;
+
+		ret = sendmsg(t->fd, &mh, MSG_NOSIGNAL);
+		stat_inc(t->syscalls);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			forward_tcp_disconnect(t);
+			break;
+		}
+
+		/* Skip whatever was sent, partial writes included. */
+		stat_add(t->bytes, ret);
+		while (ret > 0) {
+			if ((size_t)ret >= iov[first].iov_len) {
+				ret -= iov[first++].iov_len;
+				continue;
+			}
+			iov[first].iov_base = (char *)iov[first].iov_base + ret;
+			iov[first].iov_len -= ret;
+			ret = 0;
+		}
+	}
+
+	stat_add(t->sent, first / 2);
+	return first / 2;
+}
+
+/**
+ * @brief Appends the batch messages from @p first up to @p count
+ * to the target @p t spill file, or discards them if there is no
+ * room left.
+ */
+static void forward_spill(struct forward_target *t, int first, int count)
+{
+	struct iovec rec[2];
+	uint32_t len;
+
+	for (int i = first; i < count; i++) {
+		len = t->iovs[i].iov_len;
+		if (t->spill_fd < 0 ||
+		    t->spill_wr + (off_t)(sizeof(len) + len) > t->spill_max)
+		{
+			stat_inc(t->lost);
+			continue;
+		}
+
+		rec[0].iov_base = &len;
+		rec[0].iov_len  = sizeof(len);
+		rec[1].iov_base = t->msgs[i];
+		rec[1].iov_len  = len;
+		if (pwritev(t->spill_fd, rec, 2, t->spill_wr) !=
+		    (ssize_t)(sizeof(len) + len))
+		{
+			stat_inc(t->lost);
+			continue;
+		}
+
+		t->spill_wr += sizeof(len) + len;
+		stat_inc(t->spilled);
+	}
+	stat_set(t->backlog, t->spill_wr - t->spill_rd);
+}
+
+/**
+ * @brief Replays (in order) the target @p t spill file, in batches,
+ * until either it is empty or the connection is lost.
+ */
+static void forward_spill_replay(struct forward_target *t)
+{
+	uint32_t len;
+	off_t off;
+	int sent;
+	int n;
+
+	while (t->connected && t->spill_rd < t->spill_wr) {
+		off = t->spill_rd;
+		for (n = 0; n < fwd_batch_size && off < t->spill_wr; n++) {
+			if (pread(t->spill_fd, &len, sizeof(len), off) != sizeof(len) ||
+			    len >= MSG_MAX ||
+			    pread(t->spill_fd, t->msgs[n], len, off + sizeof(len)) != len)
+			{
+				/* Should not happen, but if so, the rest is unusable. */
+				log_msg("Forward target %s:%s: corrupted spill file!\n",
+					t->host, t->port);
+				t->spill_wr = off;
+				break;
+			}
+			t->iovs[n].iov_len = len;
+			off += sizeof(len) + len;
+		}
+
+		sent = forward_tcp_send(t, n);
+		for (int i = 0; i < sent; i++)
+			t->spill_rd += sizeof(len) + t->iovs[i].iov_len;
+		stat_add(t->replayed, sent);
+	}
+
+	/* Everything replayed: start over. */
+	if (t->spill_rd >= t->spill_wr) {
+		if (ftruncate(t->spill_fd, 0) < 0)
+			log_errno("Unable to truncate spill file");
+		t->spill_rd = t->spill_wr = 0;
+	}
+	stat_set(t->backlog, t->spill_wr - t->spill_rd);
+}
+
+/**
+ * @brief Pops up to FORWARD_BATCH messages from the target @p t
+ * queue into its batch buffers, waiting up to @p timeout_ms for
+ * the first one (or forever, if -1).
+ *
+ * @return Returns the amount of messages popped.
+ */
+static int forward_pop_batch(struct forward_target *t, int timeout_ms)
+{
+	struct log_event ev;
+	int n = 0;
+
+	if (fifo_pop_timeout(&t->fifo, &ev, timeout_ms) < 0)
+		return 0;
+
+	/* Take whatever else is already queued, without blocking. */
+	do {
+		memcpy(t->msgs[n], ev.msg, ev.len);
+		t->iovs[n].iov_len = ev.len;
+		fifo_release(&t->fifo, &ev);
+		n++;
+	} while (n < fwd_batch_size && !fifo_try_pop(&t->fifo, &ev));
+
+	return n;
+}
+
+/**
+ * @brief Sender thread (UDP): drains the target queue in batches
+ * of up to FORWARD_BATCH messages.
+ */
+static void *forward_loop(void *p)
+{
+	struct forward_target *t = p;
+	for (;;)
+		forward_send(t, forward_pop_batch(t, -1));
+	return NULL;
+}
+
+/**
+ * @brief Sender thread (TCP): drains the target queue in batches of
+ * up to FORWARD_BATCH messages while connected, or into the spill
+ * file while not, reconnecting (and replaying the spill file) as
+ * soon as possible.
+ *
+ * Without a spill file, messages are kept in the queue instead,
+ * which evicts the oldest ones if full.
+ */
+static void *forward_tcp_loop(void *p)
+{
+	struct forward_target *t = p;
+	long long wait;
+	int sent;
+	int n;
+
+	for (;;) {
+		if (!t->connected && forward_now_ms() >= t->next_retry)
+			forward_tcp_connect(t);
+		if (t->connected && t->spill_rd < t->spill_wr)
+			forward_spill_replay(t);
+
+		wait = -1;
+		if (!t->connected)
+			wait = MAX(t->next_retry - forward_now_ms(), 0);
+
+		if (!t->connected && t->spill_fd < 0) {
+			usleep(wait * 1000);
+			continue;
+		}
+
+		if (!(n = forward_pop_batch(t, wait)))
+			continue;
+
+		sent = 0;
+		if (t->connected)
+			sent = forward_tcp_send(t, n);
+		if (sent < n)
+			forward_spill(t, sent, n);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Retrieves the target string @p str (i.e., FORWARDn_str)
+ * from the environment variables.
+ *
+ * @param idx      Target number.
+ * @param str      String identifier.
+ * @param required Whether the var must be set.
+ *
+ * @return Returns the string, or NULL if not set.
+ */
+static char *get_target_str(int idx, const char *str, int required)
+{
+	char var[64];
+	char *env;
+
+	snprintf(var, sizeof var, "FORWARD%d_%s", idx, str);
+	if (!(env = getenv(var)) && required)
+		panic("Unable to find %s, please check the forward targets!\n", var);
+	return env;
+}
+
+/**
+ * @brief Resolves the target @p t address and, for UDP, creates
+ * its socket (TCP ones are created on connect).
+ */
+static void forward_init_socket(struct forward_target *t)
+{
+	struct addrinfo hints, *results, *try;
+	int sock = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (t->proto != FWD_PROTO_UDP)
+		hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(t->host, t->port, &hints, &results) != 0)
+		panic_errno("Unable to getaddrinfo...");
+
+	/* Iterate over results. */
+	for (try = results; try != NULL; try = try->ai_next) {
+		sock = socket(try->ai_family, try->ai_socktype, try->ai_protocol);
+		if (sock < 0)
+			continue;
+		break;
+	}
+
+	if (sock < 0)
+		panic("Unable to create a socket for forward...\n");
+
+	t->addr = try;
+	t->fd   = sock;
+	if (t->proto != FWD_PROTO_UDP) {
+		close(sock);
+		t->fd = -1;
+	}
+}
+
+/**
+ * @brief Opens (and truncates) the target @p idx spill file, with
+ * up to @p max bytes. If it cannot be opened, messages are kept in
+ * the queue instead.
+ */
+static void forward_init_spill(struct forward_target *t, int idx, long max)
+{
+	char path[64];
+	struct stat sb;
+
+	t->spill_fd  = -1;
+	t->spill_max = max;
+	if (!max)
+		return;
+
+	if (stat("log", &sb) < 0 && mkdir("log", 0755) < 0)
+		goto fail;
+
+	snprintf(path, sizeof path, FORWARD_SPILL_FILE, idx);
+	t->spill_fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (t->spill_fd >= 0)
+		return;
+fail:
+	log_msg("Unable to create spill file for FORWARD%d: %s\n", idx,
+		strerror(errno));
+}
+
+/**
+ * @brief Allocates the target @p t queue (with @p bytes bytes) and
+ * its batch buffers, and starts its sender thread.
+ */
+static void forward_init_queue(struct forward_target *t, long bytes)
+{
+	void *(*loop)(void *) = forward_loop;
+
+	if (fifo_init(&t->fifo, bytes, FIFO_DROP_OLDEST, 0) < 0)
+		panic("Unable to initialize forward queue!\n");
+
+	t->msgs = calloc(fwd_batch_size, MSG_MAX);
+	t->iovs = calloc(fwd_batch_size, sizeof(struct iovec));
+	t->hdrs = calloc(fwd_batch_size, sizeof(struct mmsghdr));
+	if (!t->msgs || !t->iovs || !t->hdrs)
+		panic("Unable to allocate forward buffers!\n");
+
+	for (int i = 0; i < fwd_batch_size; i++) {
+		t->iovs[i].iov_base = t->msgs[i];
+		t->hdrs[i].msg_hdr.msg_iov     = &t->iovs[i];
+		t->hdrs[i].msg_hdr.msg_iovlen  = 1;
+		t->hdrs[i].msg_hdr.msg_name    = t->addr->ai_addr;
+		t->hdrs[i].msg_hdr.msg_namelen = t->addr->ai_addrlen;
+	}
+
+	if (t->proto != FWD_PROTO_UDP) {
+		t->tcp_iovs = calloc(2 * fwd_batch_size, sizeof(struct iovec));
+		t->prefixes = calloc(fwd_batch_size, sizeof(*t->prefixes));
+		if (!t->tcp_iovs || !t->prefixes)
+			panic("Unable to allocate forward buffers!\n");
+		t->backoff_ms = FORWARD_BACKOFF_MIN_MS;
+		loop = forward_tcp_loop;
+	}
+
+	if (pthread_create(&t->thread, NULL, loop, t))
+		panic_errno("Unable to create forwarder thread!");
+}
+
+/**
+ * @brief Reads the forward protocol from the environment var
+ * @p var, if any.
+ *
+ * @return Returns the protocol, UDP by default.
+ */
+static int forward_get_proto(const char *var)
+{
+	char *env;
+	int i;
+
+	if (!(env = getenv(var)))
+		return FWD_PROTO_UDP;
+
+	for (i = 0; i < PROTOS_LEN; i++)
+		if (!strcmp(env, protos[i]))
+			return i;
+
+	panic("Invalid %s (%s)!\n", var, env);
+}
+
+/**
+ * @brief Reads the target @p idx filter (FORWARDn_MATCH_TYPE
+ * and FORWARDn_MATCH_STR), if any.
+ */
+static void forward_init_filter(struct forward_target *t, int idx)
+{
+	char *type;
+	int i;
+
+	t->match_type = FWD_MATCH_ALL;
+	if (!(t->match_str = get_target_str(idx, "MATCH_STR", 0)))
+		return;
+
+	t->match_type = FWD_MATCH_SUBSTR;
+	if ((type = get_target_str(idx, "MATCH_TYPE", 0))) {
+		for (i = 0; i < MATCH_TYPES_LEN; i++)
+			if (!strcmp(type, match_types[i]))
+				break;
+		if (i == MATCH_TYPES_LEN)
+			panic("Invalid FORWARD%d_MATCH_TYPE (%s)!\n", idx, type);
+		t->match_type = i;
+	}
+
+	if (t->match_type == FWD_MATCH_REGEX &&
+	    regcomp(&t->regex, t->match_str, REG_EXTENDED|REG_NOSUB))
+	{
+		panic("Unable to compile regex (%s) for FORWARD%d!!!",
+			t->match_str, idx);
+	}
+}
+
+/**
+ * @brief Initializes the forwarding to the syslog servers, if
+ * any, and starts their sender threads.
+ *
+ * Targets are either a single one, with FORWARD_HOST,
+ * FORWARD_PORT and FORWARD_PROTO, or a list of FORWARD_TARGETS
+ * targets, each with its own FORWARDn_HOST, FORWARDn_PORT,
+ * FORWARDn_PROTO and (optional) FORWARDn_MATCH_TYPE and
+ * FORWARDn_MATCH_STR filter.
+ *
+ * @return Returns 0.
+ */
+int forward_init(void)
+{
+	struct forward_target *t;
+	char *host, *port;
+	char var[64];
+	long spill;
+	long bytes;
+	int count;
+
+	/* Check if we should forward messages. */
+	host  = getenv("FORWARD_HOST");
+	port  = getenv("FORWARD_PORT");
+	count = syslog_get_env_int("FORWARD_TARGETS", 0, 0, MAX_FORWARD_TARGETS);
+	if (!host && !port && !count) {
+		log_msg("Forward Mode: disabled\n\n");
+		return 0;
+	}
+
+	if (count && (host || port))
+		panic("FORWARD_HOST/PORT and FORWARD_TARGETS are mutually exclusive!\n");
+
+	if (!count) {
+		if (!host || !port)
+			panic("FORWARD_ADDR and FORWARD_PORT must be specified!\n");
+		targets[0].host       = host;
+		targets[0].port       = port;
+		targets[0].proto      = forward_get_proto("FORWARD_PROTO");
+		targets[0].match_type = FWD_MATCH_ALL;
+		count = 1;
+	}
+	else {
+		for (int i = 0; i < count; i++) {
+			snprintf(var, sizeof var, "FORWARD%d_PROTO", i);
+			targets[i].host  = get_target_str(i, "HOST", 1);
+			targets[i].port  = get_target_str(i, "PORT", 1);
+			targets[i].proto = forward_get_proto(var);
+			forward_init_filter(&targets[i], i);
+		}
+	}
+
+	bytes = syslog_get_env_int("FORWARD_FIFO_BYTES",
+		FORWARD_FIFO_DEFAULT_BYTES, FIFO_MIN_BYTES, FIFO_MAX_BYTES);
+	fwd_batch_size = syslog_get_env_int("FORWARD_BATCH",
+		FORWARD_BATCH_DEFAULT, 1, FORWARD_BATCH_MAX);
+	spill = syslog_get_env_int("FORWARD_SPILL_BYTES",
+		FORWARD_SPILL_DEFAULT_BYTES, 0, FORWARD_SPILL_MAX_BYTES);
+
+	log_msg("Forward Mode: enabled:\n");
+	log_msg("----------------------\n");
+
+	for (int i = 0; i < count; i++) {
+		t = &targets[i];
+		forward_init_socket(t);
+		if (t->proto != FWD_PROTO_UDP)
+			forward_init_spill(t, i, spill);
+		forward_init_queue(t, bytes);
+
+		if (t->match_type == FWD_MATCH_ALL)
+			log_msg("FORWARD%d: %s:%s/%s\n", i, t->host, t->port,
+				protos[t->proto]);
+		else
+			log_msg("FORWARD%d: %s:%s/%s (%s: %s)\n", i, t->host,
+				t->port, protos[t->proto], match_types[t->match_type],
+				t->match_str);
+	}
+
+	log_msg("FORWARD_BATCH: %d\n\n", fwd_batch_size);
+
+	/* Enabled only now, with everything in place. */
+	num_targets = count;
+	stats_register("forward", forward_dump_stats);
+	return 0;
+}
+
+/**
+ * @brief Checks whether the message @p msg should be forwarded
+ * to the target @p t.
+ */
+static int forward_match(struct forward_target *t, const char *msg)
+{
+	switch (t->match_type) {
+	case FWD_MATCH_SUBSTR:
+		return strstr(msg, t->match_str) != NULL;
+	case FWD_MATCH_REGEX:
+		return !regexec(&t->regex, msg, 0, NULL, 0);
+	default:
+		return 1;
+	}
+}
+
+/**
+ * @brief Queues the message @p msg (NUL-terminated) of length
+ * @p len to be forwarded to every target whose filter matches.
+ *
+ * This never blocks: if a target queue is full, its oldest
+ * message is evicted.
+ *
+ * @param msg       Message to be forwarded.
+ * @param len       Message length.
+ * @param timestamp Reception timestamp.
+ */
+void forward_msg(const char *msg, size_t len, time_t timestamp)
+{
+	struct forward_target *t;
+
+	for (int i = 0; i < num_targets; i++) {
+		t = &targets[i];
+		if (!forward_match(t, msg)) {
+			stat_inc(t->filtered);
+			continue;
+		}
+		fifo_push(&t->fifo, msg, len, timestamp, 0);
+	}
+}
+
+/**
+ * @brief Wakes up the sender threads (if sleeping) after one
+ * or more calls to forward_msg().
+ */
+void forward_wake(void)
+{
+	for (int i = 0; i < num_targets; i++)
+		fifo_wake(&targets[i].fifo);
+}
@@ -0,0 +1,105 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef FORWARD_H
+#define FORWARD_H
+
+	#include <pthread.h>
+	#include <regex.h>
+	#include <stddef.h>
+	#include <time.h>
+	#include <netdb.h>
+	#include <sys/types.h>
+	#include "fifo.h"
+	#include "stats.h"
+
+	/* Maximum amount of forward targets (FORWARD_TARGETS env var). */
+	#define MAX_FORWARD_TARGETS 8
+
+	/* Forward queue memory budget (FORWARD_FIFO_BYTES env var). */
+	#define FORWARD_FIFO_DEFAULT_BYTES (64 << 10)
+
+	/* Maximum (and default) amount of datagrams per sendmmsg(). */
+	#define FORWARD_BATCH_MAX     64
+	#define FORWARD_BATCH_DEFAULT 16
+
+	/* Forward protocols (FORWARDn_PROTO env var). */
+	#define FWD_PROTO_UDP       0 /* Fire-and-forget datagrams.        */
+	#define FWD_PROTO_TCP       1 /* LF-terminated messages.           */
+	#define FWD_PROTO_TCP_OCTET 2 /* Octet-counted messages (RFC 6587). */
+
+	/* TCP: reconnect backoff and max time blocked on a send. */
+	#define FORWARD_BACKOFF_MIN_MS 500
+	#define FORWARD_BACKOFF_MAX_MS 60000
+	#define FORWARD_SEND_TIMEOUT_S 5
+
+	/* TCP: spill file size (FORWARD_SPILL_BYTES env var). */
+	#define FORWARD_SPILL_DEFAULT_BYTES (1 << 20)
+	#define FORWARD_SPILL_MAX_BYTES     (1 << 30)
+	#define FORWARD_SPILL_FILE          "log/forward%d.spill"
+
+	/* Filter match types. */
+	#define FWD_MATCH_ALL    -1
+	#define FWD_MATCH_SUBSTR  0
+	#define FWD_MATCH_REGEX   1
+
+	/*
+	 * Forward target: each one has its own queue and sender
+	 * thread, so that a slow target does not hold the others.
+	 */
+	struct forward_target {
+		const char *host;
+		const char *port;
+		struct addrinfo *addr;
+		int proto;
+		int fd;
+
+		/* Filter: which messages are forwarded. */
+		int match_type;
+		const char *match_str;
+		regex_t regex;
+
+		/* Queue, sender thread and batch buffers. */
+		struct fifo fifo;
+		pthread_t thread;
+		char (*msgs)[MSG_MAX];
+		struct iovec *iovs;
+		struct mmsghdr *hdrs;
+
+		/*
+		 * TCP only: connection state, framing buffers and the spill
+		 * file, which holds (in order) everything that could not be
+		 * sent while disconnected, as a sequence of 'u32 len + msg'.
+		 */
+		int connected;
+		int backoff_ms;
+		long long next_retry;    /* Monotonic, in ms. */
+		struct iovec *tcp_iovs;  /* Two per message.  */
+		char (*prefixes)[16];    /* Octet counts.     */
+		int spill_fd;
+		long spill_max;
+		off_t spill_rd;          /* Next record to be replayed.   */
+		off_t spill_wr;          /* End of file, next record.     */
+
+		/* Statistics. */
+		stat_t sent;
+		stat_t syscalls;
+		stat_t errors;
+		stat_t filtered;
+		stat_t bytes;
+		stat_t connects;
+		stat_t connect_fails;
+		stat_t spilled;
+		stat_t replayed;
+		stat_t lost;
+		stat_t backlog;
+		int failing;
+	};
+
+	extern int forward_init(void);
+	extern void forward_msg(const char *msg, size_t len, time_t timestamp);
+	extern void forward_wake(void);
+
+#endif /* FORWARD_H */
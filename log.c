@@ -23,6 +23,9 @@
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int curr_file;
 
+/* Capture buffer of the calling thread, NULL if not capturing. */
+static _Thread_local struct log_buf *log_buf;
+
 /* There should *always* be a corresponding close_log_file() call. */
 static inline void open_log_file(void)
 {
@@ -64,15 +67,90 @@ out:
  */
 char *get_formatted_time(time_t time, char *time_str)
 {
+	struct tm tm;
 	strftime(
 		time_str,
 		32,
 		"%Y-%m-%d %H:%M:%S",
-		localtime(&time)
+		localtime_r(&time, &tm)
 	);
 	return time_str;
 }
 
+/**
+ * @brief Appends the formatted string @p fmt to the capture
+ * buffer @p b, growing it if needed.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int buf_vprintf(struct log_buf *b, const char *fmt, va_list ap)
+{
+	size_t cap;
+	va_list cp;
+	char *p;
+	int n;
+
+	va_copy(cp, ap);
+	n = vsnprintf(b->data ? b->data + b->len : NULL, b->cap - b->len,
+		fmt, cp);
+	va_end(cp);
+	if (n < 0)
+		return -1;
+
+	if (b->len + n >= b->cap) {
+		for (cap = b->cap ? b->cap : 256; cap <= b->len + n; cap *= 2);
+		if (!(p = realloc(b->data, cap)))
+			return -1;
+		b->data = p;
+		b->cap  = cap;
+		vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+	}
+	b->len += n;
+	return 0;
+}
+
+/**
+ * @brief Same as buf_vprintf(), but variadic.
+ */
+static int buf_printf(struct log_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+	va_start(ap, fmt);
+	ret = buf_vprintf(b, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+/**
+ * @brief Captures the log output of the calling thread into
+ * @p buf, instead of writing it, until called again with NULL.
+ * The captured output is meant to be written later (in a
+ * different order, maybe) with log_write().
+ *
+ * @param buf Capture buffer, or NULL to stop capturing.
+ */
+void log_capture(struct log_buf *buf) {
+	log_buf = buf;
+}
+
+/**
+ * @brief Writes the @p len bytes of @p buf, as is, to the log.
+ *
+ * @param buf Previously captured output.
+ * @param len Length, in bytes.
+ */
+void log_write(const char *buf, size_t len)
+{
+	ssize_t ret;
+	open_log_file();
+		for (; len; buf += ret, len -= ret) {
+			if ((ret = write(curr_file, buf, len)) <= 0)
+				break;
+		}
+	close_log_file();
+}
+
 /**
  * @brief Receives a formated string and outputs to stdout
  * with the current timestamp.
@@ -82,7 +160,22 @@ char *get_formatted_time(time_t time, char *time_str)
 void log_msg(const char *fmt, ...)
 {
 	char time_str[32] = {0};
+	size_t len;
 	va_list ap;
+	int ret;
+
+	if (log_buf) {
+		len = log_buf->len;
+		va_start(ap, fmt);
+		ret = buf_printf(log_buf, "[%s] ",
+			get_formatted_time(time(NULL), time_str));
+		if (!ret)
+			ret = buf_vprintf(log_buf, fmt, ap);
+		va_end(ap);
+		if (!ret)
+			return;
+		log_buf->len = len; /* Out of memory, write it now. */
+	}
 
 	open_log_file();
 		dprintf(curr_file, "[%s] ", get_formatted_time(time(NULL), time_str));
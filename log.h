@@ -31,9 +31,18 @@
 
 	#define LOG_FILE "log/log.txt"
 
+	/* Captured log output, see log_capture(). */
+	struct log_buf {
+		char  *data;
+		size_t len;
+		size_t cap;
+	};
+
 	extern char *get_formatted_time(time_t time, char *time_str);
 	extern void print_log_event(struct log_event *ev);
 	extern void log_msg(const char *fmt, ...);
+	extern void log_capture(struct log_buf *buf);
+	extern void log_write(const char *buf, size_t len);
 	extern void log_init(void);
 
 #endif /* LOG_H */
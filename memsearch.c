@@ -0,0 +1,382 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+#define MS_NEON
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+#include "memsearch.h"
+
+/*
+ * Vectorized substring search
+ *
+ * Both kernels compare a whole vector of the haystack at once: memchr
+ * against the byte itself, and memmem against the first and the last
+ * bytes of the needle, at the same time ('generic SIMD' filter, by
+ * Wojciech Mula). Only the positions where both of them match are then
+ * verified with memcmp(), which is rare on real text. Instead of a
+ * scalar tail, the last vector overlaps the previous one, since log
+ * lines are short.
+ *
+ * Implementations: SSE2 and AVX2 on x86, NEON on aarch64 and ARMv7
+ * (if built with NEON enabled), and a scalar fallback (i.e., for
+ * ARMv6), which relies on libc's memchr() for the first byte.
+ */
+
+const char *const ms_impls_str[MS_IMPLS_LEN] = {
+	"scalar", "sse2", "avx2", "neon"
+};
+
+#if defined(MS_X86) || defined(MS_NEON)
+/**
+ * @brief Scalar memmem() for the positions @p i and on, for
+ * haystacks shorter than a vector.
+ */
+static const char *tail_memmem(const char *h, size_t hlen, const char *n,
+	size_t nlen, size_t i)
+{
+	for (; i + nlen <= hlen; i++) {
+		if (h[i] == n[0] && h[i + nlen - 1] == n[nlen - 1] &&
+			!memcmp(h + i + 1, n + 1, nlen - 2))
+		{
+			return h + i;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Scalar memchr(), libc's one.
+ */
+static const char *scalar_memchr(const char *s, int c, size_t n) {
+	return memchr(s, c, n);
+}
+
+/**
+ * @brief Scalar memmem(): memchr() for the first byte, then the last
+ * one, then the rest.
+ */
+static const char *scalar_memmem(const char *h, size_t hlen, const char *n,
+	size_t nlen)
+{
+	const char *p;
+	size_t i;
+
+	if (!nlen)
+		return h;
+	if (nlen > hlen)
+		return NULL;
+	if (nlen == 1)
+		return memchr(h, n[0], hlen);
+
+	for (i = 0; i + nlen <= hlen; i++) {
+		if (!(p = memchr(h + i, n[0], hlen - nlen + 1 - i)))
+			return NULL;
+		i = p - h;
+		if (h[i + nlen - 1] == n[nlen - 1] &&
+			!memcmp(h + i + 1, n + 1, nlen - 2))
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+///////////////////////////////// X86 /////////////////////////////////////////
+#ifdef MS_X86
+
+__attribute__((target("sse2")))
+static const char *sse2_memchr(const char *s, int c, size_t n)
+{
+	__m128i v = _mm_set1_epi8((char)c);
+	unsigned mask;
+	size_t i;
+
+	if (n < 16)
+		return memchr(s, c, n);
+
+	for (i = 0;; i += 16) {
+		/* Last block overlaps the previous one. */
+		if (i + 16 > n)
+			i = n - 16;
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(s + i)), v));
+		if (mask)
+			return s + i + __builtin_ctz(mask);
+		if (i + 16 == n)
+			return NULL;
+	}
+}
+
+__attribute__((target("sse2")))
+static const char *sse2_memmem(const char *h, size_t hlen, const char *n,
+	size_t nlen)
+{
+	__m128i first, last, a, b;
+	unsigned mask;
+	size_t i, end;
+
+	if (!nlen)
+		return h;
+	if (nlen > hlen)
+		return NULL;
+	if (nlen == 1)
+		return sse2_memchr(h, n[0], hlen);
+
+	first = _mm_set1_epi8(n[0]);
+	last  = _mm_set1_epi8(n[nlen - 1]);
+
+	/* Positions to check. */
+	end = hlen - nlen + 1;
+	if (end < 16)
+		return tail_memmem(h, hlen, n, nlen, 0);
+
+	for (i = 0;; i += 16) {
+		if (i + 16 > end)
+			i = end - 16;
+		a = _mm_loadu_si128((const __m128i *)(h + i));
+		b = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		for (; mask; mask &= mask - 1) {
+			if (!memcmp(h + i + __builtin_ctz(mask) + 1, n + 1, nlen - 2))
+				return h + i + __builtin_ctz(mask);
+		}
+		if (i + 16 == end)
+			return NULL;
+	}
+}
+
+__attribute__((target("avx2")))
+static const char *avx2_memchr(const char *s, int c, size_t n)
+{
+	__m256i v = _mm256_set1_epi8((char)c);
+	unsigned mask;
+	size_t i;
+
+	if (n < 32)
+		return sse2_memchr(s, c, n);
+
+	for (i = 0;; i += 32) {
+		if (i + 32 > n)
+			i = n - 32;
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(s + i)), v));
+		if (mask)
+			return s + i + __builtin_ctz(mask);
+		if (i + 32 == n)
+			return NULL;
+	}
+}
+
+__attribute__((target("avx2")))
+static const char *avx2_memmem(const char *h, size_t hlen, const char *n,
+	size_t nlen)
+{
+	__m256i first, last, a, b;
+	unsigned mask;
+	size_t i, end;
+
+	if (!nlen)
+		return h;
+	if (nlen > hlen)
+		return NULL;
+	if (nlen == 1)
+		return avx2_memchr(h, n[0], hlen);
+
+	first = _mm256_set1_epi8(n[0]);
+	last  = _mm256_set1_epi8(n[nlen - 1]);
+
+	end = hlen - nlen + 1;
+	if (end < 32)
+		return sse2_memmem(h, hlen, n, nlen);
+
+	for (i = 0;; i += 32) {
+		if (i + 32 > end)
+			i = end - 32;
+		a = _mm256_loadu_si256((const __m256i *)(h + i));
+		b = _mm256_loadu_si256((const __m256i *)(h + i + nlen - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+		for (; mask; mask &= mask - 1) {
+			if (!memcmp(h + i + __builtin_ctz(mask) + 1, n + 1, nlen - 2))
+				return h + i + __builtin_ctz(mask);
+		}
+		if (i + 32 == end)
+			return NULL;
+	}
+}
+
+#endif /* MS_X86 */
+
+///////////////////////////////// NEON ////////////////////////////////////////
+#ifdef MS_NEON
+
+/**
+ * @brief Narrows the byte comparison @p eq into a 64-bit mask, with
+ * only the top bit of each nibble set, one nibble per byte.
+ */
+static inline uint64_t neon_mask(uint8x16_t eq)
+{
+	uint8x8_t r = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(r), 0) & 0x8888888888888888ULL;
+}
+
+static const char *neon_memchr(const char *s, int c, size_t n)
+{
+	uint8x16_t v = vdupq_n_u8((uint8_t)c);
+	uint64_t mask;
+	size_t i;
+
+	if (n < 16)
+		return memchr(s, c, n);
+
+	for (i = 0;; i += 16) {
+		if (i + 16 > n)
+			i = n - 16;
+		mask = neon_mask(vceqq_u8(vld1q_u8((const uint8_t *)s + i), v));
+		if (mask)
+			return s + i + (__builtin_ctzll(mask) >> 2);
+		if (i + 16 == n)
+			return NULL;
+	}
+}
+
+static const char *neon_memmem(const char *h, size_t hlen, const char *n,
+	size_t nlen)
+{
+	uint8x16_t first, last, a, b;
+	uint64_t mask;
+	size_t i, end, bit;
+
+	if (!nlen)
+		return h;
+	if (nlen > hlen)
+		return NULL;
+	if (nlen == 1)
+		return neon_memchr(h, n[0], hlen);
+
+	first = vdupq_n_u8((uint8_t)n[0]);
+	last  = vdupq_n_u8((uint8_t)n[nlen - 1]);
+
+	end = hlen - nlen + 1;
+	if (end < 16)
+		return tail_memmem(h, hlen, n, nlen, 0);
+
+	for (i = 0;; i += 16) {
+		if (i + 16 > end)
+			i = end - 16;
+		a = vld1q_u8((const uint8_t *)h + i);
+		b = vld1q_u8((const uint8_t *)h + i + nlen - 1);
+		mask = neon_mask(vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last)));
+
+		for (; mask; mask &= mask - 1) {
+			bit = __builtin_ctzll(mask) >> 2;
+			if (!memcmp(h + i + bit + 1, n + 1, nlen - 2))
+				return h + i + bit;
+		}
+		if (i + 16 == end)
+			return NULL;
+	}
+}
+
+#endif /* MS_NEON */
+
+///////////////////////////////// DISPATCH ////////////////////////////////////
+
+static const struct ms_kernel {
+	const char *(*memchr)(const char *, int, size_t);
+	const char *(*memmem)(const char *, size_t, const char *, size_t);
+} kernels[MS_IMPLS_LEN] = {
+	[MS_IMPL_SCALAR] = {scalar_memchr, scalar_memmem},
+#ifdef MS_X86
+	[MS_IMPL_SSE2]   = {sse2_memchr, sse2_memmem},
+	[MS_IMPL_AVX2]   = {avx2_memchr, avx2_memmem},
+#endif
+#ifdef MS_NEON
+	[MS_IMPL_NEON]   = {neon_memchr, neon_memmem},
+#endif
+};
+
+/* Current kernel, scalar until ms_init(). */
+const char *(*ms_memchr)(const char *s, int c, size_t n) = scalar_memchr;
+const char *(*ms_memmem)(const char *h, size_t hlen,
+	const char *n, size_t nlen) = scalar_memmem;
+
+/**
+ * @brief Checks whether the kernel @p impl was built in and is
+ * supported by the running CPU.
+ *
+ * @return Returns 1 if supported, 0 otherwise.
+ */
+int ms_impl_supported(int impl)
+{
+	if (impl < 0 || impl >= MS_IMPLS_LEN || !kernels[impl].memchr)
+		return 0;
+
+	switch (impl) {
+#ifdef MS_X86
+	case MS_IMPL_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case MS_IMPL_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+#if defined(MS_NEON) && defined(__arm__)
+	case MS_IMPL_NEON:
+		return !!(getauxval(AT_HWCAP) & HWCAP_NEON);
+#endif
+	default:
+		return 1;
+	}
+}
+
+/**
+ * @brief Selects the kernel @p impl, if supported.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int ms_select(int impl)
+{
+	if (!ms_impl_supported(impl))
+		return -1;
+
+	ms_memchr = kernels[impl].memchr;
+	ms_memmem = kernels[impl].memmem;
+	return 0;
+}
+
+/**
+ * @brief Selects the best kernel supported by the running CPU, must
+ * be called before any other thread uses the search functions.
+ *
+ * @return Returns the selected kernel.
+ */
+int ms_init(void)
+{
+	static const int order[] = {
+		MS_IMPL_AVX2, MS_IMPL_SSE2, MS_IMPL_NEON, MS_IMPL_SCALAR
+	};
+
+	for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+		if (!ms_select(order[i]))
+			return order[i];
+	return MS_IMPL_SCALAR;
+}
@@ -0,0 +1,28 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef MEMSEARCH_H
+#define MEMSEARCH_H
+
+	#include <stddef.h>
+
+	/* Search kernels, the best one is picked at runtime. */
+	#define MS_IMPL_SCALAR 0
+	#define MS_IMPL_SSE2   1
+	#define MS_IMPL_AVX2   2
+	#define MS_IMPL_NEON   3
+	#define MS_IMPLS_LEN   4
+
+	extern const char *const ms_impls_str[MS_IMPLS_LEN];
+
+	extern const char *(*ms_memchr)(const char *s, int c, size_t n);
+	extern const char *(*ms_memmem)(const char *h, size_t hlen,
+		const char *n, size_t nlen);
+
+	extern int ms_impl_supported(int impl);
+	extern int ms_select(int impl);
+	extern int ms_init(void);
+
+#endif /* MEMSEARCH_H */
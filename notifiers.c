@@ -5,11 +5,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <curl/curl.h>
 
 #include "log.h"
 #include "notifiers.h"
+#include "notify_queue.h"
 #include "str.h"
 
 /*
@@ -21,9 +22,6 @@ struct webhook_data {
 	const char *env_var;
 };
 
-/* EPOCH in secs of last sent notification. */
-static time_t time_last_sent_notify;
-
 /* Just to omit the print to stdout. */
 size_t libcurl_noop_cb(void *ptr, size_t size, size_t nmemb, void *data) {
 	((void)ptr);
@@ -31,25 +29,6 @@ size_t libcurl_noop_cb(void *ptr, size_t size, size_t nmemb, void *data) {
 	return size * nmemb;
 }
 
-/**
- * @brief Just updates the time (Epoch) of the last sent
- * notify.
- */
-void update_notify_last_sent(void) {
-	time_last_sent_notify = time(NULL);
-}
-
-/**
- * @brief Checks if the current time is within or not
- * the minimal threshold to send a nofication.
- *
- * @return Returns 1 if within the range (can send nofications),
- * 0 otherwise.
- */
-int is_within_notify_threshold(void) {
-	return (time(NULL) - time_last_sent_notify) > LAST_SENT_THRESHOLD_SECS;
-}
-
 /**
  * @brief Initializes and configures the CURL handle for sending a request.
  *
@@ -90,40 +69,23 @@ static void do_curl_cleanup(CURL *hnd, char *escape, struct curl_slist *slist)
 }
 
 /**
- * @brief Finally sends a curl request, check its return code
- * and then cleanup the resources allocated.
+ * @brief Queues a prepared curl request of the notifier @p self,
+ * to be sent in the background (see notify_queue.c), which then
+ * owns the handler and the string list.
  *
- * @param hnd    curl handler
- * @param escape Escape string if any (leave NULL if there's none).
- * @param slist  String list if any (leave NULL if there's none).
+ * @param self    Notifier.
+ * @param hnd     curl handler
+ * @param slist   String list if any (leave NULL if there's none).
+ * @param done    Completion callback, or NULL.
+ * @param cb_data Callback data.
  *
- * @return Returns CURLE_OK if success, !CURLE_OK if error.
+ * @return Returns 0 if queued, -1 if error.
  */
-static CURLcode do_curl(CURL *hnd, char *escape, struct curl_slist *slist)
+static int do_curl(const struct notifier *self, CURL *hnd,
+	struct curl_slist *slist, notify_cb done, void *cb_data)
 {
-	long response_code = 0;
-	CURLcode ret_curl  = !CURLE_OK;
-
-#ifndef DISABLE_NOTIFICATIONS
-	ret_curl = curl_easy_perform(hnd);
-	if (ret_curl != CURLE_OK) {
-		log_msg("> Unable to send request!\n");
-		goto error;
-	}
-	else {
-		curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &response_code);
-		log_msg("> Done!\n", response_code);
-		if (response_code != 200) {
-			log_msg("(Info: Response code != 200 (%ld), your message might "
-			        "not be correctly sent!)\n", response_code);
-		}
-	}
-#endif
-
-	ret_curl = CURLE_OK;
-error:
-	do_curl_cleanup(hnd, escape, slist);
-	return ret_curl;
+	log_msg("> Sending notification!\n");
+	return notify_submit(hnd, slist, self - notifiers, done, cb_data);
 }
 
 /**
@@ -161,7 +123,7 @@ static int setopts_post_json_curl(CURL *hnd, const char *url,
 #ifndef VALIDATE_CERTS
 	curl_easy_setopt(hnd, CURLOPT_SSL_VERIFYPEER, 0L);
 #endif
-	curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, json_payload);
+	curl_easy_setopt(hnd, CURLOPT_COPYPOSTFIELDS, json_payload);
 	*slist = s;
 	return 0;
 }
@@ -170,49 +132,60 @@ static int setopts_post_json_curl(CURL *hnd, const char *url,
  * @brief Sends a generic webhook POST request with JSON payload in the
  * format {"text": "text here"}.
  *
- * @param url  Target webhook URL.
- * @param text Text to be sent in the json payload.
+ * @param self    Notifier.
+ * @param url     Target webhook URL.
+ * @param text    Text to be sent in the json payload.
+ * @param done    Completion callback, or NULL.
+ * @param cb_data Callback data.
  *
- * @return Returns CURLE_OK if success, 1 if error.
+ * @return Returns 0 if success, -1 if error.
  */
-static int send_generic_webhook(const char *url, const char *text)
+static int send_generic_webhook(const struct notifier *self,
+	const char *url, const char *text, notify_cb done, void *cb_data)
 {
 	CURL *hnd               = NULL;
 	struct curl_slist *s    = NULL;
 	struct str_ab payload_data;
 	const char *t;
 
-	if (!(hnd = curl_easy_init())) {
-		log_msg("Failed to initialize libcurl!\n");
-		return 1;
-	}
-
 	ab_init(&payload_data);
 	ab_append_str(&payload_data, "{\"text\":\"", 9);
 
 	/* Append the payload data text while escaping double
-	 * quotes.
+	 * quotes, backslashes and line breaks (digests span
+	 * multiple lines).
 	 */
 	for (t = text; *t != '\0'; t++) {
-		if (*t != '"') {
-			if (ab_append_chr(&payload_data, *t) < 0)
-				return 1;
+		if (*t == '"' || *t == '\\') {
+			if (ab_append_chr(&payload_data, '\\') < 0 ||
+			    ab_append_chr(&payload_data, *t) < 0)
+				return -1;
+		}
+		else if (*t == '\n') {
+			if (ab_append_str(&payload_data, "\\n", 2) < 0)
+				return -1;
 		}
 		else {
-			if (ab_append_str(&payload_data, "\\\"", 2) < 0)
-				return 1;
+			if (ab_append_chr(&payload_data, *t) < 0)
+				return -1;
 		}
 	}
 
 	/* End the string. */
 	if (ab_append_str(&payload_data, "\"}", 2) < 0)
-		return 1;
+		return -1;
 
-	if (setopts_post_json_curl(hnd, url, payload_data.buff, &s))
-		return 1;
+	if (!(hnd = notify_handle(self - notifiers))) {
+		log_msg("Failed to initialize libcurl!\n");
+		return -1;
+	}
 
-	log_msg("> Sending notification!\n");
-	return do_curl(hnd, NULL, s);
+	if (setopts_post_json_curl(hnd, url, payload_data.buff, &s)) {
+		do_curl_cleanup(hnd, NULL, s);
+		return -1;
+	}
+
+	return do_curl(self, hnd, s, done, cb_data);
 }
 
 
@@ -242,19 +215,19 @@ void setup_telegram(struct notifier *self)
 			"- TELEGRAM_CHAT_ID\n"
 		);
 	}
-	setup = 1;
+	setup       = 1;
+	self->ready = 1;
 }
 
-static int send_telegram_notification(const struct notifier *self, const char *msg)
+static int send_telegram_notification(const struct notifier *self,
+	const char *msg, notify_cb done, void *cb_data)
 {
 	struct str_ab full_request_url;
 	char *escaped_msg = NULL;
 	CURL *hnd         = NULL;
 	int  ret;
 
-	((void)self);
-
-	if (!(hnd = curl_easy_init())) {
+	if (!(hnd = notify_handle(self - notifiers))) {
 		log_msg("Failed to initialize libcurl!\n");
 		return -1;
 	}
@@ -263,6 +236,7 @@ static int send_telegram_notification(const struct notifier *self, const char *m
 	if (!escaped_msg) {
 		log_msg("> Unable to escape notification message...\n");
 		do_curl_cleanup(hnd, escaped_msg, NULL);
+		return -1;
 	}
 
 	ab_init(&full_request_url);
@@ -271,12 +245,15 @@ static int send_telegram_notification(const struct notifier *self, const char *m
 		"https://api.telegram.org/bot%s/sendMessage?chat_id=%s&text=%s",
 		telegram_bot_token, telegram_chat_id, escaped_msg);
 
-	if (ret)
+	/* The URL is copied by curl. */
+	curl_free(escaped_msg);
+	if (ret) {
+		do_curl_cleanup(hnd, NULL, NULL);
 		return -1;
+	}
 
 	setopts_get_curl(hnd, full_request_url.buff);
-	log_msg("> Sending notification!\n");
-	return do_curl(hnd, escaped_msg, NULL);
+	return do_curl(self, hnd, NULL, done, cb_data);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -295,13 +272,15 @@ void setup_generic_webhook(struct notifier *self)
 		panic("Unable to find env vars, please check if you have set the %s!!\n",
 			data->env_var);
 	}
+	self->ready = 1;
 }
 
 static int send_generic_webhook_notification(
-	const struct notifier *self, const char *msg)
+	const struct notifier *self, const char *msg, notify_cb done,
+	void *cb_data)
 {
 	struct webhook_data *data = self->data;
-    return send_generic_webhook(data->webhook_url, msg);
+	return send_generic_webhook(self, data->webhook_url, msg, done, cb_data);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -310,14 +289,15 @@ static int send_generic_webhook_notification(
 
 /* Discord in Slack-compatible mode. */
 static int send_discord_notification(
-	const struct notifier *self, const char *msg)
+	const struct notifier *self, const char *msg, notify_cb done,
+	void *cb_data)
 {
 	struct webhook_data *data = self->data;
 	struct str_ab url;
 	ab_init(&url);
 	if (ab_append_fmt(&url, "%s/slack", data->webhook_url) < 0)
-		return 1;
-	return send_generic_webhook(url.buff, msg);
+		return -1;
+	return send_generic_webhook(self, url.buff, msg, done, cb_data);
 }
 
 ////////////////////////////////// END ////////////////////////////////////////
@@ -328,6 +308,12 @@ const char *const notifiers_str[] = {
 	"Generic1", "Generic2", "Generic3", "Generic4"
 };
 
+/* Prefix of the per-notifier environment vars, like TELEGRAM_TIMEOUT. */
+const char *const notifiers_env[] = {
+	"TELEGRAM", "SLACK",    "TEAMS",    "DISCORD",
+	"GENERIC1", "GENERIC2", "GENERIC3", "GENERIC4"
+};
+
 struct notifier notifiers[] = {
 	/* Telegram. */
 	{
@@ -387,3 +373,67 @@ struct notifier notifiers[] = {
 		                     {.env_var = "GENERIC4_WEBHOOK_URL"},
 	},
 };
+
+/**
+ * @brief Parses the comma-separated list of notifier names @p str
+ * (like 'Telegram,Slack') into the notifiers mask @p mask.
+ *
+ * @return Returns 0 if success, -1 if empty or with an unknown name.
+ */
+int notifiers_parse(const char *str, unsigned *mask)
+{
+	const char *end;
+	size_t len;
+	int i;
+
+	*mask = 0;
+	do {
+		while (*str == ' ')
+			str++;
+		for (end = str; *end && *end != ','; end++);
+		for (len = end - str; len && str[len - 1] == ' '; len--);
+
+		for (i = 0; i < NUM_NOTIFIERS; i++)
+			if (strlen(notifiers_str[i]) == len &&
+				!strncmp(str, notifiers_str[i], len))
+			{
+				break;
+			}
+		if (i == NUM_NOTIFIERS)
+			return -1;
+
+		*mask |= NOTIFIER_BIT(i);
+		str = end + 1;
+	} while (*end);
+	return 0;
+}
+
+/**
+ * @brief Writes the names of the notifiers in @p mask, separated by
+ * commas, into @p buf, of NOTIFIERS_NAMES_LEN bytes.
+ *
+ * @return Returns @p buf.
+ */
+const char *notifiers_names(unsigned mask, char *buf)
+{
+	size_t off = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		if (!(mask & NOTIFIER_BIT(i)))
+			continue;
+		off += snprintf(buf + off, NOTIFIERS_NAMES_LEN - off, "%s%s",
+			off ? "," : "", notifiers_str[i]);
+	}
+	return buf;
+}
+
+/**
+ * @brief Sets up each notifier in @p mask, if not yet.
+ */
+void notifiers_setup(unsigned mask)
+{
+	for (int i = 0; i < NUM_NOTIFIERS; i++)
+		if (mask & NOTIFIER_BIT(i))
+			notifiers[i].setup(&notifiers[i]);
+}
@@ -6,6 +6,8 @@
 #ifndef NOTIFIERS_H
 #define NOTIFIERS_H
 
+	#include "notify_queue.h"
+
 	/* Uncomment/comment to enable/disable the following settings. */
 	// #define CURL_VERBOSE
 	// #define VALIDATE_CERTS
@@ -24,12 +26,15 @@
 	#define NOTIFY_IDX_GENRC3  (NUM_NOTIFIERS-2)
 	#define NOTIFY_IDX_GENRC4  (NUM_NOTIFIERS-1)
 
+	/* Notifiers mask bit, for the events with several notifiers. */
+	#define NOTIFIER_BIT(idx) (1u << (idx))
+
+	/* Enough for all the names, see notifiers_names(). */
+	#define NOTIFIERS_NAMES_LEN 96
+
 	#define CURL_USER_AGENT "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 " \
 	                        "(KHTML, like Gecko) Chrome/125.0.0.0 Safari/537.36"
 
-	/* Minimum time (in secs) between two */
-	#define LAST_SENT_THRESHOLD_SECS 10
-
 	/* Notifiers list, like:
 	 * - Telegram
 	 * - Slack
@@ -37,16 +42,24 @@
 	 * - Teams
 	 */
 	extern const char *const notifiers_str[NUM_NOTIFIERS];
+	extern const char *const notifiers_env[NUM_NOTIFIERS];
 
-	/* Notifier struct. */
+	/*
+	 * Notifier struct: send_notification() queues the message, and
+	 * reports the request outcome to @p done (if not NULL), unless
+	 * it fails right away.
+	 */
 	struct notifier {
 		void *data;
+		int   ready; /* Whether already set up. */
 		void(*setup)(struct notifier *self);
-		int(*send_notification)(const struct notifier *self, const char *msg);
+		int(*send_notification)(const struct notifier *self, const char *msg,
+			notify_cb done, void *cb_data);
 	};
 
 	extern struct notifier notifiers[NUM_NOTIFIERS];
-	extern int is_within_notify_threshold(void);
-	extern void update_notify_last_sent(void);
+	extern int notifiers_parse(const char *str, unsigned *mask);
+	extern const char *notifiers_names(unsigned mask, char *buf);
+	extern void notifiers_setup(unsigned mask);
 
 #endif /* NOTIFIERS_H */
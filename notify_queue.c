@@ -0,0 +1,546 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "breaker.h"
+#include "log.h"
+#include "notifiers.h"
+#include "notify_queue.h"
+#include "stats.h"
+#include "syslog.h"
+
+/*
+ * Asynchronous notification queue
+ *
+ * A webhook round-trip takes hundreds of milliseconds, far more than
+ * matching a message, so notifiers do not perform their requests:
+ * they only prepare a curl handle and queue it here. A single thread
+ * then drives all of them at once with a curl multi handle, up to
+ * NOTIFY_INFLIGHT requests in flight, and reports each outcome (and
+ * its latency) to the request's completion callback.
+ *
+ * If requests arrive faster than they complete, they wait for a free
+ * slot in a queue per notifier, of up to NOTIFY_QUEUE requests (newer
+ * ones are dropped), and free slots go to each queue in turn: so, an
+ * alert fanned out to several notifiers (see worker_notify()) never
+ * waits behind the backlog of another one. While other notifiers have
+ * requests waiting too, a notifier does not start more requests once
+ * it takes half of the slots (rounded up), and its requests time out
+ * after <NOTIFIER>_CONNECT_TIMEOUT seconds to connect, or
+ * <NOTIFIER>_TIMEOUT seconds overall: so a hung webhook cannot hold
+ * back the others for long, while a lone notifier still gets all the
+ * slots.
+ *
+ * Handles are not freed once done, but kept in a pool per notifier
+ * (see notify_handle()), and all of them share the same DNS cache,
+ * connection cache and TLS session cache: so, alerts go out on warm
+ * keep-alive connections instead of paying the DNS, TCP and TLS
+ * handshakes every time, and when a connection is closed anyway, its
+ * TLS session is resumed.
+ */
+
+/* Queued request. */
+struct notify_req {
+	CURL *hnd;
+	struct curl_slist *slist; /* Request headers, if any.   */
+	int notif_idx;
+	notify_cb done;
+	void *data;
+	struct timespec queued;
+	struct notify_req *next;
+};
+
+static CURLM *multi;
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* Idle handles, per notifier, guarded by the mutex below. */
+static struct handle_pool {
+	CURL *hnds[NOTIFY_INFLIGHT_MAX];
+	int num;
+} pools[NUM_NOTIFIERS];
+/* In flight, only used by the notification thread. */
+static int num_inflight;
+static int inflight_of[NUM_NOTIFIERS];
+
+static int max_inflight = NOTIFY_INFLIGHT_DEFAULT;
+static int max_inflight_each;
+static int max_queued   = NOTIFY_QUEUE_DEFAULT;
+
+/* Timeouts, per notifier, in secs. */
+static long connect_timeout[NUM_NOTIFIERS];
+static long total_timeout[NUM_NOTIFIERS];
+
+/* Pending requests, per notifier, guarded by the mutex. */
+static pthread_mutex_t nq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pending {
+	struct notify_req *head;
+	struct notify_req *tail;
+	int num;
+} pending[NUM_NOTIFIERS];
+/* Next queue to take from, only used by the notification thread. */
+static int next_queue;
+
+/* Statistics. */
+static struct notify_stats {
+	stat_t sent;          /* Requests completed.           */
+	stat_t failed;        /* Transfer errors.              */
+	stat_t timeouts;      /* Transfer errors, timed out.   */
+	stat_t http_errors;   /* Completed, but status != 2xx. */
+	stat_t latency_ms;    /* Sum, since queued.            */
+	stat_t max_latency_ms;
+	stat_t new_conns;     /* Requests that connected.      */
+	stat_t reused_conns;  /* Requests on a warm connection. */
+	stat_t handshakes;    /* TLS handshakes.               */
+	stat_t handshake_ms;  /* Sum.                          */
+} notify_stats[NUM_NOTIFIERS];
+
+static stat_t queued;        /* Requests accepted.            */
+static stat_t dropped;       /* Requests dropped, queue full. */
+static stat_t in_flight;
+static stat_t max_in_flight;
+
+/**
+ * @brief Dumps the notification statistics, for each notifier
+ * used so far.
+ */
+static void notify_dump_stats(void)
+{
+	struct notify_stats *st;
+	unsigned long done;
+
+	log_msg("  queued          : %lu\n", stat_get(queued));
+	log_msg("  dropped         : %lu\n", stat_get(dropped));
+	log_msg("  in flight (max) : %lu (%lu)\n", stat_get(in_flight),
+		stat_get(max_in_flight));
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		st   = &notify_stats[i];
+		done = stat_get(st->sent) + stat_get(st->failed);
+		if (!done)
+			continue;
+		log_msg("  %-8s sent/failed/http errors: %lu / %lu / %lu, "
+			"latency avg/max: %lu / %lu ms\n", notifiers_str[i],
+			stat_get(st->sent), stat_get(st->failed),
+			stat_get(st->http_errors), stat_get(st->latency_ms) / done,
+			stat_get(st->max_latency_ms));
+		log_msg("  %-8s timeouts: %lu (connect/total: %ld / %ld s)\n",
+			notifiers_str[i], stat_get(st->timeouts), connect_timeout[i],
+			total_timeout[i]);
+		log_msg("  %-8s connections new/reused: %lu / %lu, "
+			"TLS handshakes: %lu (avg %lu ms)\n", notifiers_str[i],
+			stat_get(st->new_conns), stat_get(st->reused_conns),
+			stat_get(st->handshakes), stat_get(st->handshakes) ?
+			stat_get(st->handshake_ms) / stat_get(st->handshakes) : 0);
+	}
+}
+
+/**
+ * @brief Default completion callback: logs the request outcome.
+ */
+static void log_result(const struct notify_result *res)
+{
+	if (res->code != CURLE_OK) {
+		log_msg("> Unable to send notification through %s: %s\n",
+			notifiers_str[res->notif_idx], curl_easy_strerror(res->code));
+		return;
+	}
+
+	log_msg("> Notification sent through %s (%lu ms)\n",
+		notifiers_str[res->notif_idx], res->latency_ms);
+	if (res->status != 200) {
+		log_msg("(Info: Response code != 200 (%ld), your message might "
+		        "not be correctly sent!)\n", res->status);
+	}
+}
+
+/**
+ * @brief Locks the shared data @p data, for curl.
+ */
+static void share_lock(CURL *hnd, curl_lock_data data,
+	curl_lock_access access, void *p)
+{
+	((void)hnd);
+	((void)access);
+	((void)p);
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+/**
+ * @brief Unlocks the shared data @p data, for curl.
+ */
+static void share_unlock(CURL *hnd, curl_lock_data data, void *p)
+{
+	((void)hnd);
+	((void)p);
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+/**
+ * @brief Returns a curl handle for a new request of the notifier
+ * @p notif_idx: an idle one from its pool if any (whose options are
+ * reset, but keeps its caches), or a new one otherwise.
+ *
+ * @return Returns the handle, or NULL if error.
+ */
+CURL *notify_handle(int notif_idx)
+{
+	struct handle_pool *pool = &pools[notif_idx];
+	CURL *hnd = NULL;
+
+	pthread_mutex_lock(&nq_mutex);
+		if (pool->num)
+			hnd = pool->hnds[--pool->num];
+	pthread_mutex_unlock(&nq_mutex);
+
+	if (!hnd && !(hnd = curl_easy_init()))
+		return NULL;
+
+	curl_easy_setopt(hnd, CURLOPT_SHARE, share);
+	return hnd;
+}
+
+/**
+ * @brief Gives the handle @p hnd of the notifier @p notif_idx back
+ * to its pool, or frees it if the pool is full.
+ */
+static void put_handle(int notif_idx, CURL *hnd)
+{
+	struct handle_pool *pool = &pools[notif_idx];
+
+	curl_easy_reset(hnd);
+	pthread_mutex_lock(&nq_mutex);
+		if (pool->num < max_inflight) {
+			pool->hnds[pool->num++] = hnd;
+			hnd = NULL;
+		}
+	pthread_mutex_unlock(&nq_mutex);
+
+	if (hnd)
+		curl_easy_cleanup(hnd);
+}
+
+/**
+ * @brief Frees the request @p req and its curl resources.
+ */
+static void free_req(struct notify_req *req)
+{
+	curl_slist_free_all(req->slist);
+	put_handle(req->notif_idx, req->hnd);
+	free(req);
+}
+
+/**
+ * @brief Accounts the connection of the finished request @p req:
+ * whether it was reused, and its TLS handshake, if any.
+ */
+static void account_conn(struct notify_req *req)
+{
+	struct notify_stats *st = &notify_stats[req->notif_idx];
+	curl_off_t connect_us, appconnect_us;
+	long conns = 0;
+
+	curl_easy_getinfo(req->hnd, CURLINFO_NUM_CONNECTS, &conns);
+	if (!conns) {
+		stat_inc(st->reused_conns);
+		return;
+	}
+
+	stat_inc(st->new_conns);
+	if (curl_easy_getinfo(req->hnd, CURLINFO_CONNECT_TIME_T,
+		&connect_us) != CURLE_OK ||
+		curl_easy_getinfo(req->hnd, CURLINFO_APPCONNECT_TIME_T,
+		&appconnect_us) != CURLE_OK || appconnect_us <= 0)
+	{
+		return;
+	}
+
+	stat_inc(st->handshakes);
+	stat_add(st->handshake_ms, (appconnect_us - connect_us) / 1000);
+}
+
+/**
+ * @brief Reports the outcome @p code of the request @p req to its
+ * callback, updates the statistics and frees it.
+ */
+static void complete_req(struct notify_req *req, CURLcode code)
+{
+	struct notify_stats *st = &notify_stats[req->notif_idx];
+	struct notify_result res;
+	curl_off_t retry_after;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	res.notif_idx   = req->notif_idx;
+	res.code        = code;
+	res.status      = 0;
+	res.retry_after = 0;
+	res.data        = req->data;
+	res.latency_ms  = (now.tv_sec - req->queued.tv_sec) * 1000UL +
+		(now.tv_nsec - req->queued.tv_nsec) / 1000000;
+
+	if (code == CURLE_OK) {
+		curl_easy_getinfo(req->hnd, CURLINFO_RESPONSE_CODE, &res.status);
+		if (curl_easy_getinfo(req->hnd, CURLINFO_RETRY_AFTER,
+			&retry_after) == CURLE_OK)
+		{
+			res.retry_after = retry_after;
+		}
+		stat_inc(st->sent);
+		if (res.status < 200 || res.status > 299)
+			stat_inc(st->http_errors);
+	} else {
+		stat_inc(st->failed);
+		if (code == CURLE_OPERATION_TIMEDOUT)
+			stat_inc(st->timeouts);
+	}
+
+	stat_add(st->latency_ms, res.latency_ms);
+	stat_max(st->max_latency_ms, res.latency_ms);
+	account_conn(req);
+
+	breaker_result(req->notif_idx, !notify_retryable(&res));
+	req->done(&res);
+	free_req(req);
+}
+
+/**
+ * @brief Takes the oldest pending request of the next notifier (in
+ * turn) that is not already using its share of the slots, if other
+ * notifiers have pending requests too.
+ *
+ * @return Returns the request, or NULL if none.
+ */
+static struct notify_req *take_pending(void)
+{
+	struct notify_req *req = NULL;
+	struct pending *q;
+	int i, idx;
+	int waiting;
+
+	pthread_mutex_lock(&nq_mutex);
+		for (i = 0, waiting = 0; i < NUM_NOTIFIERS; i++)
+			waiting += (pending[i].head != NULL);
+
+		for (i = 0; i < NUM_NOTIFIERS && !req; i++) {
+			idx = (next_queue + i) % NUM_NOTIFIERS;
+			q   = &pending[idx];
+			if (!q->head)
+				continue;
+			if (waiting > 1 && inflight_of[idx] >= max_inflight_each)
+				continue;
+
+			req = q->head;
+			if (!(q->head = req->next))
+				q->tail = NULL;
+			q->num--;
+			next_queue = (idx + 1) % NUM_NOTIFIERS;
+		}
+	pthread_mutex_unlock(&nq_mutex);
+	return req;
+}
+
+/**
+ * @brief Moves pending requests to the multi handle, while there
+ * are free slots.
+ */
+static void start_pending(void)
+{
+	struct notify_req *req;
+
+	while (num_inflight < max_inflight) {
+		if (!(req = take_pending()))
+			return;
+
+		if (curl_multi_add_handle(multi, req->hnd) != CURLM_OK) {
+			complete_req(req, CURLE_FAILED_INIT);
+			continue;
+		}
+		inflight_of[req->notif_idx]++;
+		stat_set(in_flight, ++num_inflight);
+		stat_max(max_in_flight, num_inflight);
+	}
+}
+
+/**
+ * @brief Notification thread: drives all requests in flight, and
+ * completes them as they finish.
+ */
+static void *notify_thread(void *p)
+{
+	((void)p);
+
+	struct notify_req *req;
+	CURLMsg *msg;
+	int completed;
+	int running;
+	int left;
+
+	while (1) {
+		start_pending();
+		curl_multi_perform(multi, &running);
+
+		completed = 0;
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+			curl_multi_remove_handle(multi, req->hnd);
+			inflight_of[req->notif_idx]--;
+			stat_set(in_flight, --num_inflight);
+			complete_req(req, msg->data.result);
+			completed++;
+		}
+
+		/* Slots were freed: starts the pending requests right away. */
+		if (completed)
+			continue;
+
+		/* Sleeps until some transfer progresses, or new requests. */
+		curl_multi_poll(multi, NULL, 0, 1000, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Queues the prepared request @p hnd to be sent in the
+ * background, taking ownership of it (and of @p slist).
+ *
+ * @param hnd       Curl handle, with all options set.
+ * @param slist     Header list used by the request, or NULL.
+ * @param notif_idx Notifier index.
+ * @param done      Completion callback, or NULL to just log the
+ *                  outcome.
+ * @param data      Callback data.
+ *
+ * @return Returns 0 if queued, -1 otherwise.
+ */
+int notify_submit(CURL *hnd, struct curl_slist *slist, int notif_idx,
+	notify_cb done, void *data)
+{
+	struct notify_req *req;
+	struct pending *q;
+
+#ifdef DISABLE_NOTIFICATIONS
+	/* Pretend it was sent. */
+	curl_slist_free_all(slist);
+	put_handle(notif_idx, hnd);
+	if (done) {
+		done(&(struct notify_result){
+			.notif_idx = notif_idx, .code = CURLE_OK, .status = 200,
+			.data = data});
+	}
+	return 0;
+#endif
+
+	if (!(req = calloc(1, sizeof(*req)))) {
+		curl_slist_free_all(slist);
+		put_handle(notif_idx, hnd);
+		return -1;
+	}
+
+	req->hnd       = hnd;
+	req->slist     = slist;
+	req->notif_idx = notif_idx;
+	req->done      = done ? done : log_result;
+	req->data      = data;
+	clock_gettime(CLOCK_MONOTONIC, &req->queued);
+	curl_easy_setopt(hnd, CURLOPT_PRIVATE, req);
+	curl_easy_setopt(hnd, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(hnd, CURLOPT_CONNECTTIMEOUT, connect_timeout[notif_idx]);
+	curl_easy_setopt(hnd, CURLOPT_TIMEOUT, total_timeout[notif_idx]);
+
+	q = &pending[notif_idx];
+
+	pthread_mutex_lock(&nq_mutex);
+		if (q->num >= max_queued) {
+			pthread_mutex_unlock(&nq_mutex);
+			stat_inc(dropped);
+			log_msg("> Notification queue of %s full, dropping!\n",
+				notifiers_str[notif_idx]);
+			free_req(req);
+			return -1;
+		}
+		if (q->tail)
+			q->tail->next = req;
+		else
+			q->head = req;
+		q->tail = req;
+		q->num++;
+	pthread_mutex_unlock(&nq_mutex);
+
+	stat_inc(queued);
+	curl_multi_wakeup(multi);
+	return 0;
+}
+
+/**
+ * @brief Reads the timeouts of each notifier, from the
+ * <NOTIFIER>_CONNECT_TIMEOUT and <NOTIFIER>_TIMEOUT environment vars,
+ * or NOTIFY_CONNECT_TIMEOUT and NOTIFY_TIMEOUT, if not set.
+ */
+static void read_timeouts(void)
+{
+	long def_connect, def_total;
+	char var[64];
+
+	def_connect = syslog_get_env_int("NOTIFY_CONNECT_TIMEOUT",
+		NOTIFY_CONNECT_TIMEOUT_DEFAULT, 1, NOTIFY_CONNECT_TIMEOUT_MAX);
+	def_total   = syslog_get_env_int("NOTIFY_TIMEOUT",
+		NOTIFY_TIMEOUT_DEFAULT, 1, NOTIFY_TIMEOUT_MAX);
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		snprintf(var, sizeof var, "%s_CONNECT_TIMEOUT", notifiers_env[i]);
+		connect_timeout[i] = syslog_get_env_int(var, def_connect, 1,
+			NOTIFY_CONNECT_TIMEOUT_MAX);
+		snprintf(var, sizeof var, "%s_TIMEOUT", notifiers_env[i]);
+		total_timeout[i]   = syslog_get_env_int(var, def_total, 1,
+			NOTIFY_TIMEOUT_MAX);
+	}
+}
+
+/**
+ * @brief Reads the NOTIFY_INFLIGHT, NOTIFY_QUEUE and timeouts
+ * environment vars (if any) and starts the notification thread.
+ */
+void notify_queue_init(void)
+{
+	pthread_t thread;
+
+	max_inflight = syslog_get_env_int("NOTIFY_INFLIGHT",
+		NOTIFY_INFLIGHT_DEFAULT, 1, NOTIFY_INFLIGHT_MAX);
+	max_queued   = syslog_get_env_int("NOTIFY_QUEUE",
+		NOTIFY_QUEUE_DEFAULT, 1, NOTIFY_QUEUE_MAX);
+	max_inflight_each = (max_inflight + 1) / 2;
+	read_timeouts();
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK)
+		panic("Unable to initialize libcurl!\n");
+	if (!(multi = curl_multi_init()) || !(share = curl_share_init()))
+		panic("Unable to initialize the notification queue!\n");
+
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&share_locks[i], NULL);
+
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC,   share_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	log_msg("Notifications: up to %d in flight (%d per notifier, if shared), "
+		"%d queued per notifier\n\n",
+		max_inflight, max_inflight_each, max_queued);
+
+	stats_register("notify", notify_dump_stats);
+	if (pthread_create(&thread, NULL, notify_thread, NULL))
+		panic_errno("Unable to create notification thread!");
+}
@@ -0,0 +1,53 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef NOTIFY_QUEUE_H
+#define NOTIFY_QUEUE_H
+
+	#include <curl/curl.h>
+
+	/* Maximum (and default) amount of requests in flight. */
+	#define NOTIFY_INFLIGHT_MAX     64
+	#define NOTIFY_INFLIGHT_DEFAULT 8
+
+	/* Maximum (and default) amount of requests waiting, per notifier. */
+	#define NOTIFY_QUEUE_MAX        4096
+	#define NOTIFY_QUEUE_DEFAULT    64
+
+	/* Default (and maximum) connect and total timeouts, in secs. */
+	#define NOTIFY_CONNECT_TIMEOUT_DEFAULT 5
+	#define NOTIFY_CONNECT_TIMEOUT_MAX     120
+	#define NOTIFY_TIMEOUT_DEFAULT         15
+	#define NOTIFY_TIMEOUT_MAX             600
+
+	/* Outcome of a request, for its completion callback. */
+	struct notify_result {
+		int      notif_idx;
+		CURLcode code;        /* Transfer result.            */
+		long     status;      /* HTTP status, 0 if none.     */
+		unsigned long latency_ms; /* Since it was queued.    */
+		long     retry_after; /* Retry-After, in secs, or 0. */
+		void    *data;        /* As given to notify_submit(). */
+	};
+
+	typedef void (*notify_cb)(const struct notify_result *res);
+
+	/**
+	 * @brief Whether the request of @p res failed in a way that is
+	 * worth retrying later: transfer error (such as a timeout), or
+	 * HTTP 408, 429 or 5xx.
+	 */
+	static inline int notify_retryable(const struct notify_result *res)
+	{
+		return res->code != CURLE_OK || res->status == 408 ||
+			res->status == 429 || res->status >= 500;
+	}
+
+	extern CURL *notify_handle(int notif_idx);
+	extern int notify_submit(CURL *hnd, struct curl_slist *slist,
+		int notif_idx, notify_cb done, void *data);
+	extern void notify_queue_init(void);
+
+#endif /* NOTIFY_QUEUE_H */
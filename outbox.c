@@ -0,0 +1,613 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "breaker.h"
+#include "log.h"
+#include "notifiers.h"
+#include "outbox.h"
+#include "stats.h"
+#include "syslog.h"
+
+/*
+ * Notification outbox
+ *
+ * Every notification is first appended to the outbox, a segment file
+ * (log/outbox.seg) mapped in memory, and only leaves it once the
+ * webhook accepts it. If the request fails (transfer error, or HTTP
+ * 408, 429 or 5xx), it is retried later, with an exponential backoff
+ * (and jitter) or after the Retry-After the server asked for, up to
+ * OUTBOX_RETRIES times. Other HTTP errors are not retried.
+ *
+ * Records are only appended, and marked done in place once sent: the
+ * segment is compacted (live records moved to its beginning) when it
+ * fills up, or rewound as soon as it is empty. Since the segment
+ * lives in the log directory (a tmpfs, in the container), pending
+ * notifications survive a restart of Alertik, and are retried once
+ * it is back.
+ *
+ * If the segment is full, notifications are still sent, but without
+ * retries.
+ */
+
+#define OB_MAGIC   0x3158424fU /* 'OBX1'. */
+#define OB_PENDING 1
+#define OB_DONE    2
+#define OB_FREE    ((size_t)-1)
+
+#define OB_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* Outbox record, in the segment. */
+struct ob_rec {
+	uint32_t magic;
+	uint32_t len;       /* Text length, with the NUL. */
+	uint16_t attempts;
+	uint8_t  notif_idx;
+	uint8_t  state;
+	char     text[];
+};
+
+/* Pending notification. */
+struct ob_entry {
+	size_t off;         /* Record offset, OB_FREE if unused. */
+	int    notif_idx;
+	int    inflight;
+	time_t next_try;    /* Monotonic secs.                   */
+};
+
+static char  *seg;
+static size_t seg_size;
+static size_t seg_tail;
+
+/* Entries, guarded by the mutex, along with the segment. */
+static pthread_mutex_t ob_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ob_entry *entries;
+static int num_entries;
+static int max_entries;
+static int num_live;
+
+static int max_retries;
+static unsigned rnd_state; /* Backoff jitter, guarded by the mutex. */
+
+/* Statistics. */
+static stat_t sent;      /* Sent, from the outbox.              */
+static stat_t retries;   /* Attempts after the first one.       */
+static stat_t expired;   /* Given up, out of retries.           */
+static stat_t rejected;  /* Given up, non-retryable HTTP error. */
+static stat_t overflow;  /* Sent without retries, outbox full.  */
+static stat_t recovered; /* Pending, from a previous run.       */
+
+/**
+ * @brief Returns the record at the offset @p off.
+ */
+static inline struct ob_rec *rec_at(size_t off)
+{
+	return (struct ob_rec *)(seg + off);
+}
+
+/**
+ * @brief Returns the size of a record with a text of @p len bytes.
+ */
+static inline size_t rec_size(size_t len)
+{
+	return OB_ALIGN(sizeof(struct ob_rec) + len);
+}
+
+/**
+ * @brief Returns the current monotonic time, in seconds.
+ */
+static time_t now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * @brief Dumps the outbox statistics.
+ */
+static void outbox_dump_stats(void)
+{
+	size_t used;
+	int depth;
+
+	pthread_mutex_lock(&ob_mutex);
+		depth = num_live;
+		used  = seg_tail;
+	pthread_mutex_unlock(&ob_mutex);
+
+	log_msg("  depth (bytes)   : %d (%zu / %zu)\n", depth, used, seg_size);
+	log_msg("  sent/retries    : %lu / %lu\n", stat_get(sent),
+		stat_get(retries));
+	log_msg("  expired/rejected: %lu / %lu\n", stat_get(expired),
+		stat_get(rejected));
+	log_msg("  overflow        : %lu\n", stat_get(overflow));
+	log_msg("  recovered       : %lu\n", stat_get(recovered));
+}
+
+/**
+ * @brief Marks the end of the records at the segment tail, so that
+ * stale records after it are not recovered.
+ */
+static void mark_tail(size_t off)
+{
+	if (off + sizeof(uint32_t) <= seg_size)
+		*(uint32_t *)(seg + off) = 0;
+}
+
+/**
+ * @brief Compares two entries by their record offset, for qsort().
+ */
+static int cmp_off(const void *a, const void *b)
+{
+	size_t off_a = entries[*(const int *)a].off;
+	size_t off_b = entries[*(const int *)b].off;
+	return (off_a > off_b) - (off_a < off_b);
+}
+
+/**
+ * @brief Compacts the segment: moves the pending records (in order)
+ * to its beginning, dropping the done ones.
+ */
+static void compact(void)
+{
+	size_t off, size;
+	int *order;
+	int i, n;
+
+	if (!num_live) {
+		seg_tail = 0;
+		mark_tail(0);
+		return;
+	}
+
+	if (!(order = malloc(num_live * sizeof(*order))))
+		return;
+
+	for (i = 0, n = 0; i < num_entries; i++)
+		if (entries[i].off != OB_FREE)
+			order[n++] = i;
+	qsort(order, n, sizeof(*order), cmp_off);
+
+	for (i = 0, off = 0; i < n; i++) {
+		size = rec_size(rec_at(entries[order[i]].off)->len);
+		if (entries[order[i]].off != off)
+			memmove(seg + off, seg + entries[order[i]].off, size);
+		entries[order[i]].off = off;
+		off += size;
+	}
+
+	seg_tail = off;
+	mark_tail(off);
+	free(order);
+}
+
+/**
+ * @brief Returns a free entry slot, or -1 if none.
+ */
+static int get_slot(void)
+{
+	void *p;
+	int i;
+
+	for (i = 0; i < num_entries; i++)
+		if (entries[i].off == OB_FREE)
+			return i;
+
+	if (num_entries == max_entries) {
+		i = max_entries ? max_entries * 2 : 64;
+		if (!(p = realloc(entries, i * sizeof(*entries))))
+			return -1;
+		entries     = p;
+		max_entries = i;
+	}
+	return num_entries++;
+}
+
+/**
+ * @brief Appends the notification @p msg, for the notifier
+ * @p notif_idx, to the outbox.
+ *
+ * @return Returns its entry slot, or -1 if it does not fit.
+ */
+static int ob_append(int notif_idx, const char *msg)
+{
+	struct ob_rec *rec;
+	size_t len, size;
+	int slot;
+
+	len  = strlen(msg) + 1;
+	size = rec_size(len);
+	if (seg_tail + size > seg_size)
+		compact();
+	if (seg_tail + size > seg_size || (slot = get_slot()) < 0)
+		return -1;
+
+	/* Record header last, so that a partial record is not valid. */
+	mark_tail(seg_tail + size);
+	rec = rec_at(seg_tail);
+	memcpy(rec->text, msg, len);
+	rec->len       = len;
+	rec->attempts  = 0;
+	rec->notif_idx = notif_idx;
+	rec->state     = OB_PENDING;
+	rec->magic     = OB_MAGIC;
+
+	entries[slot].off       = seg_tail;
+	entries[slot].notif_idx = notif_idx;
+	entries[slot].inflight  = 0;
+	entries[slot].next_try  = 0;
+	seg_tail += size;
+	num_live++;
+	return slot;
+}
+
+/**
+ * @brief Removes the entry @p slot from the outbox.
+ */
+static void ob_remove(int slot)
+{
+	rec_at(entries[slot].off)->state = OB_DONE;
+	entries[slot].off = OB_FREE;
+	if (!--num_live)
+		compact();
+}
+
+/**
+ * @brief Returns the delay (in secs) before the next attempt, after
+ * @p attempts failed ones, or @p retry_after, if longer. Must be
+ * called with the mutex held (for the jitter state).
+ */
+static unsigned backoff(int attempts, long retry_after)
+{
+	unsigned delay = OUTBOX_BACKOFF_MIN;
+
+	for (int i = 1; i < attempts && delay < OUTBOX_BACKOFF_MAX; i++)
+		delay *= 2;
+	if (delay > OUTBOX_BACKOFF_MAX)
+		delay = OUTBOX_BACKOFF_MAX;
+
+	/* Jitter (xorshift), so retries do not all fire at once. */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	delay = delay / 2 + rnd_state % (delay / 2 + 1);
+
+	if (retry_after > OUTBOX_RETRY_AFTER_MAX)
+		retry_after = OUTBOX_RETRY_AFTER_MAX;
+	if (retry_after > (long)delay)
+		delay = retry_after;
+	return delay;
+}
+
+/**
+ * @brief Completion callback of the outbox requests: removes the
+ * notification if sent, or schedules its next attempt otherwise.
+ */
+static void outbox_done(const struct notify_result *res)
+{
+	int slot = (int)(intptr_t)res->data;
+	const char *name = notifiers_str[res->notif_idx];
+	unsigned delay = 0;
+	char reason[32];
+	int attempts;
+	int retry;
+
+	if (res->code == CURLE_OK && res->status >= 200 && res->status <= 299) {
+		log_msg("> Notification sent through %s (%lu ms)\n", name,
+			res->latency_ms);
+		stat_inc(sent);
+		pthread_mutex_lock(&ob_mutex);
+			ob_remove(slot);
+		pthread_mutex_unlock(&ob_mutex);
+		return;
+	}
+
+	if (res->code != CURLE_OK)
+		snprintf(reason, sizeof reason, "%s", curl_easy_strerror(res->code));
+	else
+		snprintf(reason, sizeof reason, "HTTP %ld", res->status);
+	retry = notify_retryable(res);
+
+	pthread_mutex_lock(&ob_mutex);
+		entries[slot].inflight = 0;
+		attempts = rec_at(entries[slot].off)->attempts;
+		if (!retry || attempts > max_retries)
+			ob_remove(slot);
+		else {
+			delay = backoff(attempts, res->retry_after);
+			entries[slot].next_try = now_secs() + delay;
+		}
+	pthread_mutex_unlock(&ob_mutex);
+
+	if (!retry || attempts > max_retries) {
+		log_msg("> Unable to send notification through %s (%s), giving up "
+			"after %d attempt(s)!\n", name, reason, attempts);
+		if (retry)
+			stat_inc(expired);
+		else
+			stat_inc(rejected);
+		return;
+	}
+
+	log_msg("> Unable to send notification through %s (%s), retrying in "
+		"%us (attempt %d)\n", name, reason, delay, attempts);
+}
+
+/**
+ * @brief Sends the notification @p text of the entry @p slot through
+ * the notifier @p notif_idx (or its fallback, if its circuit is open),
+ * or schedules a new attempt if it cannot be sent now.
+ *
+ * @return Returns 0 if sent, -1 if deferred.
+ */
+static int send_entry(int slot, int notif_idx, const char *text)
+{
+	const struct notifier *self;
+	unsigned delay = 1;
+	int attempts = 0;
+	int idx;
+
+	/* Circuit open: checks it again in the next round. */
+	if ((idx = breaker_route(notif_idx)) < 0)
+		goto defer;
+
+	pthread_mutex_lock(&ob_mutex);
+		attempts = ++rec_at(entries[slot].off)->attempts;
+	pthread_mutex_unlock(&ob_mutex);
+
+	if (attempts > 1)
+		stat_inc(retries);
+	if (idx != notif_idx)
+		log_msg("> Circuit for %s open, sending through %s\n",
+			notifiers_str[notif_idx], notifiers_str[idx]);
+
+	self = &notifiers[idx];
+	if (self->send_notification(self, text, outbox_done,
+		(void *)(intptr_t)slot) == 0)
+	{
+		return 0;
+	}
+
+	breaker_release(idx);
+defer:
+	pthread_mutex_lock(&ob_mutex);
+		if (attempts)
+			delay = backoff(attempts, 0);
+		entries[slot].inflight = 0;
+		entries[slot].next_try = now_secs() + delay;
+	pthread_mutex_unlock(&ob_mutex);
+	return -1;
+}
+
+/**
+ * @brief Sends the notification @p msg through the notifier
+ * @p notif_idx, retrying it later if it fails.
+ *
+ * @return Returns 0 if queued (or kept in the outbox), -1 otherwise.
+ */
+int outbox_send(int notif_idx, const char *msg)
+{
+	const struct notifier *self;
+	int slot = -1;
+	int idx;
+
+	if (seg) {
+		pthread_mutex_lock(&ob_mutex);
+			if ((slot = ob_append(notif_idx, msg)) >= 0)
+				entries[slot].inflight = 1;
+		pthread_mutex_unlock(&ob_mutex);
+
+		if (slot < 0) {
+			log_msg("> Outbox full, sending without retries!\n");
+			stat_inc(overflow);
+		}
+	}
+
+	if (slot >= 0) {
+		if (send_entry(slot, notif_idx, msg) < 0)
+			log_msg("> Notification through %s kept in the outbox, "
+				"to be retried\n", notifiers_str[notif_idx]);
+		return 0;
+	}
+
+	if ((idx = breaker_route(notif_idx)) < 0) {
+		log_msg("> Circuit for %s open, dropping!\n", notifiers_str[notif_idx]);
+		return -1;
+	}
+
+	self = &notifiers[idx];
+	if (self->send_notification(self, msg, NULL, NULL) == 0)
+		return 0;
+
+	breaker_release(idx);
+	return -1;
+}
+
+/**
+ * @brief Takes the entry @p slot for a new attempt, if due at @p now.
+ *
+ * @return Returns a copy of its text if so (to be freed), NULL
+ * otherwise.
+ */
+static char *take_due(int slot, time_t now, int *notif_idx)
+{
+	struct ob_entry *e = &entries[slot];
+	struct ob_rec *rec;
+	char *text = NULL;
+
+	if (e->off == OB_FREE || e->inflight || e->next_try > now)
+		return NULL;
+
+	rec = rec_at(e->off);
+	if (rec->attempts > max_retries) {
+		log_msg("> Unable to send notification through %s, giving up "
+			"after %d attempt(s)!\n", notifiers_str[e->notif_idx],
+			rec->attempts);
+		stat_inc(expired);
+		ob_remove(slot);
+		return NULL;
+	}
+
+	if (!(text = strdup(rec->text)))
+		return NULL;
+
+	e->inflight = 1;
+	*notif_idx  = e->notif_idx;
+	return text;
+}
+
+/**
+ * @brief Outbox thread: once per second, sends again the pending
+ * notifications whose backoff is over.
+ */
+static void *outbox_thread(void *p)
+{
+	((void)p);
+	int notif_idx;
+	char *text;
+	time_t now;
+	int slot;
+	int n;
+
+	while (1) {
+		sleep(1);
+		now = now_secs();
+
+		for (slot = 0; ; slot++) {
+			pthread_mutex_lock(&ob_mutex);
+				n    = num_entries;
+				text = (slot < n) ? take_due(slot, now, &notif_idx) : NULL;
+			pthread_mutex_unlock(&ob_mutex);
+
+			if (slot >= n)
+				break;
+			if (!text)
+				continue;
+
+			send_entry(slot, notif_idx, text);
+			free(text);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Recovers the pending notifications left in the segment by
+ * a previous run, and compacts it.
+ */
+static void ob_recover(void)
+{
+	struct ob_rec *rec;
+	size_t off, size;
+	int dropped = 0;
+	int slot;
+
+	for (off = 0; off + sizeof(*rec) <= seg_size; off += size) {
+		rec = rec_at(off);
+		if (rec->magic != OB_MAGIC || !rec->len || rec->len > seg_size ||
+		    (size = rec_size(rec->len)) > seg_size - off ||
+		    rec->text[rec->len - 1] != '\0')
+		{
+			break;
+		}
+
+		if (rec->state != OB_PENDING)
+			continue;
+
+		/* Notifier no longer configured. */
+		if (rec->notif_idx >= NUM_NOTIFIERS ||
+		    !notifiers[rec->notif_idx].ready || (slot = get_slot()) < 0)
+		{
+			rec->state = OB_DONE;
+			dropped++;
+			continue;
+		}
+
+		entries[slot].off       = off;
+		entries[slot].notif_idx = rec->notif_idx;
+		entries[slot].inflight  = 0;
+		entries[slot].next_try  = 0;
+		num_live++;
+		stat_inc(recovered);
+	}
+
+	seg_tail = off;
+	compact();
+
+	if (dropped)
+		log_msg("Outbox: dropped %d notification(s) for notifiers no longer "
+			"configured\n", dropped);
+}
+
+/**
+ * @brief Reads the OUTBOX_BYTES and OUTBOX_RETRIES environment vars
+ * (if any), maps the outbox segment (recovering its pending
+ * notifications) and starts the outbox thread: must be called after
+ * the notifiers were set up.
+ */
+void outbox_init(void)
+{
+	pthread_t thread;
+	struct stat sb;
+	int fd = -1;
+
+	seg_size    = syslog_get_env_int("OUTBOX_BYTES", OUTBOX_BYTES_DEFAULT,
+		0, OUTBOX_BYTES_MAX);
+	max_retries = syslog_get_env_int("OUTBOX_RETRIES", OUTBOX_RETRIES_DEFAULT,
+		0, OUTBOX_RETRIES_MAX);
+
+	if (!seg_size) {
+		log_msg("Outbox: disabled, failed notifications are not retried\n\n");
+		return;
+	}
+	if (seg_size < OUTBOX_BYTES_MIN)
+		seg_size = OUTBOX_BYTES_MIN;
+	seg_size = OB_ALIGN(seg_size);
+
+	if (stat("log", &sb) < 0 && mkdir("log", 0755) < 0)
+		goto fail;
+
+	fd = open(OUTBOX_FILE, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, seg_size) < 0)
+		goto fail;
+
+	seg = mmap(NULL, seg_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		seg = NULL;
+		goto fail;
+	}
+	close(fd);
+
+	rnd_state = (unsigned)time(NULL) ^ (unsigned)getpid();
+	if (!rnd_state)
+		rnd_state = 1;
+
+	ob_recover();
+	log_msg("Outbox: %zu KiB, up to %d retries, %d notification(s) "
+		"recovered\n\n", seg_size >> 10, max_retries, num_live);
+
+	stats_register("outbox", outbox_dump_stats);
+	if (pthread_create(&thread, NULL, outbox_thread, NULL))
+		panic_errno("Unable to create outbox thread!");
+	return;
+fail:
+	log_msg("Unable to create the outbox (%s): %s, failed notifications "
+		"are not retried\n\n", OUTBOX_FILE, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
@@ -0,0 +1,29 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+	/* Segment file, and its default (and maximum) size, 0 disables it. */
+	#define OUTBOX_FILE          "log/outbox.seg"
+	#define OUTBOX_BYTES_DEFAULT (256 << 10)
+	#define OUTBOX_BYTES_MIN     4096
+	#define OUTBOX_BYTES_MAX     (16 << 20)
+
+	/* Default (and maximum) amount of retries per notification. */
+	#define OUTBOX_RETRIES_DEFAULT 10
+	#define OUTBOX_RETRIES_MAX     100
+
+	/* Backoff between retries, in secs: doubles from MIN up to MAX. */
+	#define OUTBOX_BACKOFF_MIN   2
+	#define OUTBOX_BACKOFF_MAX   300
+
+	/* Longest Retry-After honored, in secs. */
+	#define OUTBOX_RETRY_AFTER_MAX 3600
+
+	extern int outbox_send(int notif_idx, const char *msg);
+	extern void outbox_init(void);
+
+#endif /* OUTBOX_H */
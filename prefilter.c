@@ -0,0 +1,319 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aho_corasick.h"
+#include "events.h"
+#include "log.h"
+#include "prefilter.h"
+
+/*
+ * Regex literal prefilter
+ *
+ * Most lines match none of the regex rules, and regexec() is slow
+ * (especially musl's, on ARM). So, at init, the ERE of each rule is
+ * walked looking for its 'required factors': literal runs that must
+ * appear in any match, like 'login failure for user ' and ' via ssh'
+ * in 'login failure for user ([a-z]+) from (.*) via ssh'.
+ *
+ * The factors are added to the Aho-Corasick automaton, so they cost
+ * nothing extra at runtime: if one of them is missing from the line,
+ * regexec() is skipped altogether.
+ *
+ * The extraction is conservative: anything that is not a plain literal
+ * (groups, brackets, classes, anchors, back-references...) just ends
+ * the current factor, and a top-level alternation disables the
+ * prefilter for the rule.
+ */
+
+static struct prefilter **prefilters;
+static int num_prefilters;
+
+/* Factor extraction state. */
+struct pf_factors {
+	char cur[MSG_MAX];
+	size_t cur_len;
+	char *list[MSG_MAX];
+	int num;
+};
+
+/**
+ * @brief Ends the current literal run, keeping it if long enough.
+ */
+static void factor_flush(struct pf_factors *f)
+{
+	char *s;
+
+	if (f->cur_len >= PF_MIN_FACTOR_LEN && f->num < MSG_MAX) {
+		if (!(s = malloc(f->cur_len + 1)))
+			panic("Unable to allocate regex factor!\n");
+		memcpy(s, f->cur, f->cur_len);
+		s[f->cur_len] = '\0';
+		f->list[f->num++] = s;
+	}
+	f->cur_len = 0;
+}
+
+/**
+ * @brief Whether @p p starts a quantifier ('*', '+', '?', '{n,m}' or,
+ * as glibc reads it, '{,m}').
+ */
+static int is_quantifier(const char *p)
+{
+	return *p == '*' || *p == '+' || *p == '?' ||
+		(*p == '{' && (isdigit((unsigned char)p[1]) || p[1] == ','));
+}
+
+/**
+ * @brief Skips the quantifiers ('*', '+', '?' or '{n,m}') at @p p, if
+ * any: stacked ones too, like 'a+?' or 'a*{2}', which glibc accepts.
+ *
+ * @param p        Current position.
+ * @param optional Set to 1 if any quantifier allows zero repetitions
+ *                 (a missing lower bound, as in '{,m}', is 0).
+ *
+ * @return Returns the position after the quantifiers.
+ */
+static const char *skip_quantifier(const char *p, int *optional)
+{
+	*optional = 0;
+
+	while (is_quantifier(p)) {
+		if (*p == '*' || *p == '?')
+			*optional = 1;
+		else if (*p == '{') {
+			if (strtol(p + 1, NULL, 10) == 0)
+				*optional = 1;
+			while (*p && *p != '}')
+				p++;
+			if (!*p)
+				break;
+		}
+		p++;
+	}
+	return p;
+}
+
+/**
+ * @brief Skips a bracket expression starting at @p p ('[').
+ *
+ * @return Returns the position after it.
+ */
+static const char *skip_bracket(const char *p)
+{
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+
+	for (; *p && *p != ']'; p++) {
+		/* Character classes, equivalence classes and collating symbols. */
+		if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+			const char *end = strchr(p + 2, p[1]);
+			if (end && end[1] == ']')
+				p = end + 1;
+		}
+	}
+	return (*p) ? p + 1 : p;
+}
+
+/**
+ * @brief Skips a group starting at @p p ('('), with all of its
+ * nested groups.
+ *
+ * @return Returns the position after it.
+ */
+static const char *skip_group(const char *p)
+{
+	int depth = 0;
+
+	while (*p) {
+		if (*p == '\\' && p[1])
+			p += 2;
+		else if (*p == '[')
+			p = skip_bracket(p);
+		else {
+			if (*p == '(')
+				depth++;
+			else if (*p == ')' && --depth == 0)
+				return p + 1;
+			p++;
+		}
+	}
+	return p;
+}
+
+/**
+ * @brief Extracts the required literal factors of the ERE @p regex
+ * into @p f.
+ *
+ * @return Returns 0 if success, -1 if the regex has no usable
+ * factors (i.e., it has a top-level alternation).
+ */
+static int extract_factors(const char *regex, struct pf_factors *f)
+{
+	const char *p = regex;
+	const char *q;
+	int optional;
+	char c;
+
+	while (*p) {
+		switch (*p) {
+		case '|':
+			return -1;
+
+		case '(':
+			factor_flush(f);
+			p = skip_quantifier(skip_group(p), &optional);
+			continue;
+
+		case '[':
+			factor_flush(f);
+			p = skip_quantifier(skip_bracket(p), &optional);
+			continue;
+
+		case '.':
+		case '^':
+		case '$':
+			factor_flush(f);
+			p = skip_quantifier(p + 1, &optional);
+			continue;
+
+		case '\\':
+			c = p[1];
+			if (!c)
+				return 0;
+			/* \d, \w, \b, \1..., or anything not a plain literal. */
+			if (isalnum((unsigned char)c) || c == '<' || c == '>' || c == '`' || c == '\'') {
+				factor_flush(f);
+				p = skip_quantifier(p + 2, &optional);
+				continue;
+			}
+			p += 2;
+			break;
+
+		default:
+			/* A quantifier with nothing to repeat: not a literal. */
+			if (is_quantifier(p)) {
+				factor_flush(f);
+				p = skip_quantifier(p, &optional);
+				continue;
+			}
+			c = *p++;
+			break;
+		}
+
+		/*
+		 * A literal char 'c', which may be quantified: if optional,
+		 * it is dropped, otherwise it is kept only once.
+		 */
+		q = skip_quantifier(p, &optional);
+		if (!optional && f->cur_len < sizeof(f->cur))
+			f->cur[f->cur_len++] = c;
+		if (q != p)
+			factor_flush(f);
+		p = q;
+	}
+
+	factor_flush(f);
+	return 0;
+}
+
+/**
+ * @brief Dumps the prefilter counters.
+ */
+static void prefilter_dump_stats(void)
+{
+	unsigned long checked, rejected;
+
+	for (int i = 0; i < num_prefilters; i++) {
+		checked  = stat_get(prefilters[i]->checked);
+		rejected = stat_get(prefilters[i]->rejected);
+		log_msg("  %s: factors: %d, checked: %lu, rejected: %lu (%.1f%%)\n",
+			prefilters[i]->name, prefilters[i]->num_factors, checked,
+			rejected, checked ? (100.0 * rejected) / checked : 0.0);
+	}
+}
+
+/**
+ * @brief Compares two factors by decreasing length.
+ */
+static int factor_cmp(const void *a, const void *b)
+{
+	size_t la = strlen(*(char *const *)a);
+	size_t lb = strlen(*(char *const *)b);
+	return (la < lb) - (la > lb);
+}
+
+/**
+ * @brief Initializes the prefilter @p pf for the ERE @p regex: its
+ * required factors (at most PF_MAX_FACTORS, the longest ones) are
+ * added to the substring automaton, so it must be called before
+ * ac_build().
+ *
+ * @param pf      Prefilter to be initialized.
+ * @param name    Rule name, used in the stats.
+ * @param regex   Extended regular expression.
+ * @param on_body Whether the regex only matches the message body.
+ */
+void prefilter_init(struct prefilter *pf, const char *name,
+	const char *regex, int on_body)
+{
+	static struct pf_factors f;
+	struct prefilter **pfs;
+	int i;
+
+	memset(pf, 0, sizeof(*pf));
+	snprintf(pf->name, sizeof pf->name, "%s", name);
+
+	f.cur_len = 0;
+	f.num     = 0;
+
+	if (extract_factors(regex, &f) < 0) {
+		for (i = 0; i < f.num; i++)
+			free(f.list[i]);
+		f.num = 0;
+	}
+
+	qsort(f.list, f.num, sizeof(*f.list), factor_cmp);
+	for (i = 0; i < f.num; i++) {
+		if (i < PF_MAX_FACTORS)
+			pf->ac_ids[pf->num_factors++] = ac_add_pattern(f.list[i], on_body);
+		else
+			free(f.list[i]);
+	}
+
+	pfs = realloc(prefilters, (num_prefilters + 1) * sizeof(*prefilters));
+	if (!pfs)
+		panic("Unable to allocate regex prefilters!\n");
+	prefilters = pfs;
+
+	if (!num_prefilters)
+		stats_register("regex-prefilter", prefilter_dump_stats);
+	prefilters[num_prefilters++] = pf;
+}
+
+/**
+ * @brief Checks whether the log event @p ev (already scanned by
+ * ac_scan()) might match the regex of the prefilter @p pf.
+ *
+ * @return Returns 1 if regexec() is worth calling, 0 otherwise.
+ */
+int prefilter_pass(struct prefilter *pf, const struct log_event *ev)
+{
+	stat_inc(pf->checked);
+	for (int i = 0; i < pf->num_factors; i++) {
+		if (!ac_hit(&ev->substr_hits, pf->ac_ids[i])) {
+			stat_inc(pf->rejected);
+			return 0;
+		}
+	}
+	return 1;
+}
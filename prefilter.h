@@ -0,0 +1,37 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+	#include "stats.h"
+
+	/* Maximum amount of literal factors checked per regex. */
+	#define PF_MAX_FACTORS 4
+
+	/* Shorter factors are not worth the automaton states. */
+	#define PF_MIN_FACTOR_LEN 2
+
+	struct log_event;
+
+	/*
+	 * Regex prefilter: literals that any match of the regex must
+	 * contain, matched along with the substring events, so that
+	 * regexec() only runs when all of them were found.
+	 */
+	struct prefilter {
+		char name[32];     /* Rule name, for the stats. */
+		int num_factors;   /* 0 means no prefilter.     */
+		int ac_ids[PF_MAX_FACTORS];
+		stat_t checked;
+		stat_t rejected;
+	};
+
+	extern void prefilter_init(struct prefilter *pf, const char *name,
+		const char *regex, int on_body);
+	extern int prefilter_pass(struct prefilter *pf,
+		const struct log_event *ev);
+
+#endif /* PREFILTER_H */
@@ -0,0 +1,243 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "notifiers.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "syslog.h"
+
+/*
+ * Notification rate limiting
+ *
+ * Each rule and each notifier has its own token bucket: a
+ * notification is only sent if both of them have a token left, and
+ * tokens refill over time, up to the bucket burst. So, a noisy rule
+ * only exhausts its own bucket (and, at most, a share of its
+ * notifier's), while the other rules keep notifying as usual. An
+ * alert sent through several notifiers takes a single token from its
+ * rule, and one from each notifier.
+ *
+ * Buckets are configured per rule with <RULE>_RATE_BURST and
+ * <RULE>_RATE_SECS (e.g., EVENT0_RATE_BURST), and per notifier with
+ * <NOTIFIER>_RATE_BURST/_SECS (e.g., TELEGRAM_RATE_SECS), with the
+ * defaults taken from RULE_RATE_BURST/_SECS and NOTIFY_RATE_BURST/_SECS.
+ * A burst of 0 disables the limit.
+ *
+ * Tokens are taken by the emitter thread (see workers.c), and by the
+ * dedup summaries (see dedup.c), so buckets are guarded by a mutex.
+ */
+
+struct rl_bucket {
+	char    *name;
+	double   tokens;
+	unsigned burst;     /* Maximum tokens, 0 if unlimited. */
+	unsigned secs;      /* Seconds per token.              */
+	struct timespec last;
+
+	/* Statistics. */
+	stat_t allowed;
+	stat_t suppressed;
+};
+
+static struct rl_bucket *rules;
+static int num_rules;
+static int max_rules;
+static struct rl_bucket notifier_buckets[NUM_NOTIFIERS];
+static pthread_mutex_t rl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Dumps the rate limiting statistics: each notifier used so
+ * far, and each rule that had notifications suppressed.
+ */
+static void rl_dump_stats(void)
+{
+	struct rl_bucket *b;
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		b = &notifier_buckets[i];
+		if (!stat_get(b->allowed) && !stat_get(b->suppressed))
+			continue;
+		log_msg("  %-14s allowed/suppressed: %lu / %lu\n", b->name,
+			stat_get(b->allowed), stat_get(b->suppressed));
+	}
+	for (int i = 0; i < num_rules; i++) {
+		b = &rules[i];
+		if (!stat_get(b->suppressed))
+			continue;
+		log_msg("  %-14s allowed/suppressed: %lu / %lu\n", b->name,
+			stat_get(b->allowed), stat_get(b->suppressed));
+	}
+}
+
+/**
+ * @brief Initializes the bucket @p b, named @p name, from the
+ * <name>_RATE_BURST and <name>_RATE_SECS environment vars, if any,
+ * or the defaults @p burst and @p secs otherwise.
+ */
+static void bucket_init(struct rl_bucket *b, const char *name,
+	unsigned burst, unsigned secs)
+{
+	char var[64];
+
+	if (!(b->name = strdup(name)))
+		panic("Unable to allocate rate limit bucket!\n");
+
+	snprintf(var, sizeof var, "%s_RATE_BURST", name);
+	b->burst = syslog_get_env_int(var, burst, 0, RL_BURST_MAX);
+	snprintf(var, sizeof var, "%s_RATE_SECS", name);
+	b->secs  = syslog_get_env_int(var, secs, 1, RL_SECS_MAX);
+
+	/* Starts full. */
+	b->tokens = b->burst;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+/**
+ * @brief Refills the bucket @p b up to the time @p now.
+ */
+static void bucket_refill(struct rl_bucket *b, const struct timespec *now)
+{
+	double elapsed;
+
+	elapsed = (now->tv_sec - b->last.tv_sec) +
+		(now->tv_nsec - b->last.tv_nsec) / 1e9;
+	b->last = *now;
+
+	b->tokens += elapsed / b->secs;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+}
+
+/**
+ * @brief Adds a new rule, named @p name (like 'EVENT0'), and reads
+ * its bucket settings.
+ *
+ * @return Returns the rule id, for rl_allow().
+ */
+int rl_rule_add(const char *name)
+{
+	unsigned burst, secs;
+	void *p;
+
+	if (num_rules == max_rules) {
+		max_rules = max_rules ? max_rules * 2 : 16;
+		if (!(p = realloc(rules, max_rules * sizeof(*rules))))
+			panic("Unable to allocate rate limit bucket!\n");
+		rules = p;
+	}
+
+	burst = syslog_get_env_int("RULE_RATE_BURST", RL_RULE_BURST, 0,
+		RL_BURST_MAX);
+	secs  = syslog_get_env_int("RULE_RATE_SECS", RL_RULE_SECS, 1,
+		RL_SECS_MAX);
+
+	memset(&rules[num_rules], 0, sizeof(*rules));
+	bucket_init(&rules[num_rules], name, burst, secs);
+	return num_rules++;
+}
+
+/**
+ * @brief Checks whether the rule @p rule_id might send one more
+ * alert through the notifiers in @p notifiers, and if so, takes a
+ * token from the rule bucket (once, as it counts alerts) and from the
+ * bucket of each notifier it is sent through.
+ *
+ * @param rule_id   Rule id.
+ * @param notifiers Notifiers mask.
+ * @param limit     Which bucket was empty (RL_LIMIT_RULE or
+ *                  RL_LIMIT_NOTIFIER), for the notifiers not allowed.
+ *
+ * @return Returns the mask of the notifiers allowed, 0 if none.
+ */
+unsigned rl_allow(int rule_id, unsigned notifiers, int *limit)
+{
+	struct rl_bucket *rule = &rules[rule_id];
+	struct rl_bucket *notif;
+	struct timespec now;
+	unsigned allowed = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	*limit = RL_LIMIT_NOTIFIER;
+
+	pthread_mutex_lock(&rl_mutex);
+		bucket_refill(rule, &now);
+		if (rule->burst && rule->tokens < 1) {
+			*limit = RL_LIMIT_RULE;
+			goto out;
+		}
+
+		for (i = 0; i < NUM_NOTIFIERS; i++) {
+			notif = &notifier_buckets[i];
+			if (!(notifiers & NOTIFIER_BIT(i)))
+				continue;
+
+			bucket_refill(notif, &now);
+			if (notif->burst && notif->tokens < 1)
+				continue;
+			notif->tokens -= (notif->burst != 0);
+			allowed |= NOTIFIER_BIT(i);
+		}
+		if (allowed)
+			rule->tokens -= (rule->burst != 0);
+out:
+	pthread_mutex_unlock(&rl_mutex);
+
+	for (i = 0; i < NUM_NOTIFIERS; i++) {
+		notif = &notifier_buckets[i];
+		if (allowed & NOTIFIER_BIT(i))
+			stat_inc(notif->allowed);
+		else if ((notifiers & NOTIFIER_BIT(i)) && *limit == RL_LIMIT_NOTIFIER)
+			stat_inc(notif->suppressed);
+	}
+	if (allowed)
+		stat_inc(rule->allowed);
+	else
+		stat_inc(rule->suppressed);
+	return allowed;
+}
+
+/**
+ * @brief Returns the name of the rule @p rule_id, like 'EVENT0'.
+ */
+const char *rl_rule_name(int rule_id)
+{
+	return rules[rule_id].name;
+}
+
+/**
+ * @brief Reads the notifiers bucket settings (the defaults from
+ * NOTIFY_RATE_BURST/_SECS, and <NOTIFIER>_RATE_BURST/_SECS), must be
+ * called after all rules were added.
+ */
+void rl_init(void)
+{
+	unsigned burst, secs;
+	int i;
+
+	burst = syslog_get_env_int("NOTIFY_RATE_BURST", RL_NOTIFIER_BURST, 0,
+		RL_BURST_MAX);
+	secs  = syslog_get_env_int("NOTIFY_RATE_SECS", RL_NOTIFIER_SECS, 1,
+		RL_SECS_MAX);
+
+	for (i = 0; i < NUM_NOTIFIERS; i++)
+		bucket_init(&notifier_buckets[i], notifiers_env[i], burst, secs);
+
+	log_msg("Rate limits (burst/secs per token, 0 if unlimited):\n");
+	for (i = 0; i < num_rules; i++)
+		log_msg("  %-14s: %u / %u\n", rules[i].name, rules[i].burst,
+			rules[i].secs);
+	log_msg("  notifiers     : %u / %u (default)\n\n", burst, secs);
+
+	stats_register("ratelimit", rl_dump_stats);
+}
@@ -0,0 +1,32 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+	/*
+	 * Default token buckets: each rule might send up to BURST
+	 * notifications at once, then one every SECS seconds, and the
+	 * same for each notifier (for all rules using it).
+	 */
+	#define RL_RULE_BURST     3
+	#define RL_RULE_SECS      30
+	#define RL_NOTIFIER_BURST 10
+	#define RL_NOTIFIER_SECS  3
+
+	/* Maximum burst and refill period. */
+	#define RL_BURST_MAX 1000
+	#define RL_SECS_MAX  86400
+
+	/* Why rl_allow() did not allow some notifiers. */
+	#define RL_LIMIT_RULE     1 /* Rule out of tokens.     */
+	#define RL_LIMIT_NOTIFIER 2 /* Notifier out of tokens. */
+
+	extern int rl_rule_add(const char *name);
+	extern unsigned rl_allow(int rule_id, unsigned notifiers, int *limit);
+	extern const char *rl_rule_name(int rule_id);
+	extern void rl_init(void);
+
+#endif /* RATELIMIT_H */
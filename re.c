@@ -0,0 +1,1610 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "re.h"
+
+/*
+ * Built-in regex engine
+ *
+ * musl's regexec() is slow and its latency unpredictable on our ARM
+ * targets, so this is a small engine for the POSIX ERE subset used by
+ * rules: literals, '.', brackets (ranges, negation and [:classes:]),
+ * groups, '|', '*', '+', '?', '{n,m}', '^', '$' and the \d, \w, \s
+ * (and negated) shorthands. Anything else (back-references, word
+ * boundaries...) fails to compile, and rules fall back to libc.
+ *
+ * The pattern is compiled into a Thompson NFA program, which is run
+ * in two ways:
+ *
+ * - Match decision: a lazy DFA, whose states (sets of NFA threads) are
+ *   only built when first reached, and cached in a fixed-size arena.
+ *   When the arena is full, the whole cache is flushed and rebuilt
+ *   from the current state, so memory is bounded and each byte costs
+ *   a table lookup once the cache is warm.
+ *
+ * - Captures: a Pike VM, only run after the DFA confirmed a match.
+ *   Submatches follow leftmost-first priority (greedy quantifiers,
+ *   left alternatives first), which only differs from POSIX's
+ *   leftmost-longest for ambiguous patterns.
+ *
+ * Several patterns can also be compiled into a single program (a
+ * 'set', like RE2::Set), one alternative per pattern, each ending in
+ * its own MATCH: a single DFA pass then tells which of them matched,
+ * at a cost that depends on the input length, not on the amount of
+ * patterns.
+ *
+ * A compiled regex keeps its own scratch buffers and DFA cache, so it
+ * must not be used by more than one thread at once.
+ */
+
+const char *const re_engines_str[RE_ENGINES_LEN] = {"libc", "builtin"};
+
+/* Program. */
+#define I_SET   0 /* Consume a byte in set 'arg'.      */
+#define I_SPLIT 1 /* Fork to 'x' (preferred) and 'y'.  */
+#define I_JMP   2 /* Go to 'x'.                         */
+#define I_SAVE  3 /* Save position in capture 'arg'.   */
+#define I_BOL   4 /* Beginning of line.                 */
+#define I_EOL   5 /* End of line.                       */
+#define I_MATCH 6 /* Pattern 'arg' matched.           */
+
+struct re_inst {
+	uint8_t  op;
+	uint16_t arg;
+	uint16_t x, y;
+};
+
+/* Byte sets. */
+struct re_set {
+	uint32_t bits[8];
+};
+
+#define set_has(s, c) (((s)->bits[(c) >> 5] >> ((c) & 31)) & 1)
+#define set_add(s, c) ((s)->bits[(c) >> 5] |= 1u << ((c) & 31))
+
+/* Lazy DFA. */
+#define DS_ACCEPT     1 /* Matched.                          */
+#define DS_ACCEPT_EOL 2 /* Matches if the input ends here.   */
+#define DS_DEAD       4 /* Can never match.                  */
+#define RE_DFA_BUCKETS 256
+
+struct re_dstate {
+	struct re_dstate *hnext;
+	uint16_t *pcs;
+	uint16_t *matches; /* Matched patterns, then the ones at EOL. */
+	uint32_t  hash;
+	uint16_t  npcs;
+	uint16_t  nmatches;
+	uint16_t  neol;
+	uint8_t   flags;
+	struct re_dstate *next[]; /* One per byte class, NULL if not built. */
+};
+
+/* Closure stack entry, 'slot' >= 0 restores a capture. */
+struct re_stack {
+	int pc;
+	int slot;
+	int old;
+};
+
+/* Pike VM thread list. */
+struct re_threads {
+	uint16_t *pcs;
+	int      *caps;
+	unsigned  n;
+	uint32_t  gen;
+};
+
+struct re {
+	struct re_inst *insts;
+	unsigned ninsts;
+	unsigned max_insts;
+	unsigned npatterns;
+	struct re_set *sets;
+	unsigned nsets;
+	size_t nsub;
+	int ncaps;
+
+	uint8_t byte_class[256];
+	uint8_t class_rep[256]; /* A byte of each class. */
+	unsigned nclasses;
+
+	/* DFA cache. */
+	char *cache;
+	size_t cache_size;
+	size_t cache_used;
+	struct re_dstate *buckets[RE_DFA_BUCKETS];
+	struct re_dstate *dfa_start;
+	unsigned long flushes;
+
+	/* Scratch. */
+	uint32_t *mark;
+	uint32_t gen;
+	struct re_stack *stack;
+	uint16_t *set_pcs;
+	uint16_t *tmp_pcs;
+	uint16_t *match_ids;
+	struct re_threads threads[2];
+	int *work_caps;
+	int *best_caps;
+
+	/* Per-thread copies, sharing the program, see re_local(). */
+	struct re *clones[RE_MAX_THREADS];
+	int is_clone;
+};
+
+/* Calling thread, 0 uses the regex itself. */
+static _Thread_local int re_thread;
+
+///////////////////////////////// PARSER //////////////////////////////////////
+
+#define N_SET   0
+#define N_CAT   1 /* List starting at 'a', may be empty. */
+#define N_ALT   2
+#define N_REP   3
+#define N_GROUP 4
+#define N_BOL   5
+#define N_EOL   6
+
+struct re_node {
+	int type;
+	int a, b;     /* Children, or set index. */
+	int next;     /* Next node in a N_CAT list, or -1. */
+	int min, max; /* Repetition, max -1 if unbounded. */
+};
+
+struct re_parser {
+	const char *pattern;
+	const char *p;
+	const char *err;
+	struct re_node *nodes;
+	int nnodes, cap_nodes;
+	struct re_set *sets;
+	unsigned nsets, cap_sets;
+	int nsub;
+	int depth;
+	int libc_differs; /* See re_check(). */
+};
+
+static int parse_alt(struct re_parser *ps);
+
+/**
+ * @brief Allocates a new AST node.
+ *
+ * @return Returns the node index, or -1 if error.
+ */
+static int node_new(struct re_parser *ps, int type, int a, int b)
+{
+	struct re_node *n;
+
+	if (ps->nnodes == ps->cap_nodes) {
+		ps->cap_nodes = ps->cap_nodes ? ps->cap_nodes * 2 : 32;
+		n = realloc(ps->nodes, ps->cap_nodes * sizeof(*n));
+		if (!n) {
+			ps->err = "out of memory";
+			return -1;
+		}
+		ps->nodes = n;
+	}
+
+	n = &ps->nodes[ps->nnodes];
+	n->type = type;
+	n->a    = a;
+	n->b    = b;
+	n->next = -1;
+	n->min  = n->max = 0;
+	return ps->nnodes++;
+}
+
+/**
+ * @brief Adds the byte set @p s to the set table, reusing an
+ * identical one if already there.
+ *
+ * @return Returns a new N_SET node, or -1 if error.
+ */
+static int node_set(struct re_parser *ps, const struct re_set *s)
+{
+	struct re_set *sets;
+	unsigned i;
+
+	for (i = 0; i < ps->nsets; i++)
+		if (!memcmp(&ps->sets[i], s, sizeof(*s)))
+			return node_new(ps, N_SET, i, 0);
+
+	if (ps->nsets == ps->cap_sets) {
+		ps->cap_sets = ps->cap_sets ? ps->cap_sets * 2 : 16;
+		sets = realloc(ps->sets, ps->cap_sets * sizeof(*sets));
+		if (!sets) {
+			ps->err = "out of memory";
+			return -1;
+		}
+		ps->sets = sets;
+	}
+
+	ps->sets[ps->nsets] = *s;
+	return node_new(ps, N_SET, ps->nsets++, 0);
+}
+
+/**
+ * @brief Adds all bytes in the character class @p name (like
+ * 'alpha') to @p s.
+ *
+ * @return Returns 0 if success, -1 if unknown class.
+ */
+static int set_add_class(struct re_set *s, const char *name, size_t len)
+{
+	static const struct {
+		const char *name;
+		int (*fn)(int);
+	} classes[] = {
+		{"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+		{"upper", isupper}, {"lower", islower}, {"space", isspace},
+		{"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+		{"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+	};
+
+	for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strlen(classes[i].name) != len ||
+			memcmp(classes[i].name, name, len))
+		{
+			continue;
+		}
+		for (int c = 1; c < 256; c++)
+			if (classes[i].fn(c))
+				set_add(s, c);
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Inverts the set @p s, NUL is never matched.
+ */
+static void set_invert(struct re_set *s)
+{
+	for (int i = 0; i < 8; i++)
+		s->bits[i] = ~s->bits[i];
+	s->bits[0] &= ~1u;
+}
+
+/**
+ * @brief Parses a bracket expression, starting after the '['.
+ */
+static int parse_bracket(struct re_parser *ps)
+{
+	struct re_set s = {0};
+	const char *p = ps->p;
+	const char *end;
+	int neg = 0;
+	int lo, hi;
+
+	if (*p == '^') {
+		neg = 1;
+		p++;
+	}
+
+	for (int first = 1; *p && (*p != ']' || first); first = 0) {
+		if (*p == '[' && p[1] == ':') {
+			if (!(end = strstr(p + 2, ":]")) ||
+				set_add_class(&s, p + 2, end - (p + 2)) < 0)
+			{
+				ps->err = "invalid character class";
+				return -1;
+			}
+			p = end + 2;
+			continue;
+		}
+		if (*p == '[' && (p[1] == '=' || p[1] == '.')) {
+			ps->err = "collating elements are not supported";
+			return -1;
+		}
+
+		lo = (unsigned char)*p++;
+		hi = lo;
+		if (*p == '-' && p[1] && p[1] != ']') {
+			hi = (unsigned char)p[1];
+			p += 2;
+			if (hi < lo) {
+				ps->err = "invalid range";
+				return -1;
+			}
+		}
+		for (int c = lo; c <= hi; c++)
+			set_add(&s, c);
+	}
+
+	if (*p != ']') {
+		ps->err = "unmatched [";
+		return -1;
+	}
+
+	ps->p = p + 1;
+	if (neg)
+		set_invert(&s);
+	return node_set(ps, &s);
+}
+
+/**
+ * @brief Parses an escape sequence, starting after the '\'.
+ */
+static int parse_escape(struct re_parser *ps)
+{
+	struct re_set s = {0};
+	int c = (unsigned char)*ps->p++;
+
+	/*
+	 * glibc knows \w \W \s \S (GNU extensions), but reads \d \D \t \n
+	 * and \r as the literal letter.
+	 */
+	if (strchr("dDtnr", c) && c != '\0')
+		ps->libc_differs = 1;
+
+	switch (c) {
+	case 'd': case 'D':
+		set_add_class(&s, "digit", 5);
+		break;
+	case 'w': case 'W':
+		set_add_class(&s, "alnum", 5);
+		set_add(&s, '_');
+		break;
+	case 's': case 'S':
+		set_add_class(&s, "space", 5);
+		break;
+	case 't': set_add(&s, '\t'); break;
+	case 'n': set_add(&s, '\n'); break;
+	case 'r': set_add(&s, '\r'); break;
+	case '\0':
+		ps->err = "trailing backslash";
+		return -1;
+	default:
+		/* Back-references, word boundaries... */
+		if (isalnum(c) || c == '<' || c == '>' || c == '`' || c == '\'') {
+			ps->err = "unsupported escape";
+			return -1;
+		}
+		set_add(&s, c);
+		break;
+	}
+
+	if (c == 'D' || c == 'W' || c == 'S')
+		set_invert(&s);
+	return node_set(ps, &s);
+}
+
+/**
+ * @brief Parses a single atom: literal, set, group or anchor.
+ */
+static int parse_atom(struct re_parser *ps)
+{
+	struct re_set s = {0};
+	int c = (unsigned char)*ps->p;
+	int n, g;
+
+	switch (c) {
+	case '(':
+		if (++ps->depth > RE_MAX_DEPTH) {
+			ps->err = "too many nested groups";
+			return -1;
+		}
+		ps->p++;
+		g = ++ps->nsub;
+		if ((n = parse_alt(ps)) < 0)
+			return -1;
+		if (*ps->p != ')') {
+			ps->err = "unmatched (";
+			return -1;
+		}
+		ps->p++;
+		ps->depth--;
+		return node_new(ps, N_GROUP, n, g);
+
+	case '[':
+		ps->p++;
+		return parse_bracket(ps);
+
+	case '\\':
+		ps->p++;
+		return parse_escape(ps);
+
+	case '.':
+		ps->p++;
+		set_invert(&s);
+		return node_set(ps, &s);
+
+	/*
+	 * Anchors that do not start (or end) a branch, like '$^', may match
+	 * differently than with glibc.
+	 */
+	case '^':
+		if (ps->p > ps->pattern && !strchr("(|", ps->p[-1]))
+			ps->libc_differs = 1;
+		ps->p++;
+		return node_new(ps, N_BOL, 0, 0);
+
+	case '$':
+		ps->p++;
+		if (*ps->p && !strchr(")|", *ps->p))
+			ps->libc_differs = 1;
+		return node_new(ps, N_EOL, 0, 0);
+
+	case '*':
+	case '+':
+	case '?':
+		ps->err = "repetition-operator operand invalid";
+		return -1;
+
+	default:
+		ps->p++;
+		set_add(&s, c);
+		return node_set(ps, &s);
+	}
+}
+
+/**
+ * @brief Parses a '{n}', '{n,}', '{n,m}' or (as glibc does) '{,m}'
+ * bound, starting after the '{'. A missing lower bound is 0.
+ */
+static int parse_bound(struct re_parser *ps, int *min, int *max)
+{
+	char *end;
+
+	*min = strtol(ps->p, &end, 10);
+	*max = *min;
+
+	if (*end == ',') {
+		end++;
+		*max = -1;
+		if (isdigit((unsigned char)*end))
+			*max = strtol(end, &end, 10);
+	}
+
+	if (*end != '}' || *min > RE_DUP_MAX || *max > RE_DUP_MAX ||
+		(*max >= 0 && *max < *min))
+	{
+		ps->err = "invalid repetition count";
+		return -1;
+	}
+	ps->p = end + 1;
+	return 0;
+}
+
+/**
+ * @brief Parses an atom followed by any amount of quantifiers.
+ */
+static int parse_repeat(struct re_parser *ps)
+{
+	int n, min, max;
+
+	if ((n = parse_atom(ps)) < 0)
+		return -1;
+
+	for (;;) {
+		switch (*ps->p) {
+		case '*': min = 0; max = -1; ps->p++; break;
+		case '+': min = 1; max = -1; ps->p++; break;
+		case '?': min = 0; max =  1; ps->p++; break;
+		case '{':
+			if (!isdigit((unsigned char)ps->p[1]) && ps->p[1] != ',')
+				return n;
+			ps->p++;
+			if (parse_bound(ps, &min, &max) < 0)
+				return -1;
+			break;
+		default:
+			return n;
+		}
+
+		if ((n = node_new(ps, N_REP, n, 0)) < 0)
+			return -1;
+		ps->nodes[n].min = min;
+		ps->nodes[n].max = max;
+	}
+}
+
+/**
+ * @brief Parses a concatenation, up to a '|', ')' or the end, as
+ * a list of nodes (so that long patterns do not nest deeply).
+ */
+static int parse_cat(struct re_parser *ps)
+{
+	int cat, tail, n;
+
+	if ((cat = node_new(ps, N_CAT, -1, 0)) < 0)
+		return -1;
+
+	tail = -1;
+	while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+		if ((n = parse_repeat(ps)) < 0)
+			return -1;
+		if (tail < 0)
+			ps->nodes[cat].a = n;
+		else
+			ps->nodes[tail].next = n;
+		tail = n;
+	}
+	return cat;
+}
+
+/**
+ * @brief Parses an alternation.
+ */
+static int parse_alt(struct re_parser *ps)
+{
+	int left, right;
+
+	if ((left = parse_cat(ps)) < 0)
+		return -1;
+
+	while (*ps->p == '|') {
+		ps->p++;
+		if ((right = parse_cat(ps)) < 0)
+			return -1;
+		if ((left = node_new(ps, N_ALT, left, right)) < 0)
+			return -1;
+	}
+	return left;
+}
+
+//////////////////////////////// COMPILER /////////////////////////////////////
+
+/**
+ * @brief Emits a new instruction.
+ *
+ * @return Returns its address, or -1 if the program is too big.
+ */
+static int emit(struct re *re, int op, int arg)
+{
+	if (re->ninsts >= re->max_insts)
+		return -1;
+
+	re->insts[re->ninsts].op  = op;
+	re->insts[re->ninsts].arg = arg;
+	re->insts[re->ninsts].x   = 0;
+	re->insts[re->ninsts].y   = 0;
+	return re->ninsts++;
+}
+
+/**
+ * @brief Compiles the AST node @p n into the program.
+ *
+ * @return Returns 0 if success, -1 if the program is too big.
+ */
+static int compile_node(struct re *re, const struct re_parser *ps, int n)
+{
+	const struct re_node *node = &ps->nodes[n];
+	int s, j, i, prev;
+
+	switch (node->type) {
+	case N_SET:
+		return (emit(re, I_SET, node->a) < 0) ? -1 : 0;
+
+	case N_CAT:
+		for (i = node->a; i >= 0; i = ps->nodes[i].next)
+			if (compile_node(re, ps, i) < 0)
+				return -1;
+		return 0;
+
+	case N_ALT:
+		if ((s = emit(re, I_SPLIT, 0)) < 0)
+			return -1;
+		re->insts[s].x = s + 1;
+		if (compile_node(re, ps, node->a) < 0 || (j = emit(re, I_JMP, 0)) < 0)
+			return -1;
+		re->insts[s].y = re->ninsts;
+		if (compile_node(re, ps, node->b) < 0)
+			return -1;
+		re->insts[j].x = re->ninsts;
+		return 0;
+
+	case N_GROUP:
+		if (emit(re, I_SAVE, node->b * 2) < 0 ||
+			compile_node(re, ps, node->a) < 0 ||
+			emit(re, I_SAVE, node->b * 2 + 1) < 0)
+		{
+			return -1;
+		}
+		return 0;
+
+	case N_BOL:
+		return (emit(re, I_BOL, 0) < 0) ? -1 : 0;
+
+	case N_EOL:
+		return (emit(re, I_EOL, 0) < 0) ? -1 : 0;
+
+	case N_REP:
+		/* Mandatory copies. */
+		for (i = 0; i < node->min; i++)
+			if (compile_node(re, ps, node->a) < 0)
+				return -1;
+
+		/* e*: L: split L+1, end; e; jmp L. */
+		if (node->max < 0) {
+			if ((s = emit(re, I_SPLIT, 0)) < 0)
+				return -1;
+			re->insts[s].x = s + 1;
+			if (compile_node(re, ps, node->a) < 0 || (j = emit(re, I_JMP, 0)) < 0)
+				return -1;
+			re->insts[j].x = s;
+			re->insts[s].y = re->ninsts;
+			return 0;
+		}
+
+		/*
+		 * Optional copies, nested: (e(e(e)?)?)?, all the splits exit
+		 * to the end, chained through 'y' until it is known.
+		 */
+		prev = -1;
+		for (i = 0; i < node->max - node->min; i++) {
+			if ((s = emit(re, I_SPLIT, 0)) < 0)
+				return -1;
+			re->insts[s].x = s + 1;
+			re->insts[s].y = (prev < 0) ? UINT16_MAX : prev;
+			prev = s;
+			if (compile_node(re, ps, node->a) < 0)
+				return -1;
+		}
+		for (s = prev; s >= 0; s = j) {
+			j = (re->insts[s].y == UINT16_MAX) ? -1 : re->insts[s].y;
+			re->insts[s].y = re->ninsts;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * @brief Splits the 256 bytes into classes of bytes that no set
+ * can tell apart, so that DFA states only need one transition per
+ * class.
+ */
+static void compute_byte_classes(struct re *re)
+{
+	int remap[256];
+	int used[256];
+	unsigned n = 1;
+
+	memset(re->byte_class, 0, sizeof(re->byte_class));
+
+	/* Refine the partition with each set. */
+	for (unsigned i = 0; i < re->nsets; i++) {
+		memset(remap, -1, sizeof(remap));
+		for (int c = 0; c < 256; c++) {
+			if (!set_has(&re->sets[i], c))
+				continue;
+			if (remap[re->byte_class[c]] < 0)
+				remap[re->byte_class[c]] = n++;
+			re->byte_class[c] = remap[re->byte_class[c]];
+		}
+	}
+
+	/* Compact the class numbers. */
+	memset(used, -1, sizeof(used));
+	re->nclasses = 0;
+	for (int c = 0; c < 256; c++) {
+		if (used[re->byte_class[c]] < 0) {
+			used[re->byte_class[c]] = re->nclasses;
+			re->class_rep[re->nclasses++] = c;
+		}
+		re->byte_class[c] = used[re->byte_class[c]];
+	}
+}
+
+/**
+ * @brief Frees the compiled regex @p re.
+ */
+void re_free(struct re *re)
+{
+	if (!re)
+		return;
+	if (!re->is_clone) {
+		free(re->insts);
+		free(re->sets);
+		for (int i = 0; i < RE_MAX_THREADS; i++)
+			re_free(re->clones[i]);
+	}
+	free(re->cache);
+	free(re->mark);
+	free(re->stack);
+	free(re->set_pcs);
+	free(re->tmp_pcs);
+	free(re->match_ids);
+	free(re->threads[0].pcs);
+	free(re->threads[0].caps);
+	free(re->threads[1].pcs);
+	free(re->threads[1].caps);
+	free(re->work_caps);
+	free(re->best_caps);
+	free(re);
+}
+
+/**
+ * @brief Allocates the DFA cache and the matching scratch buffers of
+ * the compiled regex @p re.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+static int alloc_scratch(struct re *re)
+{
+	size_t ni = re->ninsts;
+
+	re->cache     = malloc(re->cache_size);
+	re->mark      = calloc(ni, sizeof(*re->mark));
+	re->stack     = malloc((2 * ni + 2) * sizeof(*re->stack));
+	re->set_pcs   = malloc(ni * sizeof(*re->set_pcs));
+	re->tmp_pcs   = malloc(ni * sizeof(*re->tmp_pcs));
+	re->match_ids = malloc(2 * re->npatterns * sizeof(*re->match_ids));
+	re->work_caps = malloc(re->ncaps * sizeof(int));
+	re->best_caps = malloc(re->ncaps * sizeof(int));
+	for (int i = 0; i < 2; i++) {
+		re->threads[i].pcs  = malloc(ni * sizeof(uint16_t));
+		re->threads[i].caps = malloc(ni * re->ncaps * sizeof(int));
+	}
+	if (!re->cache || !re->mark || !re->stack || !re->set_pcs ||
+		!re->tmp_pcs || !re->match_ids || !re->work_caps ||
+		!re->best_caps || !re->threads[0].pcs || !re->threads[0].caps ||
+		!re->threads[1].pcs || !re->threads[1].caps)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Sets the calling thread id, between 0 and RE_MAX_THREADS-1:
+ * threads with different ids can match the same regexes at the same
+ * time, each one with its own DFA cache.
+ */
+void re_set_thread(int id) {
+	re_thread = id;
+}
+
+/**
+ * @brief Returns the copy of the compiled regex @p re that belongs to
+ * the calling thread, creating it on first use: it shares the program
+ * with @p re, but not the DFA cache nor the scratch buffers.
+ *
+ * @return Returns the copy, or NULL if out of memory.
+ */
+static struct re *re_local(struct re *re)
+{
+	struct re *c;
+
+	if (!re_thread)
+		return re;
+	if ((c = re->clones[re_thread]))
+		return c;
+
+	if (!(c = malloc(sizeof(*c))))
+		return NULL;
+
+	memcpy(c, re, sizeof(*c));
+	memset(&c->cache, 0, sizeof(*c) - offsetof(struct re, cache));
+	c->cache_size = re->cache_size;
+	c->is_clone   = 1;
+
+	if (alloc_scratch(c) < 0) {
+		re_free(c);
+		return NULL;
+	}
+	return (re->clones[re_thread] = c);
+}
+
+/**
+ * @brief Parses the ERE @p pattern into @p ps.
+ *
+ * @return Returns the root node, or -1 if error.
+ */
+static int parse_pattern(struct re_parser *ps, const char *pattern)
+{
+	int root;
+
+	ps->pattern = pattern;
+	ps->p       = pattern;
+	ps->nsub    = 0;
+	ps->depth   = 0;
+
+	root = parse_alt(ps);
+	if (root >= 0 && *ps->p == ')') {
+		ps->err = "unmatched )";
+		root  = -1;
+	}
+	return root;
+}
+
+/**
+ * @brief Compiles the @p n patterns in @p patterns into a single
+ * regex: with captures, if just one, or as a set otherwise.
+ *
+ * @return Returns the compiled regex, or NULL if error.
+ */
+static struct re *
+re_build(const char *const *patterns, unsigned n, const char **err)
+{
+	struct re_parser ps = {0};
+	struct re *re;
+	int *roots;
+	int s = -1;
+
+	*err = NULL;
+
+	re    = calloc(1, sizeof(*re));
+	roots = malloc(n * sizeof(*roots));
+	if (!re || !roots) {
+		ps.err = "out of memory";
+		goto err;
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		if ((roots[i] = parse_pattern(&ps, patterns[i])) < 0)
+			goto err;
+
+	re->npatterns = n;
+	re->sets      = ps.sets;
+	re->nsets     = ps.nsets;
+	re->nsub      = (n == 1) ? ps.nsub : 0;
+	re->ncaps     = (re->nsub + 1) * 2;
+	re->max_insts = (n == 1) ? RE_MAX_INSTS : RE_SET_MAX_INSTS;
+	re->cache_size = (n == 1) ? RE_DFA_CACHE_SIZE : RE_SET_CACHE_SIZE;
+	ps.sets       = NULL;
+
+	if (!(re->insts = malloc(re->max_insts * sizeof(*re->insts)))) {
+		ps.err = "out of memory";
+		goto err;
+	}
+
+	/*
+	 * Single: SAVE 0; <regex>; SAVE 1; MATCH 0.
+	 * Set:    SPLIT L0, L1; L0: <regex0>; MATCH 0; L1: SPLIT L1', L2...
+	 */
+	ps.err = "regex too big";
+	for (unsigned i = 0; i < n; i++) {
+		if (s >= 0)
+			re->insts[s].y = re->ninsts;
+		if (i < n - 1) {
+			if ((s = emit(re, I_SPLIT, 0)) < 0)
+				goto err;
+			re->insts[s].x = s + 1;
+		}
+		if (n == 1 && emit(re, I_SAVE, 0) < 0)
+			goto err;
+		if (compile_node(re, &ps, roots[i]) < 0)
+			goto err;
+		if (n == 1 && emit(re, I_SAVE, 1) < 0)
+			goto err;
+		if (emit(re, I_MATCH, i) < 0)
+			goto err;
+	}
+	ps.err = "out of memory";
+
+	compute_byte_classes(re);
+
+	if (alloc_scratch(re) < 0)
+		goto err;
+
+	free(roots);
+	free(ps.nodes);
+	return re;
+
+err:
+	*err = ps.err;
+	free(roots);
+	free(ps.nodes);
+	free(ps.sets);
+	re_free(re);
+	return NULL;
+}
+
+/**
+ * @brief Compiles the ERE @p pattern.
+ *
+ * @param pattern Extended regular expression.
+ * @param err     Error message (output), if failed.
+ *
+ * @return Returns the compiled regex, or NULL if error.
+ */
+struct re *re_compile(const char *pattern, const char **err) {
+	return re_build(&pattern, 1, err);
+}
+
+/**
+ * @brief Compiles the @p n EREs in @p patterns into a set, to be
+ * matched all at once by re_set_match().
+ *
+ * @param patterns Extended regular expressions.
+ * @param n        Amount of patterns.
+ * @param err      Error message (output), if failed.
+ *
+ * @return Returns the compiled set, or NULL if error.
+ */
+struct re *re_set_compile(const char *const *patterns, unsigned n,
+	const char **err)
+{
+	if (!n || n > RE_SET_MAX) {
+		*err = "invalid amount of patterns";
+		return NULL;
+	}
+	return re_build(patterns, n, err);
+}
+
+/**
+ * @brief Checks whether the ERE @p pattern is supported by the
+ * built-in engine, without compiling it.
+ *
+ * @return Returns 0 if supported, RE_CHECK_LIBC_DIFFERS if supported
+ * but libc may not agree on what it matches (shorthands like '\d',
+ * anchors amid a branch), -1 otherwise (see @p err).
+ */
+int re_check(const char *pattern, const char **err)
+{
+	struct re_parser ps = {0};
+	int ret;
+
+	if (parse_pattern(&ps, pattern) < 0)
+		ret = -1;
+	else
+		ret = ps.libc_differs ? RE_CHECK_LIBC_DIFFERS : 0;
+	*err = ps.err;
+	free(ps.nodes);
+	free(ps.sets);
+	return ret;
+}
+
+/**
+ * @brief Returns the amount of groups of the regex @p re.
+ */
+size_t re_nsub(const struct re *re) {
+	return re->nsub;
+}
+
+/**
+ * @brief Returns how many times the DFA cache of @p re was flushed.
+ */
+unsigned long re_dfa_flushes(const struct re *re)
+{
+	unsigned long flushes = re->flushes;
+	for (int i = 0; i < RE_MAX_THREADS; i++)
+		if (re->clones[i])
+			flushes += re->clones[i]->flushes;
+	return flushes;
+}
+
+//////////////////////////////// LAZY DFA /////////////////////////////////////
+
+/**
+ * @brief Adds the epsilon closure of @p pc to @p out (unless already
+ * marked with the current generation): only the instructions that
+ * wait for input (SET), the end of it (EOL), or MATCH are kept.
+ *
+ * @param bol Whether at the beginning of the input.
+ * @param eol Whether at the end of the input.
+ */
+static void dfa_closure(struct re *re, int pc, int bol, int eol,
+	uint16_t *out, unsigned *n)
+{
+	struct re_stack *sp = re->stack;
+	struct re_inst *in;
+
+	(sp++)->pc = pc;
+	while (sp > re->stack) {
+		pc = (--sp)->pc;
+		if (re->mark[pc] == re->gen)
+			continue;
+		re->mark[pc] = re->gen;
+
+		in = &re->insts[pc];
+		switch (in->op) {
+		case I_SPLIT:
+			(sp++)->pc = in->y;
+			(sp++)->pc = in->x;
+			break;
+		case I_JMP:
+			(sp++)->pc = in->x;
+			break;
+		case I_SAVE:
+			(sp++)->pc = pc + 1;
+			break;
+		case I_BOL:
+			if (bol)
+				(sp++)->pc = pc + 1;
+			break;
+		case I_EOL:
+			if (eol)
+				(sp++)->pc = pc + 1;
+			else
+				out[(*n)++] = pc;
+			break;
+		default:
+			out[(*n)++] = pc;
+			break;
+		}
+	}
+}
+
+static int pc_cmp(const void *a, const void *b) {
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+/**
+ * @brief Empties the DFA cache.
+ */
+static void dfa_flush(struct re *re)
+{
+	re->cache_used = 0;
+	re->dfa_start  = NULL;
+	memset(re->buckets, 0, sizeof(re->buckets));
+	re->flushes++;
+}
+
+/**
+ * @brief Retrieves the DFA state for the sorted thread set @p pcs,
+ * creating it if not cached yet.
+ *
+ * @return Returns the state, or NULL if it does not fit in the
+ * cache (flushing it first if needed).
+ */
+static struct re_dstate *
+dfa_state(struct re *re, const uint16_t *pcs, unsigned n, int *flushed)
+{
+	struct re_dstate *st;
+	uint32_t hash = 2166136261u;
+	unsigned nm = 0, ne = 0;
+	unsigned eol_n = 0;
+	size_t size;
+	int flags = 0;
+
+	for (unsigned i = 0; i < n; i++)
+		hash = (hash ^ pcs[i]) * 16777619u;
+
+	for (st = re->buckets[hash % RE_DFA_BUCKETS]; st; st = st->hnext) {
+		if (st->hash == hash && st->npcs == n &&
+			!memcmp(st->pcs, pcs, n * sizeof(*pcs)))
+		{
+			return st;
+		}
+	}
+
+	/* Matched patterns, now and if the input ends here. */
+	re->gen++;
+	for (unsigned i = 0; i < n; i++) {
+		if (re->insts[pcs[i]].op == I_MATCH)
+			re->match_ids[nm++] = re->insts[pcs[i]].arg;
+		else if (re->insts[pcs[i]].op == I_EOL)
+			dfa_closure(re, pcs[i] + 1, 0, 1, re->tmp_pcs, &eol_n);
+	}
+	for (unsigned i = 0; i < eol_n; i++)
+		if (re->insts[re->tmp_pcs[i]].op == I_MATCH)
+			re->match_ids[nm + ne++] = re->insts[re->tmp_pcs[i]].arg;
+
+	if (nm)
+		flags |= DS_ACCEPT | DS_ACCEPT_EOL;
+	if (ne)
+		flags |= DS_ACCEPT_EOL;
+	if (!n)
+		flags |= DS_DEAD;
+
+	size  = sizeof(*st) + re->nclasses * sizeof(st->next[0]);
+	size += (n + nm + ne) * sizeof(*pcs);
+	size  = (size + 7) & ~(size_t)7;
+
+	if (re->cache_used + size > re->cache_size) {
+		dfa_flush(re);
+		*flushed = 1;
+		if (size > re->cache_size)
+			return NULL;
+	}
+
+	st = (struct re_dstate *)(re->cache + re->cache_used);
+	re->cache_used += size;
+
+	memset(st->next, 0, re->nclasses * sizeof(st->next[0]));
+	st->pcs      = (uint16_t *)&st->next[re->nclasses];
+	st->matches  = st->pcs + n;
+	st->hash     = hash;
+	st->npcs     = n;
+	st->nmatches = nm;
+	st->neol     = ne;
+	st->flags    = flags;
+	memcpy(st->pcs, pcs, n * sizeof(*pcs));
+	memcpy(st->matches, re->match_ids, (nm + ne) * sizeof(*pcs));
+
+	st->hnext = re->buckets[hash % RE_DFA_BUCKETS];
+	re->buckets[hash % RE_DFA_BUCKETS] = st;
+	return st;
+}
+
+/**
+ * @brief Builds the DFA start state, i.e., the closure of the
+ * program start, at the beginning of the input.
+ */
+static struct re_dstate *dfa_start_state(struct re *re)
+{
+	unsigned n = 0;
+	int flushed = 0;
+
+	re->gen++;
+	dfa_closure(re, 0, 1, 0, re->set_pcs, &n);
+	qsort(re->set_pcs, n, sizeof(*re->set_pcs), pc_cmp);
+	return (re->dfa_start = dfa_state(re, re->set_pcs, n, &flushed));
+}
+
+/**
+ * @brief Builds the transition from the state @p st on the byte
+ * class @p cls: every thread waiting for a byte in that class
+ * advances, and a new thread starts (unanchored search).
+ *
+ * @return Returns the next state, or NULL if error.
+ */
+static struct re_dstate *
+dfa_step(struct re *re, struct re_dstate *st, unsigned cls)
+{
+	int c = re->class_rep[cls];
+	struct re_dstate *next;
+	struct re_inst *in;
+	unsigned n = 0;
+	int flushed = 0;
+
+	re->gen++;
+	for (unsigned i = 0; i < st->npcs; i++) {
+		in = &re->insts[st->pcs[i]];
+		if (in->op == I_SET && set_has(&re->sets[in->arg], c))
+			dfa_closure(re, st->pcs[i] + 1, 0, 0, re->set_pcs, &n);
+	}
+	dfa_closure(re, 0, 0, 0, re->set_pcs, &n);
+	qsort(re->set_pcs, n, sizeof(*re->set_pcs), pc_cmp);
+
+	next = dfa_state(re, re->set_pcs, n, &flushed);
+	if (next && !flushed)
+		st->next[cls] = next;
+	return next;
+}
+
+/**
+ * @brief Decides whether @p str (of length @p len) matches.
+ *
+ * @return Returns 1 if match, 0 if not, and -1 if the DFA cache
+ * is too small for this regex.
+ */
+static int dfa_search(struct re *re, const unsigned char *str, size_t len)
+{
+	struct re_dstate *st, *next;
+	unsigned cls;
+
+	if (!(st = re->dfa_start) && !(st = dfa_start_state(re)))
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		if (st->flags & (DS_ACCEPT|DS_DEAD))
+			return !!(st->flags & DS_ACCEPT);
+
+		cls = re->byte_class[str[i]];
+		if (!(next = st->next[cls]) && !(next = dfa_step(re, st, cls)))
+			return -1;
+		st = next;
+	}
+	return !!(st->flags & DS_ACCEPT_EOL);
+}
+
+/**
+ * @brief Adds the @p n pattern ids in @p ids to the set @p hits.
+ *
+ * @return Returns the amount of new hits.
+ */
+static unsigned
+hits_add(unsigned long *hits, const uint16_t *ids, unsigned n)
+{
+	unsigned added = 0;
+	unsigned long bit;
+
+	for (unsigned i = 0; i < n; i++) {
+		bit = 1UL << (ids[i] % RE_WORD_BITS);
+		if (!(hits[ids[i] / RE_WORD_BITS] & bit)) {
+			hits[ids[i] / RE_WORD_BITS] |= bit;
+			added++;
+		}
+	}
+	return added;
+}
+
+/**
+ * @brief Matches @p str (of length @p len) against all patterns of
+ * the set @p re at once.
+ *
+ * @param re   Compiled set.
+ * @param str  String to be matched.
+ * @param len  String length.
+ * @param hits Bitset of matched patterns (output), one bit per
+ *             pattern, must be zeroed by the caller.
+ *
+ * @return Returns the amount of matched patterns, or -1 if the DFA
+ * cache is too small or out of memory (so all of them might match).
+ */
+int re_set_match(struct re *re, const char *str, size_t len,
+	unsigned long *hits)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	struct re_dstate *st, *next;
+	unsigned matched = 0;
+	unsigned cls;
+
+	if (!(re = re_local(re)))
+		return -1;
+	if (!(st = re->dfa_start) && !(st = dfa_start_state(re)))
+		return -1;
+
+	for (size_t i = 0; i < len; i++) {
+		if (st->nmatches) {
+			matched += hits_add(hits, st->matches, st->nmatches);
+			if (matched == re->npatterns)
+				return matched;
+		}
+		if (st->flags & DS_DEAD)
+			return matched;
+
+		cls = re->byte_class[s[i]];
+		if (!(next = st->next[cls]) && !(next = dfa_step(re, st, cls)))
+			return -1;
+		st = next;
+	}
+
+	matched += hits_add(hits, st->matches, st->nmatches + st->neol);
+	return matched;
+}
+
+//////////////////////////////// PIKE VM //////////////////////////////////////
+
+/**
+ * @brief Adds the thread at @p pc, with captures @p caps, and all the
+ * threads reachable from it to the list @p l, in priority order.
+ * @p caps is restored before returning.
+ */
+static void pike_add(struct re *re, struct re_threads *l, int pc,
+	int *caps, size_t sp, size_t len)
+{
+	struct re_stack *st = re->stack;
+	struct re_inst *in;
+
+	st->pc   = pc;
+	st->slot = -1;
+	st++;
+
+	while (st > re->stack) {
+		st--;
+		if (st->slot >= 0) {
+			caps[st->slot] = st->old;
+			continue;
+		}
+
+		pc = st->pc;
+		if (re->mark[pc] == l->gen)
+			continue;
+		re->mark[pc] = l->gen;
+
+		in = &re->insts[pc];
+		switch (in->op) {
+		case I_SPLIT:
+			*st++ = (struct re_stack){in->y, -1, 0};
+			*st++ = (struct re_stack){in->x, -1, 0};
+			break;
+		case I_JMP:
+			*st++ = (struct re_stack){in->x, -1, 0};
+			break;
+		case I_SAVE:
+			*st++ = (struct re_stack){0, in->arg, caps[in->arg]};
+			caps[in->arg] = sp;
+			*st++ = (struct re_stack){pc + 1, -1, 0};
+			break;
+		case I_BOL:
+			if (sp == 0)
+				*st++ = (struct re_stack){pc + 1, -1, 0};
+			break;
+		case I_EOL:
+			if (sp == len)
+				*st++ = (struct re_stack){pc + 1, -1, 0};
+			break;
+		default:
+			l->pcs[l->n] = pc;
+			memcpy(l->caps + l->n * re->ncaps, caps, re->ncaps * sizeof(int));
+			l->n++;
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Runs the Pike VM over @p str, saving the leftmost match
+ * captures into @p best.
+ *
+ * @return Returns 1 if match, 0 otherwise.
+ */
+static int pike_run(struct re *re, const unsigned char *str, size_t len,
+	int *best)
+{
+	struct re_threads *cl = &re->threads[0];
+	struct re_threads *nl = &re->threads[1];
+	struct re_threads *tmp;
+	struct re_inst *in;
+	int *caps = re->work_caps;
+	int matched = 0;
+
+	cl->n   = 0;
+	cl->gen = ++re->gen;
+
+	for (size_t sp = 0; ; sp++) {
+		/* New thread, with the lowest priority, while no match. */
+		if (!matched) {
+			for (int i = 0; i < re->ncaps; i++)
+				caps[i] = -1;
+			pike_add(re, cl, 0, caps, sp, len);
+		}
+
+		if (!cl->n && matched)
+			break;
+
+		nl->n   = 0;
+		nl->gen = ++re->gen;
+
+		for (unsigned i = 0; i < cl->n; i++) {
+			in = &re->insts[cl->pcs[i]];
+			if (in->op == I_MATCH) {
+				matched = 1;
+				memcpy(best, cl->caps + i * re->ncaps, re->ncaps * sizeof(int));
+				break; /* Lower priority threads are cut. */
+			}
+			if (sp < len && set_has(&re->sets[in->arg], str[sp])) {
+				memcpy(caps, cl->caps + i * re->ncaps, re->ncaps * sizeof(int));
+				pike_add(re, nl, cl->pcs[i] + 1, caps, sp + 1, len);
+			}
+		}
+
+		if (sp == len)
+			break;
+
+		tmp = cl;
+		cl  = nl;
+		nl  = tmp;
+	}
+	return matched;
+}
+
+/**
+ * @brief Matches the string @p str against the regex @p re, with
+ * the same semantics as regexec() (without flags).
+ *
+ * @param re     Compiled regex.
+ * @param str    String to be matched.
+ * @param nmatch Size of @p pmatch.
+ * @param pmatch Match and submatches (output).
+ *
+ * @return Returns 0 if match, REG_NOMATCH otherwise (or REG_ESPACE,
+ * if out of memory).
+ */
+int re_exec(struct re *re, const char *str, size_t nmatch,
+	regmatch_t *pmatch)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t len = strlen(str);
+	int *caps;
+	int ret;
+
+	if (!(re = re_local(re)))
+		return REG_ESPACE;
+
+	caps = re->best_caps;
+	ret  = dfa_search(re, s, len);
+	if (!ret || (ret > 0 && !nmatch))
+		return ret ? 0 : REG_NOMATCH;
+
+	/* Captures (or the decision, if the DFA could not make it). */
+	ret = pike_run(re, s, len, caps) ? 0 : REG_NOMATCH;
+
+	for (size_t i = 0; !ret && i < nmatch; i++) {
+		pmatch[i].rm_so = -1;
+		pmatch[i].rm_eo = -1;
+		if (i <= re->nsub && caps[2 * i] >= 0 && caps[2 * i + 1] >= 0) {
+			pmatch[i].rm_so = caps[2 * i];
+			pmatch[i].rm_eo = caps[2 * i + 1];
+		}
+	}
+	return ret;
+}
+
+///////////////////////////////// RULES ///////////////////////////////////////
+
+/*
+ * Rule sets: all rule regexes supported by the built-in engine (no
+ * matter which engine runs their capture pass) also join a set of
+ * their subject, so that a single pass over a message tells which
+ * rules can match it. Each set holds up to RE_SET_MAX rules, more
+ * rules just open more sets. Rules run by libc whose pattern libc
+ * reads differently (see re_check()) are left out.
+ */
+static struct rule_set {
+	const char *patterns[RE_SET_MAX];
+	struct rule_regex *rules[RE_SET_MAX];
+	unsigned n;
+	struct re *re;
+} *rule_sets;
+static int num_rule_sets;
+
+/* Set currently being filled, per subject, -1 if none. */
+static int open_set[RE_SUBJECTS] = {-1, -1};
+
+/**
+ * @brief Adds the rule regex @p rr, whose pattern is @p pattern, to
+ * the open set of its subject, opening a new one if needed. If out of
+ * memory, the rule is just left out of the sets.
+ */
+static void rule_set_add(struct rule_regex *rr, const char *pattern)
+{
+	struct rule_set *set, *sets;
+	int *cur = &open_set[rr->subject];
+
+	if (*cur < 0 || rule_sets[*cur].n == RE_SET_MAX) {
+		sets = realloc(rule_sets, (num_rule_sets + 1) * sizeof(*rule_sets));
+		if (!sets)
+			return;
+		rule_sets = sets;
+		memset(&rule_sets[num_rule_sets], 0, sizeof(*rule_sets));
+		*cur = num_rule_sets++;
+	}
+
+	set = &rule_sets[*cur];
+	rr->set    = *cur;
+	rr->set_id = set->n;
+	set->patterns[set->n] = pattern;
+	set->rules[set->n++]  = rr;
+}
+
+/**
+ * @brief Compiles the rule regex @p pattern with the engine @p engine.
+ * If the built-in engine does not support the pattern, falls back to
+ * libc (rr->engine tells which one was used).
+ *
+ * @param rr      Rule regex.
+ * @param pattern Extended regular expression.
+ * @param engine  Preferred engine.
+ * @param subject What the rule matches: RE_SUBJECT_MSG or _BODY.
+ * @param err     Why the built-in engine was not used (output), or
+ *                NULL.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int rule_regcomp(struct rule_regex *rr, const char *pattern, int engine,
+	int subject, const char **err)
+{
+	const char *set_err;
+	int check;
+
+	memset(rr, 0, sizeof(*rr));
+	*err = NULL;
+
+	rr->subject = subject;
+	rr->set     = -1;
+	check       = re_check(pattern, &set_err);
+
+	if (engine == RE_ENGINE_BUILTIN) {
+		if ((rr->re = re_compile(pattern, err))) {
+			rr->engine  = RE_ENGINE_BUILTIN;
+			rr->re_nsub = re_nsub(rr->re);
+			if (check >= 0)
+				rule_set_add(rr, pattern);
+			return 0;
+		}
+	}
+
+	rr->engine = RE_ENGINE_LIBC;
+	if (regcomp(&rr->posix, pattern, REG_EXTENDED))
+		return -1;
+
+	/* The set must not drop lines that regexec() would match. */
+	if (check == 0)
+		rule_set_add(rr, pattern);
+
+	rr->re_nsub = rr->posix.re_nsub;
+	return 0;
+}
+
+/**
+ * @brief Matches @p str against the rule regex @p rr, see regexec().
+ */
+int rule_regexec(struct rule_regex *rr, const char *str, size_t nmatch,
+	regmatch_t *pmatch)
+{
+	if (rr->engine == RE_ENGINE_BUILTIN)
+		return re_exec(rr->re, str, nmatch, pmatch);
+	return regexec(&rr->posix, str, nmatch, pmatch, 0);
+}
+
+/**
+ * @brief Compiles the rule sets, must be called once, after all rule
+ * regexes were compiled.
+ *
+ * @return Returns the amount of rules in sets, or -1 if some set
+ * could not be built (its rules are then matched one by one).
+ */
+int rule_regset_build(void)
+{
+	struct rule_set *set;
+	const char *err;
+	int ret = 0;
+
+	for (int i = 0; i < num_rule_sets; i++) {
+		set = &rule_sets[i];
+		if (!(set->re = re_set_compile(set->patterns, set->n, &err))) {
+			for (unsigned j = 0; j < set->n; j++)
+				set->rules[j]->set = -1;
+			set->n = 0;
+			ret = -1;
+			continue;
+		}
+		if (ret >= 0)
+			ret += set->n;
+	}
+	return ret;
+}
+
+/**
+ * @brief Initializes the hit sets @p h, for all the rule sets: must
+ * be called after rule_regset_build(), once per log event buffer.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int rule_hits_init(struct rule_hits *h)
+{
+	size_t n = num_rule_sets ? num_rule_sets : 1;
+
+	h->scanned = calloc(n, sizeof(*h->scanned));
+	h->bits    = calloc(n * RE_SET_WORDS, sizeof(*h->bits));
+	if (!h->scanned || !h->bits) {
+		free(h->scanned);
+		free(h->bits);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Forgets the set hits @p h of the previous message.
+ */
+void rule_hits_reset(struct rule_hits *h)
+{
+	memset(h->scanned, 0, num_rule_sets);
+}
+
+/**
+ * @brief Checks whether the rule regex @p rr might match the message
+ * @p msg, whose body is @p body. The rule's set is matched the first
+ * time it is needed for a message, and its result saved in @p h.
+ *
+ * @return Returns 1 if the rule might match (or is not in a set),
+ * and 0 if it surely does not.
+ */
+int rule_regset_pass(struct rule_regex *rr, struct rule_hits *h,
+	const char *msg, const char *body)
+{
+	unsigned long *bits;
+	const char *str;
+
+	if (rr->set < 0)
+		return 1;
+
+	bits = &h->bits[rr->set * RE_SET_WORDS];
+	if (!h->scanned[rr->set]) {
+		h->scanned[rr->set] = 1;
+		str = (rr->subject == RE_SUBJECT_BODY) ? body : msg;
+		memset(bits, 0, RE_SET_WORDS * sizeof(*bits));
+		if (re_set_match(rule_sets[rr->set].re, str, strlen(str), bits) < 0)
+			memset(bits, 0xFF, RE_SET_WORDS * sizeof(*bits));
+	}
+
+	return (bits[rr->set_id / RE_WORD_BITS] >> (rr->set_id % RE_WORD_BITS)) & 1;
+}
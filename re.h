@@ -0,0 +1,104 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef RE_H
+#define RE_H
+
+	#include <limits.h>
+	#include <regex.h>
+	#include <stddef.h>
+
+	/* Regex engines. */
+	#define RE_ENGINE_LIBC    0 /* regcomp()/regexec().          */
+	#define RE_ENGINE_BUILTIN 1 /* Lazy DFA + NFA, see re.c.     */
+	#define RE_ENGINES_LEN    2
+
+	/* Build-time default engine, rules might override it. */
+	#ifdef USE_BUILTIN_REGEX
+	#define RE_ENGINE_DEFAULT RE_ENGINE_BUILTIN
+	#else
+	#define RE_ENGINE_DEFAULT RE_ENGINE_LIBC
+	#endif
+
+	/* Maximum program size, after expanding bounded repetitions. */
+	#define RE_MAX_INSTS 4096
+
+	/* Sets: maximum amount of patterns and program size. */
+	#define RE_SET_MAX       64
+	#define RE_SET_MAX_INSTS 65000
+
+	#define RE_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+	#define RE_SET_WORDS ((RE_SET_MAX + RE_WORD_BITS - 1) / RE_WORD_BITS)
+
+	/* Maximum amount of threads matching the same regexes. */
+	#define RE_MAX_THREADS 16
+
+	/* re_check(): supported, but libc may match it differently. */
+	#define RE_CHECK_LIBC_DIFFERS 1
+
+	/* Maximum group nesting. */
+	#define RE_MAX_DEPTH 32
+
+	/* Lazy DFA cache size, per regex: flushed when full. */
+	#ifndef RE_DFA_CACHE_SIZE
+	#define RE_DFA_CACHE_SIZE (64 * 1024)
+	#endif
+	#ifndef RE_SET_CACHE_SIZE
+	#define RE_SET_CACHE_SIZE (256 * 1024)
+	#endif
+
+	struct re;
+
+	/* Rule subjects, each one with its own sets. */
+	#define RE_SUBJECT_MSG  0 /* Whole message. */
+	#define RE_SUBJECT_BODY 1 /* Message body.  */
+	#define RE_SUBJECTS     2
+
+	/* A rule regex, compiled by any of the engines. */
+	struct rule_regex {
+		int        engine;
+		size_t     re_nsub;
+		regex_t    posix;
+		struct re *re;
+		int        subject;
+		int        set;    /* Its set, -1 if none.   */
+		int        set_id; /* Index in its set.      */
+	};
+
+	/*
+	 * Rule set hits for a message, matched on demand, sized after all
+	 * sets are built: see rule_hits_init().
+	 */
+	struct rule_hits {
+		unsigned char *scanned; /* Per set: already matched. */
+		unsigned long *bits;    /* Per set: RE_SET_WORDS.    */
+	};
+
+	extern const char *const re_engines_str[RE_ENGINES_LEN];
+
+	extern struct re *re_compile(const char *pattern, const char **err);
+	extern int re_exec(struct re *re, const char *str, size_t nmatch,
+		regmatch_t *pmatch);
+	extern struct re *re_set_compile(const char *const *patterns,
+		unsigned n, const char **err);
+	extern int re_set_match(struct re *re, const char *str, size_t len,
+		unsigned long *hits);
+	extern int re_check(const char *pattern, const char **err);
+	extern size_t re_nsub(const struct re *re);
+	extern unsigned long re_dfa_flushes(const struct re *re);
+	extern void re_free(struct re *re);
+	extern void re_set_thread(int id);
+
+	extern int rule_regcomp(struct rule_regex *rr, const char *pattern,
+		int engine, int subject, const char **err);
+	extern int rule_regset_build(void);
+	extern int rule_hits_init(struct rule_hits *h);
+	extern void rule_hits_reset(struct rule_hits *h);
+	extern int rule_regset_pass(struct rule_regex *rr, struct rule_hits *h,
+		const char *msg, const char *body);
+	extern int rule_regexec(struct rule_regex *rr, const char *str,
+		size_t nmatch, regmatch_t *pmatch);
+
+#endif /* RE_H */
@@ -0,0 +1,412 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "events.h"
+#include "log.h"
+#include "rule_index.h"
+
+/*
+ * Rule index
+ *
+ * With hundreds of rules, checking all of them against every message
+ * is wasteful, since most rules only care about a single device, or
+ * a single RouterOS topic (like 'wireless' or 'firewall').
+ *
+ * So, at init, each rule is filed into a single bucket, chosen by its
+ * most selective filter: its host, its topic, its severity or, if it
+ * has no filter at all, the 'any' bucket. A message then only visits
+ * the bucket of its hostname, the ones of each of its topics, the
+ * severities up to its own and the 'any' one: the rules found there
+ * are the candidates, whose remaining filters are checked next.
+ *
+ * All buckets point into a single ids array, each one sorted by rule
+ * order, so that rules are always evaluated in the order they were
+ * added.
+ */
+
+/* Primary keys. */
+#define KEY_HOST     0
+#define KEY_TOPIC    1
+#define KEY_SEVERITY 2
+#define KEY_ANY      3
+
+/**
+ * @brief Case-insensitive FNV-1a of the @p len bytes at @p s.
+ */
+static uint32_t hash_span(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)tolower((unsigned char)s[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief Finds the bucket of the key @p s (@p len bytes long) in the
+ * table @p t.
+ *
+ * @return Returns the bucket, or NULL if not found.
+ */
+static struct ri_bucket *
+table_find(const struct ri_table *t, const char *s, size_t len)
+{
+	struct ri_bucket *b;
+	unsigned i;
+
+	if (!t->size || !len)
+		return NULL;
+
+	i = hash_span(s, len) & (t->size - 1);
+	for (;; i = (i + 1) & (t->size - 1)) {
+		b = &t->slots[i];
+		if (!b->key)
+			return NULL;
+		if (!strncasecmp(b->key, s, len) && b->key[len] == '\0')
+			return b;
+	}
+}
+
+/**
+ * @brief Finds the bucket of the key @p key in the table @p t,
+ * adding it if not there yet.
+ */
+static struct ri_bucket *table_get(struct ri_table *t, const char *key)
+{
+	struct ri_bucket *b;
+	size_t len = strlen(key);
+	unsigned i;
+
+	i = hash_span(key, len) & (t->size - 1);
+	for (;; i = (i + 1) & (t->size - 1)) {
+		b = &t->slots[i];
+		if (!b->key) {
+			b->key = key;
+			t->used++;
+			return b;
+		}
+		if (!strcasecmp(b->key, key))
+			return b;
+	}
+}
+
+/**
+ * @brief Allocates the table @p t, for up to @p n keys (with a load
+ * factor of at most 1/2).
+ */
+static void table_init(struct ri_table *t, unsigned n)
+{
+	if (!n)
+		return;
+
+	for (t->size = 4; t->size < n * 2; t->size *= 2);
+	if (!(t->slots = calloc(t->size, sizeof(*t->slots))))
+		panic("Unable to allocate the rule index!\n");
+}
+
+/**
+ * @brief Returns the primary key of the rule filter @p f.
+ */
+static int key_kind(const struct rule_filter *f)
+{
+	if (f->host)
+		return KEY_HOST;
+	if (f->topic)
+		return KEY_TOPIC;
+	if (f->max_severity >= 0)
+		return KEY_SEVERITY;
+	return KEY_ANY;
+}
+
+/**
+ * @brief Returns the bucket where the rule at position @p pos of the
+ * index @p ri is filed, creating it if needed.
+ */
+static struct ri_bucket *rule_bucket(struct rule_index *ri, int pos)
+{
+	const struct rule_filter *f = &ri->rules[pos].f;
+
+	switch (key_kind(f)) {
+	case KEY_HOST:
+		return table_get(&ri->by_host, f->host);
+	case KEY_TOPIC:
+		return table_get(&ri->by_topic, f->topic);
+	case KEY_SEVERITY:
+		return &ri->by_severity[f->max_severity];
+	default:
+		return &ri->any;
+	}
+}
+
+/**
+ * @brief Adds a new rule to the index @p ri.
+ *
+ * @param ri Rule index.
+ * @param id Rule id, as returned by rule_index_lookup().
+ * @param f  Rule filter, its strings must outlive the index.
+ */
+void rule_index_add(struct rule_index *ri, int id, const struct rule_filter *f)
+{
+	void *p;
+
+	if (ri->num_rules == ri->max_rules) {
+		ri->max_rules = ri->max_rules ? ri->max_rules * 2 : 16;
+		if (!(p = realloc(ri->rules, ri->max_rules * sizeof(*ri->rules))))
+			panic("Unable to allocate the rule index!\n");
+		ri->rules = p;
+	}
+
+	ri->rules[ri->num_rules].id = id;
+	ri->rules[ri->num_rules].f  = *f;
+	ri->num_rules++;
+}
+
+/**
+ * @brief Builds the index @p ri, must be called once, after all
+ * rules were added.
+ *
+ * @param ri   Rule index.
+ * @param name Index name, for the startup summary.
+ */
+void rule_index_build(struct rule_index *ri, const char *name)
+{
+	struct ri_bucket *b;
+	unsigned kinds[4] = {0};
+	unsigned first, largest;
+	size_t mem;
+	int i;
+
+	for (i = 0; i < ri->num_rules; i++)
+		kinds[key_kind(&ri->rules[i].f)]++;
+
+	table_init(&ri->by_host,  kinds[KEY_HOST]);
+	table_init(&ri->by_topic, kinds[KEY_TOPIC]);
+
+	ri->ids = malloc((ri->num_rules + 1) * sizeof(*ri->ids));
+	if (!ri->ids)
+		panic("Unable to allocate the rule index!\n");
+
+	/* Bucket sizes. */
+	for (i = 0; i < ri->num_rules; i++)
+		rule_bucket(ri, i)->count++;
+
+	/* Bucket starts and ids. */
+	first   = 0;
+	largest = 0;
+	for (unsigned j = 0; j < ri->by_host.size; j++) {
+		b = &ri->by_host.slots[j];
+		b->id    = ri->num_buckets++;
+		b->first = first;
+		first   += b->count;
+		largest  = (b->count > largest) ? b->count : largest;
+	}
+	for (unsigned j = 0; j < ri->by_topic.size; j++) {
+		b = &ri->by_topic.slots[j];
+		b->id    = ri->num_buckets++;
+		b->first = first;
+		first   += b->count;
+		largest  = (b->count > largest) ? b->count : largest;
+	}
+	for (int j = 0; j < NUM_SEVERITIES; j++) {
+		b = &ri->by_severity[j];
+		b->id    = ri->num_buckets++;
+		b->first = first;
+		first   += b->count;
+		largest  = (b->count > largest) ? b->count : largest;
+	}
+	ri->any.id    = ri->num_buckets++;
+	ri->any.first = first;
+
+	/* Fill, in rule order. */
+	for (unsigned j = 0; j < ri->by_host.size; j++)
+		ri->by_host.slots[j].count = 0;
+	for (unsigned j = 0; j < ri->by_topic.size; j++)
+		ri->by_topic.slots[j].count = 0;
+	for (int j = 0; j < NUM_SEVERITIES; j++)
+		ri->by_severity[j].count = 0;
+	ri->any.count = 0;
+
+	for (i = 0; i < ri->num_rules; i++) {
+		b = rule_bucket(ri, i);
+		ri->ids[b->first + b->count++] = i;
+	}
+
+	mem = ri->max_rules * sizeof(*ri->rules) +
+		(ri->by_host.size + ri->by_topic.size) * sizeof(struct ri_bucket) +
+		(ri->num_rules + 1) * sizeof(int);
+
+	log_msg("Rule index (%s): %d rule(s), %zu KiB\n", name, ri->num_rules,
+		(mem + 1023) / 1024);
+	log_msg("  by host    : %u rule(s), %u key(s)\n", kinds[KEY_HOST],
+		ri->by_host.used);
+	log_msg("  by topic   : %u rule(s), %u key(s)\n", kinds[KEY_TOPIC],
+		ri->by_topic.used);
+	log_msg("  by severity: %u rule(s)\n", kinds[KEY_SEVERITY]);
+	log_msg("  any        : %u rule(s)\n", kinds[KEY_ANY]);
+	log_msg("  largest bucket: %u rule(s)\n\n",
+		(ri->any.count > largest) ? ri->any.count : largest);
+}
+
+/**
+ * @brief Checks whether the header of the log event @p ev satisfies
+ * all the requirements of the rule filter @p f.
+ *
+ * @return Returns 1 if so, 0 otherwise.
+ */
+int rule_filter_pass(const struct rule_filter *f, const struct log_event *ev)
+{
+	const char *t, *end, *comma;
+	size_t len;
+
+	/* Unknown severities always pass. */
+	if (f->max_severity >= 0 && ev->hdr.severity > f->max_severity)
+		return 0;
+
+	if (f->host) {
+		len = ev->hdr.hostname.len;
+		if (strncasecmp(f->host, ev->msg + ev->hdr.hostname.off, len) ||
+			f->host[len] != '\0' || !len)
+		{
+			return 0;
+		}
+	}
+
+	if (!f->topic)
+		return 1;
+
+	/* Topics are case-insensitive, like in the index. */
+	t   = ev->msg + ev->hdr.topics.off;
+	end = t + ev->hdr.topics.len;
+	len = strlen(f->topic);
+	for (; t < end; t = comma + 1) {
+		if (!(comma = memchr(t, ',', end - t)))
+			comma = end;
+		if ((size_t)(comma - t) == len && !strncasecmp(t, f->topic, len))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Appends the rule positions of the bucket @p b (if any, and
+ * not visited yet by this lookup) to the candidates in @p sc.
+ *
+ * @return Returns the new amount of candidates.
+ */
+static int add_bucket(const struct rule_index *ri, struct ri_scratch *sc,
+	int n, const struct ri_bucket *b)
+{
+	if (!b || !b->count || sc->seen[b->id] == sc->lookups)
+		return n;
+	sc->seen[b->id] = sc->lookups;
+	memcpy(sc->cand + n, ri->ids + b->first, b->count * sizeof(int));
+	return n + b->count;
+}
+
+/**
+ * @brief Returns the lookup state of the calling worker, for the
+ * index @p ri, allocating it on first use.
+ */
+static struct ri_scratch *get_scratch(struct rule_index *ri)
+{
+	struct ri_scratch *sc = &ri->scratch[worker_self];
+
+	if (sc->cand)
+		return sc;
+
+	sc->cand = malloc((ri->num_rules + 1) * sizeof(*sc->cand));
+	sc->seen = calloc(ri->num_buckets, sizeof(*sc->seen));
+	if (!sc->cand || !sc->seen)
+		panic("Unable to allocate the rule index!\n");
+	return sc;
+}
+
+/**
+ * @brief Compares two rule positions.
+ */
+static int pos_cmp(const void *a, const void *b)
+{
+	int pa = *(const int *)a;
+	int pb = *(const int *)b;
+	return (pa > pb) - (pa < pb);
+}
+
+/**
+ * @brief Finds all the rules of the index @p ri whose filters are
+ * satisfied by the header of the log event @p ev.
+ *
+ * @param ri  Rule index.
+ * @param ev  Log event, already parsed.
+ * @param ids Rule ids found (output), in the order they were added,
+ *            valid until the next lookup by the same worker.
+ *
+ * @return Returns the amount of rules found.
+ */
+int rule_index_lookup(struct rule_index *ri, const struct log_event *ev,
+	const int **ids)
+{
+	struct ri_scratch *sc = get_scratch(ri);
+	const char *t, *end, *comma;
+	int n, sources, found;
+	int sev;
+
+	n       = 0;
+	sources = 0;
+
+	/* Buckets remember the last lookup that visited them. */
+	if (!++sc->lookups) {
+		memset(sc->seen, 0, ri->num_buckets * sizeof(*sc->seen));
+		sc->lookups = 1;
+	}
+
+	/* Host. */
+	n = add_bucket(ri, sc, n, table_find(&ri->by_host,
+		ev->msg + ev->hdr.hostname.off, ev->hdr.hostname.len));
+	sources += (n != 0);
+
+	/* Topics. */
+	t   = ev->msg + ev->hdr.topics.off;
+	end = t + ev->hdr.topics.len;
+	for (; ri->by_topic.size && t < end; t = comma + 1) {
+		if (!(comma = memchr(t, ',', end - t)))
+			comma = end;
+		found = n;
+		n = add_bucket(ri, sc, n, table_find(&ri->by_topic, t, comma - t));
+		sources += (n != found);
+	}
+
+	/* Severities, up to the message one. */
+	sev = (ev->hdr.severity < 0) ? 0 : ev->hdr.severity;
+	for (; sev < NUM_SEVERITIES; sev++) {
+		found = n;
+		n = add_bucket(ri, sc, n, &ri->by_severity[sev]);
+		sources += (n != found);
+	}
+
+	found = n;
+	n = add_bucket(ri, sc, n, &ri->any);
+	sources += (n != found);
+
+	/* Each bucket is sorted, but not all of them together. */
+	if (sources > 1)
+		qsort(sc->cand, n, sizeof(*sc->cand), pos_cmp);
+
+	/* Remaining filters, candidates become rule ids. */
+	found = 0;
+	for (int i = 0; i < n; i++) {
+		if (rule_filter_pass(&ri->rules[sc->cand[i]].f, ev))
+			sc->cand[found++] = ri->rules[sc->cand[i]].id;
+	}
+
+	*ids = sc->cand;
+	return found;
+}
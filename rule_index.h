@@ -0,0 +1,75 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef RULE_INDEX_H
+#define RULE_INDEX_H
+
+	#include <stddef.h>
+	#include "syslog_parse.h"
+	#include "workers.h"
+
+	struct log_event;
+
+	/* What a rule requires from a message header, before matching. */
+	struct rule_filter {
+		const char *topic;  /* RouterOS topic, NULL if any.  */
+		const char *host;   /* Source hostname, NULL if any. */
+		int max_severity;   /* -1 if any.                    */
+	};
+
+	/* Rule ids sharing the same key. */
+	struct ri_bucket {
+		const char *key;    /* NULL if the slot is free. */
+		unsigned first;     /* Start, in ids[].          */
+		unsigned count;
+		unsigned id;        /* Position, in ri_scratch.seen. */
+	};
+
+	/* Open addressing table, from key to bucket. */
+	struct ri_table {
+		struct ri_bucket *slots;
+		unsigned size;      /* Power of 2. */
+		unsigned used;
+	};
+
+	/* Lookup state, one per worker. */
+	struct ri_scratch {
+		int *cand;          /* Lookup output, num_rules ids.   */
+		unsigned *seen;     /* Per bucket: last lookup there.  */
+		unsigned lookups;
+	};
+
+	/*
+	 * Rule index: each rule is filed under its most selective
+	 * filter (host, then topic, then severity), so that a message
+	 * only visits the buckets its header can match.
+	 */
+	struct rule_index {
+		struct {
+			int id;
+			struct rule_filter f;
+		} *rules;
+		int num_rules;
+		int max_rules;
+
+		struct ri_table by_host;
+		struct ri_table by_topic;
+		struct ri_bucket by_severity[NUM_SEVERITIES];
+		struct ri_bucket any;
+
+		int *ids;           /* All buckets, in rule order. */
+		unsigned num_buckets;
+		struct ri_scratch scratch[MAX_WORKERS];
+	};
+
+	extern void rule_index_add(struct rule_index *ri, int id,
+		const struct rule_filter *f);
+	extern void rule_index_build(struct rule_index *ri, const char *name);
+	extern int rule_index_lookup(struct rule_index *ri,
+		const struct log_event *ev, const int **ids);
+	extern int rule_filter_pass(const struct rule_filter *f,
+		const struct log_event *ev);
+
+#endif /* RULE_INDEX_H */
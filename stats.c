@@ -0,0 +1,93 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "stats.h"
+
+/*
+ * Statistics reporting
+ */
+
+static struct stats_source {
+	const char *name;
+	void(*dump)(void);
+} stats_sources[MAX_STATS_SOURCES];
+
+static int num_stats_sources;
+static unsigned stats_interval;
+
+/**
+ * @brief Registers a new statistics source, the @p dump routine
+ * is periodically invoked (from the stats thread) and should
+ * print its counters using log_msg().
+ *
+ * @param name Module name.
+ * @param dump Routine that dumps the module counters.
+ */
+void stats_register(const char *name, void(*dump)(void))
+{
+	if (num_stats_sources >= MAX_STATS_SOURCES)
+		panic("Too many stats sources (max: %d)!\n", MAX_STATS_SOURCES);
+
+	stats_sources[num_stats_sources].name = name;
+	stats_sources[num_stats_sources].dump = dump;
+	num_stats_sources++;
+}
+
+/**
+ * @brief Stats thread: wakes up every STATS_INTERVAL seconds and
+ * dumps the counters of all registered sources.
+ */
+static void *stats_thread(void *p)
+{
+	((void)p);
+
+	while (1) {
+		sleep(stats_interval);
+		log_msg("Statistics:\n");
+		for (int i = 0; i < num_stats_sources; i++) {
+			log_msg("[%s]\n", stats_sources[i].name);
+			stats_sources[i].dump();
+		}
+		log_msg("\n");
+	}
+	return NULL;
+}
+
+/**
+ * @brief Initializes the statistics reporting, if the
+ * STATS_INTERVAL (in seconds) environment var was informed.
+ *
+ * @return Returns 1 if enabled, 0 otherwise.
+ */
+int stats_init(void)
+{
+	pthread_t thread;
+	char *env, *end;
+	long secs;
+
+	env = getenv("STATS_INTERVAL");
+	if (!env || !isdigit(*env)) {
+		log_msg("Statistics: disabled\n\n");
+		return 0;
+	}
+
+	secs = strtol(env, &end, 10);
+	if (*end != '\0' || secs <= 0)
+		panic("Invalid STATS_INTERVAL (%s), aborting...\n", env);
+
+	stats_interval = secs;
+	if (pthread_create(&thread, NULL, stats_thread, NULL))
+		panic_errno("Unable to create stats thread!");
+
+	pthread_detach(thread);
+	log_msg("Statistics: enabled, every %ld secs\n\n", secs);
+	return 1;
+}
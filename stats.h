@@ -0,0 +1,38 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+	#include <stdatomic.h>
+
+	/* Maximum amount of modules that can report statistics. */
+	#define MAX_STATS_SOURCES 32
+
+	/*
+	 * Counters are updated from the hot paths and read from the
+	 * stats thread, so relaxed atomics are all we need.
+	 */
+	typedef atomic_ulong stat_t;
+
+	#define stat_add(c, n) \
+		atomic_fetch_add_explicit(&(c), (n), memory_order_relaxed)
+	#define stat_inc(c) stat_add(c, 1)
+	#define stat_get(c) \
+		atomic_load_explicit(&(c), memory_order_relaxed)
+	#define stat_set(c, n) \
+		atomic_store_explicit(&(c), (n), memory_order_relaxed)
+	#define stat_max(c, n) \
+		do { \
+			unsigned long _old = stat_get(c); \
+			while ((unsigned long)(n) > _old && \
+				!atomic_compare_exchange_weak_explicit(&(c), &_old, (n), \
+					memory_order_relaxed, memory_order_relaxed)); \
+		} while (0)
+
+	extern void stats_register(const char *name, void(*dump)(void));
+	extern int stats_init(void);
+
+#endif /* STATS_H */
@@ -3,47 +3,183 @@
  * This is free and unencumbered software released into the public domain.
  */
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h>
 #include <time.h>
 
 #include "events.h"
+#include "fifo.h"
+#include "forward.h"
 #include "log.h"
+#include "stats.h"
 #include "syslog.h"
+#include "syslog_parse.h"
 
 /*
  * UDP message handling and FIFO.
+ * (TCP lives in syslog_tcp.c and feeds the same FIFO.)
  */
 
-/* Forward server data. */
-static struct addrinfo *fwd_addr_info;
-static int fwd_fd;
+/* Message queue between the receivers and the handler thread. */
+static struct fifo fifo;
+#define FIFO_POLICIES_LEN 4
+static const char *const fifo_policies[] = {
+	"drop-newest", "drop-oldest", "block", "severity"
+};
 
-/* Circular message buffer. */
-static struct circ_buffer {
-	int head;
-	int tail;
-	struct log_event log_ev [FIFO_MAX];
-} circ_buffer = {0};
+/* Receivers, each with its own socket and batch buffers. */
+static struct syslog_receiver {
+	pthread_t thread;
+	int fd;
+	char (*msgs)[MSG_MAX];
+	struct iovec *iovs;
+	struct mmsghdr *hdrs;
+
+	/* Statistics. */
+	stat_t syscalls;
+	stat_t msgs_recv;
+	stat_t max_batch;
+} *receivers;
+static int num_receivers;
+static int rx_batch_size = SYSLOG_BATCH_DEFAULT;
+
+/**
+ * @brief Dumps the receive statistics.
+ */
+static void syslog_dump_stats(void)
+{
+	unsigned long syscalls = 0, tot_syscalls = 0;
+	unsigned long msgs     = 0, tot_msgs     = 0;
+	struct syslog_receiver *rx;
+
+	for (int i = 0; i < num_receivers; i++) {
+		rx = &receivers[i];
+		syscalls = stat_get(rx->syscalls);
+		msgs     = stat_get(rx->msgs_recv);
+		tot_syscalls += syscalls;
+		tot_msgs     += msgs;
+
+		if (num_receivers == 1)
+			break;
+
+		log_msg("  rx%-2d msgs/syscalls/max batch: %lu / %lu / %lu\n",
+			i, msgs, syscalls, stat_get(rx->max_batch));
+	}
+
+	log_msg("  recv syscalls   : %lu\n", tot_syscalls);
+	log_msg("  recv messages   : %lu\n", tot_msgs);
+	if (num_receivers == 1)
+		log_msg("  max batch size  : %lu\n", stat_get(receivers[0].max_batch));
+	log_msg("  avg batch size  : %.2f\n",
+		tot_syscalls ? (double)tot_msgs / tot_syscalls : 0.0);
+	log_msg("  syscalls per msg: %.3f\n",
+		tot_msgs ? (double)tot_syscalls / tot_msgs : 0.0);
+	log_msg("  queue wakeups   : %lu\n", stat_get(fifo.wakeups));
+	log_msg("  queue dropped   : %lu\n", stat_get(fifo.dropped));
+	log_msg("  queue evicted   : %lu\n", stat_get(fifo.evicted));
+	log_msg("  queue evict low : %lu\n", stat_get(fifo.evicted_low));
+	log_msg("  queue timeouts  : %lu\n", stat_get(fifo.timeouts));
+	log_msg("  queue chained   : %lu\n", stat_get(fifo.chained));
+}
+
+/**
+ * @brief Reads the integer environment var @p var, within the
+ * range @p min-@p max.
+ *
+ * @param var Environment variable name.
+ * @param def Default value, if not set.
+ * @param min Minimum accepted value.
+ * @param max Maximum accepted value.
+ *
+ * @return Returns the read value, or @p def if not set.
+ */
+long syslog_get_env_int(const char *var, long def, long min, long max)
+{
+	char *env, *end;
+	long val;
+
+	if (!(env = getenv(var)))
+		return def;
 
-/* Sync. */
-static pthread_mutex_t fifo_mutex        = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t fifo_new_log_entry = PTHREAD_COND_INITIALIZER;
-static int syslog_push_msg_into_fifo(const char *, time_t);
+	val = strtol(env, &end, 10);
+	if (!isdigit(*env) || *end != '\0' || val < min || val > max) {
+		panic("Invalid %s (%s), should be between %ld-%ld\n",
+			var, env, min, max);
+	}
+	return val;
+}
 
+/**
+ * @brief Allocates the receiver @p rx buffers used by recvmmsg().
+ */
+static void syslog_init_batch(struct syslog_receiver *rx)
+{
+	rx->msgs = calloc(rx_batch_size, MSG_MAX);
+	rx->iovs = calloc(rx_batch_size, sizeof(struct iovec));
+	rx->hdrs = calloc(rx_batch_size, sizeof(struct mmsghdr));
+	if (!rx->msgs || !rx->iovs || !rx->hdrs)
+		panic("Unable to allocate receive buffers!\n");
+
+	for (int i = 0; i < rx_batch_size; i++) {
+		rx->iovs[i].iov_base = rx->msgs[i];
+		rx->iovs[i].iov_len  = MSG_MAX - 1;
+		rx->hdrs[i].msg_hdr.msg_iov    = &rx->iovs[i];
+		rx->hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/**
+ * @brief Reads the FIFO_BYTES, FIFO_POLICY and FIFO_BLOCK_MS
+ * environment vars (if any) and initializes the message
+ * queue accordingly.
+ */
+static void syslog_init_fifo(void)
+{
+	long bytes;
+	int timeout;
+	int policy;
+	char *env;
+
+	bytes   = syslog_get_env_int("FIFO_BYTES", FIFO_DEFAULT_BYTES,
+		FIFO_MIN_BYTES, FIFO_MAX_BYTES);
+	timeout = syslog_get_env_int("FIFO_BLOCK_MS", FIFO_DEFAULT_BLOCK_MS,
+		1, 60000);
+
+	policy = FIFO_DROP_OLDEST;
+	if ((env = getenv("FIFO_POLICY"))) {
+		for (policy = 0; policy < FIFO_POLICIES_LEN; policy++)
+			if (!strcmp(env, fifo_policies[policy]))
+				break;
+		if (policy == FIFO_POLICIES_LEN)
+			panic("Invalid FIFO_POLICY (%s)!\n", env);
+	}
+
+	if (fifo_init(&fifo, bytes, policy, timeout) < 0)
+		panic("Unable to initialize message queue!\n");
+
+	log_msg("Message queue: %ld bytes (%u chunks), overflow policy: %s\n",
+		bytes, fifo.num_chunks, fifo_policies[policy]);
+	if (policy == FIFO_BLOCK)
+		log_msg("Message queue: max blocking time: %d ms\n", timeout);
+}
 
 /**
  * @brief Create an UDP socket to read from.
  *
+ * @param reuse_port Whether the port is shared with other
+ *                   sockets (SO_REUSEPORT).
+ *
  * @return Returns the UDP socket fd if success.
  */
-int syslog_create_udp_socket(void)
+static int syslog_create_udp_socket(int reuse_port)
 {
 	struct sockaddr_in svaddr;
 	int yes;
@@ -53,6 +189,18 @@ int syslog_create_udp_socket(void)
 	if (fd < 0)
 		panic_errno("Unable to create UDP socket...");
 
+	yes = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes,
+		sizeof(yes)) < 0) {
+		panic_errno("Unable to reuse address...");
+	}
+
+	/* Let the kernel spread the senders among our sockets. */
+	if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&yes,
+		sizeof(yes)) < 0) {
+		panic_errno("Unable to reuse port...");
+	}
+
 	memset(&svaddr, 0, sizeof(svaddr));
 	svaddr.sin_family      = AF_INET;
 	svaddr.sin_addr.s_addr = INADDR_ANY;
@@ -61,109 +209,101 @@ int syslog_create_udp_socket(void)
 	if (bind(fd, (const struct sockaddr *)&svaddr, sizeof(svaddr)) < 0)
 		panic_errno("Unable to bind...");
 
-	yes = 1;
-	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes,
-		sizeof(yes)) < 0) {
-		panic_errno("Unable to reuse address...");
-	}
-
 	return fd;
 }
 
 /**
- * @brief Initializes the forwarding to the syslog server if
- * the required environment vars were informed.
+ * @brief Initializes the message queue and the receivers: reads
+ * the SYSLOG_RECEIVERS and SYSLOG_BATCH environment vars (if any)
+ * and creates one UDP socket per receiver.
  *
- * @return Returns 0.
+ * @return Returns the amount of receivers.
  */
-int syslog_init_forward(void)
+int syslog_init_receivers(void)
 {
-	struct addrinfo hints, *results, *try;
-	char *host, *port;
-	int sock = 0;
-
-	/* Check if we should forward messages. */
-	host = getenv("FORWARD_HOST");
-	port = getenv("FORWARD_PORT");
-	if (!host && !port) {
-		log_msg("Forward Mode: disabled\n\n");
-		return 0;
-	}
-
-	if (!host || !port)
-		panic("FORWARD_ADDR and FORWARD_PORT must be specified!\n");
+	syslog_init_fifo();
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
+	num_receivers = syslog_get_env_int("SYSLOG_RECEIVERS", 1, 1,
+		SYSLOG_RECEIVERS_MAX);
+	rx_batch_size = syslog_get_env_int("SYSLOG_BATCH",
+		SYSLOG_BATCH_DEFAULT, 1, SYSLOG_BATCH_MAX);
 
-	if (getaddrinfo(host, port, &hints, &results) != 0)
-		panic_errno("Unable to getaddrinfo...");
+	receivers = calloc(num_receivers, sizeof(struct syslog_receiver));
+	if (!receivers)
+		panic("Unable to allocate receivers!\n");
 
-	/* Iterate over results. */
-	for (try = results; try != NULL; try = try->ai_next) {
-		sock = socket(try->ai_family, try->ai_socktype, try->ai_protocol);
-		if (sock < 0)
-			continue;
-		break;
+	for (int i = 0; i < num_receivers; i++) {
+		receivers[i].fd = syslog_create_udp_socket(num_receivers > 1);
+		syslog_init_batch(&receivers[i]);
 	}
 
-	if (sock < 0)
-		panic("Unable to create a socket for forward...\n");
-
-	fwd_fd = sock;
-	fwd_addr_info = try;
+	stats_register("syslog", syslog_dump_stats);
+	log_msg("Receivers: %d, batch size: %d\n", num_receivers, rx_batch_size);
+	return num_receivers;
+}
 
-	log_msg("Forward Mode: enabled:\n");
-	log_msg("----------------------\n");
-	log_msg("FORWARD_HOST: %s\n", host);
-	log_msg("FORWARD_PORT: %s\n\n", port);
-	return 0;
+/**
+ * @brief Receiver thread: receives messages until an error occurs.
+ */
+static void *syslog_receiver_thread(void *p)
+{
+	int idx = (int)(intptr_t)p;
+	while (syslog_enqueue_new_upd_msg(idx) >= 0);
+	panic_errno("Unable to receive messages");
+	return NULL;
 }
 
 /**
- * @brief Sends a message @p msg of length @p len to the
- * configured syslog server.
+ * @brief Starts the receiver threads, except for the first
+ * receiver, which belongs to the caller thread (see
+ * syslog_enqueue_new_upd_msg()).
  */
-static int syslog_fwd_msg(const char *msg, size_t len) {
-	return (
-		sendto(fwd_fd, msg, len, 0, fwd_addr_info->ai_addr,
-			fwd_addr_info->ai_addrlen)
-	);
+void syslog_start_receivers(void)
+{
+	for (int i = 1; i < num_receivers; i++) {
+		if (pthread_create(&receivers[i].thread, NULL,
+		    syslog_receiver_thread, (void *)(intptr_t)i))
+		{
+			panic_errno("Unable to create receiver thread!");
+		}
+	}
 }
 
 /**
- * @brief Receives a new UDP message and then adds it
- * to the message queue. Additionally, also forwards
- * the message to a previously configured syslog server.
+ * @brief Receives a batch of new UDP messages (up to SYSLOG_BATCH
+ * messages per syscall) and then adds them to the message queue.
+ * Additionally, also forwards the messages to a previously
+ * configured syslog server.
  *
- * @param fd UDP file descriptor to receive from.
+ * @param idx Receiver index.
  *
  * @return Returns 0 if success, -1 otherwise.
  */
-int syslog_enqueue_new_upd_msg(int fd)
+int syslog_enqueue_new_upd_msg(int idx)
 {
-	struct sockaddr_storage cli = {0};
-	char msg[MSG_MAX] = {0};
-	socklen_t clilen;
-	ssize_t ret;
-
-	clilen = sizeof(cli);
-	ret = recvfrom(fd, msg, sizeof msg - 1, 0, (struct sockaddr*)&cli,
-		&clilen);
-
+	struct syslog_receiver *rx = &receivers[idx];
+	size_t len;
+	time_t ts;
+	int ret;
+
+	/* Blocks until the first message, then drains whatever is
+	 * already queued in the socket, without blocking. */
+	ret = recvmmsg(rx->fd, rx->hdrs, rx_batch_size, MSG_WAITFORONE, NULL);
 	if (ret < 0)
 		return -1;
 
-	/* Forward message if forwarding was configured. */
-	if (fwd_fd) {
-		if (syslog_fwd_msg(msg, ret) < 0)
-			log_errno("Unable to forward message...\n");
-	}
+	stat_inc(rx->syscalls);
+	stat_add(rx->msgs_recv, ret);
+	stat_max(rx->max_batch, ret);
 
-	if (syslog_push_msg_into_fifo(msg, time(NULL)) < 0)
-		panic("Circular buffer full! (size: %d)\n", FIFO_MAX);
+	ts = time(NULL);
+	for (int i = 0; i < ret; i++) {
+		len = rx->hdrs[i].msg_len;
+		rx->msgs[i][len] = '\0';
+		syslog_ingest_msg(rx->msgs[i], len, ts);
+	}
 
+	syslog_ingest_done();
 	return 0;
 }
 
@@ -171,42 +311,65 @@ int syslog_enqueue_new_upd_msg(int fd)
 
 ///////////////////////////////// FIFO ////////////////////////////////////////
 /**
- * @brief For a given message @p msg and a timestamp @p timestamp,
- * adds both to the message queue and then wakes up the waiting
- * thread.
+ * @brief Checks whether the message @p msg, of length @p len, is
+ * low-priority (i.e., notice, info or debug), either from its
+ * '<PRI>' header or, since RouterOS does not send one by default,
+ * from its topics list (like in 'system,info,account user...').
  *
- * @param msg       Read message from UDP.
- * @param timestamp Current timestamp.
+ * @param msg Message to be checked.
+ * @param len Message length.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Returns 1 if low-priority, 0 otherwise.
  */
-static int syslog_push_msg_into_fifo(const char *msg, time_t timestamp)
+static int syslog_is_low_prio(const char *msg, size_t len)
 {
-	int next;
-	int head;
-
-	pthread_mutex_lock(&fifo_mutex);
-		head = circ_buffer.head;
-		next = head + 1;
-		if (next >= FIFO_MAX)
-			next = 0;
-
-		if (next == circ_buffer.tail) {
-			pthread_mutex_unlock(&fifo_mutex);
-			return -1;
-		}
-		memcpy(circ_buffer.log_ev[head].msg, msg, MSG_MAX);
-		circ_buffer.log_ev[head].timestamp = timestamp;
+	struct log_hdr hdr;
+	syslog_parse_hdr(msg, len, &hdr);
+	return hdr.severity > SEV_WARNING;
+}
 
-		circ_buffer.head = next;
-		pthread_cond_signal(&fifo_new_log_entry);
-	pthread_mutex_unlock(&fifo_mutex);
-	return 0;
+/**
+ * @brief Adds a single received message @p msg (NUL-terminated)
+ * of length @p len and timestamp @p timestamp to the message queue
+ * (applying the overflow policy if full), and queues it to be
+ * forwarded to the configured syslog server, if any.
+ *
+ * The handler thread is not woken up until syslog_ingest_done()
+ * is called, so a whole batch costs a single wakeup.
+ *
+ * @param msg       Received message.
+ * @param len       Message length.
+ * @param timestamp Reception timestamp.
+ *
+ * @return Returns 0 if the message was queued, -1 if dropped.
+ */
+int syslog_ingest_msg(const char *msg, size_t len, time_t timestamp)
+{
+	int low_prio = 0;
+
+	/* Forward message if forwarding was configured. */
+	forward_msg(msg, len, timestamp);
+
+	if (fifo.policy == FIFO_SEVERITY)
+		low_prio = syslog_is_low_prio(msg, len);
+
+	/* Messages that do not fit are accounted for in the FIFO stats. */
+	return fifo_push(&fifo, msg, len, timestamp, low_prio);
+}
+
+/**
+ * @brief Wakes up the handler and forwarder threads (if sleeping)
+ * after one or more calls to syslog_ingest_msg().
+ */
+void syslog_ingest_done(void)
+{
+	forward_wake();
+	fifo_wake(&fifo);
 }
 
 /**
  * @brief Pops a single message from the message queue (if any),
- * and saves it into @p ev.
+ * saves it into @p ev and parses its header.
  *
  * @param ev Target buffer to the retrieved log event.
  *
@@ -214,23 +377,17 @@ static int syslog_push_msg_into_fifo(const char *msg, time_t timestamp)
  */
 int syslog_pop_msg_from_fifo(struct log_event *ev)
 {
-	int next;
-	int tail;
-
-	pthread_mutex_lock(&fifo_mutex);
-		while (circ_buffer.head == circ_buffer.tail) {
-			pthread_cond_wait(&fifo_new_log_entry, &fifo_mutex);
-		}
-
-		next = circ_buffer.tail + 1;
-		if (next >= FIFO_MAX)
-			next = 0;
-
-		tail = circ_buffer.tail;
-		ev->timestamp = circ_buffer.log_ev[tail].timestamp;
-		memcpy(ev->msg, circ_buffer.log_ev[tail].msg, MSG_MAX);
-
-		circ_buffer.tail = next;
-	pthread_mutex_unlock(&fifo_mutex);
+	fifo_pop(&fifo, ev);
+	syslog_parse_hdr(ev->msg, ev->len, &ev->hdr);
 	return 0;
 }
+
+/**
+ * @brief Releases the storage of a message retrieved with
+ * syslog_pop_msg_from_fifo(), once done with it.
+ *
+ * @param ev Log event.
+ */
+void syslog_release_msg(struct log_event *ev) {
+	fifo_release(&fifo, ev);
+}
@@ -6,14 +6,34 @@
 #ifndef SYSLOG_H
 #define SYSLOG_H
 
+	#include <stddef.h>
+	#include <time.h>
+
 	struct log_event;
 
-	#define FIFO_MAX    64
+	/* Message queue memory budget (FIFO_BYTES env var). */
+	#define FIFO_DEFAULT_BYTES    (128 << 10)
+	#define FIFO_MIN_BYTES        (8   << 10)
+	#define FIFO_MAX_BYTES        (64  << 20)
+	#define FIFO_DEFAULT_BLOCK_MS 1000
 	#define SYSLOG_PORT 5140
 
-	extern int syslog_init_forward(void);
-	extern int syslog_create_udp_socket(void);
-	extern int syslog_enqueue_new_upd_msg(int fd);
+	/* Maximum (and default) amount of datagrams per recvmmsg(). */
+	#define SYSLOG_BATCH_MAX     64
+	#define SYSLOG_BATCH_DEFAULT 16
+
+	/* Maximum amount of receiver threads (SO_REUSEPORT sockets). */
+	#define SYSLOG_RECEIVERS_MAX 64
+
+	extern int syslog_init_receivers(void);
+	extern void syslog_start_receivers(void);
+	extern int syslog_enqueue_new_upd_msg(int idx);
+	extern int syslog_ingest_msg(const char *msg, size_t len,
+		time_t timestamp);
+	extern void syslog_ingest_done(void);
+	extern long syslog_get_env_int(const char *var, long def, long min,
+		long max);
 	extern int syslog_pop_msg_from_fifo(struct log_event *ev);
+	extern void syslog_release_msg(struct log_event *ev);
 
 #endif /* SYSLOG_H */
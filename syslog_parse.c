@@ -0,0 +1,316 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "events.h"
+#include "syslog_parse.h"
+
+/*
+ * Syslog header parser
+ *
+ * A single pass over the message, which splits it into the parts
+ * that rules might care about, without copying anything. Supported
+ * formats:
+ *
+ * - RouterOS default (no header):
+ *     system,info,account user admin logged in from 10.0.0.2 via ssh
+ *
+ * - RFC 3164 (BSD), with either BSD or ISO 8601 timestamps:
+ *     <30>Oct 16 21:00:00 MikroTik system,info,account user admin ...
+ *
+ * - RFC 5424:
+ *     <30>1 2024-10-16T21:00:00.000Z MikroTik app - - - user admin ...
+ *
+ * In all of them, a RouterOS topic list in front of the message is
+ * split as well, and if there is no PRI, the severity comes from the
+ * topics themselves.
+ */
+
+const char *const severities_str[NUM_SEVERITIES] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/* RouterOS topics that are also severities. */
+static const struct {
+	const char *name;
+	size_t len;
+	int severity;
+} topic_severities[] = {
+	{"critical", 8, SEV_CRIT},
+	{"error",    5, SEV_ERR},
+	{"warning",  7, SEV_WARNING},
+	{"info",     4, SEV_INFO},
+	{"debug",    5, SEV_DEBUG},
+};
+#define TOPIC_SEVERITIES_LEN \
+	(sizeof(topic_severities) / sizeof(topic_severities[0]))
+
+/**
+ * @brief Sets the span @p s to the range @p start-@p end of the
+ * message @p msg.
+ */
+static inline void
+set_span(struct log_span *s, const char *msg, const char *start,
+	const char *end)
+{
+	s->off = start - msg;
+	s->len = end - start;
+}
+
+/**
+ * @brief Reads a space-delimited token starting at @p *p, and
+ * skips the space after it.
+ *
+ * @return Returns the token end.
+ */
+static const char *next_token(const char **p, const char *end)
+{
+	const char *tok_end = memchr(*p, ' ', end - *p);
+	if (!tok_end)
+		tok_end = end;
+
+	*p = (tok_end < end) ? tok_end + 1 : end;
+	return tok_end;
+}
+
+/**
+ * @brief Checks whether @p s starts with a BSD timestamp,
+ * i.e., 'Mmm dd hh:mm:ss' (15 chars).
+ */
+static int is_bsd_timestamp(const char *s, const char *end)
+{
+	const unsigned char *p = (const unsigned char *)s;
+
+	if (end - s < 15)
+		return 0;
+	return (
+		isalpha(p[0]) && isalpha(p[1]) && isalpha(p[2]) && p[3] == ' ' &&
+		(p[4] == ' ' || isdigit(p[4])) && isdigit(p[5]) && p[6] == ' ' &&
+		isdigit(p[7])  && isdigit(p[8])  && p[9]  == ':' &&
+		isdigit(p[10]) && isdigit(p[11]) && p[12] == ':' &&
+		isdigit(p[13]) && isdigit(p[14])
+	);
+}
+
+/**
+ * @brief Checks whether @p s starts with an ISO 8601 timestamp,
+ * i.e., 'yyyy-mm-ddT...'.
+ */
+static int is_iso_timestamp(const char *s, const char *end)
+{
+	const unsigned char *p = (const unsigned char *)s;
+
+	if (end - s < 11)
+		return 0;
+	return (
+		isdigit(p[0]) && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3]) &&
+		p[4] == '-' && isdigit(p[5]) && isdigit(p[6]) && p[7] == '-' &&
+		isdigit(p[8]) && isdigit(p[9]) && p[10] == 'T'
+	);
+}
+
+/**
+ * @brief Skips the RFC 5424 STRUCTURED-DATA starting at @p p, i.e.,
+ * either '-' or one or more '[...]' elements, in which ']' might be
+ * escaped.
+ *
+ * @return Returns the first char after it.
+ */
+static const char *skip_structured_data(const char *p, const char *end)
+{
+	if (p < end && *p == '-')
+		return p + 1;
+
+	while (p < end && *p == '[') {
+		for (p++; p < end && *p != ']'; p++)
+			if (*p == '\\' && p + 1 < end)
+				p++;
+		if (p < end)
+			p++;
+	}
+	return p;
+}
+
+/**
+ * @brief Parses the RFC 5424 header after the PRI, starting at @p p.
+ *
+ * @return Returns the MSG start.
+ */
+static const char *
+parse_rfc5424(const char *msg, const char *p, const char *end,
+	struct log_hdr *hdr)
+{
+	const char *tok, *tok_end;
+
+	hdr->format = HDR_RFC5424;
+	p += 2; /* Version. */
+
+	/* TIMESTAMP and HOSTNAME, '-' means nil. */
+	tok     = p;
+	tok_end = next_token(&p, end);
+	if (tok_end - tok != 1 || *tok != '-')
+		set_span(&hdr->timestamp, msg, tok, tok_end);
+
+	tok     = p;
+	tok_end = next_token(&p, end);
+	if (tok_end - tok != 1 || *tok != '-')
+		set_span(&hdr->hostname, msg, tok, tok_end);
+
+	/* APP-NAME, PROCID and MSGID. */
+	next_token(&p, end);
+	next_token(&p, end);
+	next_token(&p, end);
+
+	p = skip_structured_data(p, end);
+	if (p < end && *p == ' ')
+		p++;
+
+	/* UTF-8 BOM. */
+	if (end - p >= 3 && !memcmp(p, "\xEF\xBB\xBF", 3))
+		p += 3;
+	return p;
+}
+
+/**
+ * @brief Parses the RFC 3164 header after the PRI, starting at @p p.
+ *
+ * @return Returns the MSG start.
+ */
+static const char *
+parse_rfc3164(const char *msg, const char *p, const char *end,
+	struct log_hdr *hdr)
+{
+	const char *tok;
+
+	hdr->format = HDR_RFC3164;
+
+	if (is_bsd_timestamp(p, end)) {
+		set_span(&hdr->timestamp, msg, p, p + 15);
+		p += 15;
+		if (p < end && *p == ' ')
+			p++;
+	}
+	else if (is_iso_timestamp(p, end)) {
+		tok = p;
+		set_span(&hdr->timestamp, msg, tok, next_token(&p, end));
+	}
+	else
+		return p;
+
+	/* Hostname only follows a timestamp. */
+	tok = p;
+	set_span(&hdr->hostname, msg, tok, next_token(&p, end));
+	return p;
+}
+
+/**
+ * @brief Parses the RouterOS topic list (like in 'system,info,account')
+ * starting at @p p, if any. Since a single word cannot be told apart
+ * from the message itself, at least two topics are required.
+ *
+ * @return Returns the message body start.
+ */
+static const char *
+parse_topics(const char *msg, const char *p, const char *end,
+	struct log_hdr *hdr)
+{
+	const char *q, *t;
+	int commas = 0;
+
+	for (q = p; q < end && *q != ' '; q++) {
+		if (*q == ',')
+			commas++;
+		else if (!islower((unsigned char)*q) && !isdigit((unsigned char)*q) &&
+			*q != '-' && *q != '_')
+		{
+			return p;
+		}
+	}
+
+	if (!commas || q == end || q == p)
+		return p;
+
+	set_span(&hdr->topics, msg, p, q);
+
+	/* The PRI, if any, has the final word. */
+	if (hdr->severity >= 0)
+		return q + 1;
+
+	for (t = p; t < q; t++) {
+		for (size_t i = 0; i < TOPIC_SEVERITIES_LEN; i++) {
+			if ((size_t)(q - t) >= topic_severities[i].len &&
+				!memcmp(t, topic_severities[i].name, topic_severities[i].len) &&
+				(t + topic_severities[i].len == q ||
+				 t[topic_severities[i].len] == ','))
+			{
+				hdr->severity = topic_severities[i].severity;
+				return q + 1;
+			}
+		}
+		if (!(t = memchr(t, ',', q - t)))
+			break;
+	}
+	return q + 1;
+}
+
+/**
+ * @brief Parses the header of the message @p msg, of length @p len,
+ * and fills @p hdr with the spans of each of its parts.
+ *
+ * @param msg Message to be parsed.
+ * @param len Message length.
+ * @param hdr Parsed header (output).
+ */
+void syslog_parse_hdr(const char *msg, size_t len, struct log_hdr *hdr)
+{
+	const char *end = msg + len;
+	const char *p   = msg;
+	const char *q;
+	int pri;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->facility = -1;
+	hdr->severity = -1;
+
+	/* <PRI>: up to 3 digits, up to 191. */
+	if (p < end && *p == '<') {
+		for (q = p + 1, pri = 0; q < end && isdigit((unsigned char)*q) &&
+			q - p <= 3; q++)
+		{
+			pri = (pri * 10) + (*q - '0');
+		}
+
+		if (q < end && *q == '>' && q > p + 1 && pri <= 191) {
+			set_span(&hdr->pri, msg, p + 1, q);
+			hdr->facility = pri >> 3;
+			hdr->severity = pri & 7;
+			p = q + 1;
+
+			if (end - p >= 2 && p[0] == '1' && p[1] == ' ')
+				p = parse_rfc5424(msg, p, end, hdr);
+			else
+				p = parse_rfc3164(msg, p, end, hdr);
+		}
+	}
+
+	p = parse_topics(msg, p, end, hdr);
+	set_span(&hdr->body, msg, p, end);
+}
+
+/**
+ * @brief Converts the severity name @p name (as in 'warning') into
+ * its numeric value.
+ *
+ * @return Returns the severity, or -1 if invalid.
+ */
+int syslog_parse_severity(const char *name)
+{
+	for (int i = 0; i < NUM_SEVERITIES; i++)
+		if (!strcmp(name, severities_str[i]))
+			return i;
+	return -1;
+}
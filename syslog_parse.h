@@ -0,0 +1,35 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef SYSLOG_PARSE_H
+#define SYSLOG_PARSE_H
+
+	#include <stddef.h>
+
+	/* Syslog severities (RFC 5424). */
+	#define SEV_EMERG   0
+	#define SEV_ALERT   1
+	#define SEV_CRIT    2
+	#define SEV_ERR     3
+	#define SEV_WARNING 4
+	#define SEV_NOTICE  5
+	#define SEV_INFO    6
+	#define SEV_DEBUG   7
+	#define NUM_SEVERITIES 8
+
+	/* Header formats. */
+	#define HDR_NONE    0 /* RouterOS default: topics + message.   */
+	#define HDR_RFC3164 1 /* <PRI>TIMESTAMP HOSTNAME ...           */
+	#define HDR_RFC5424 2 /* <PRI>1 TIMESTAMP HOSTNAME APP PID ... */
+
+	struct log_hdr;
+
+	extern const char *const severities_str[NUM_SEVERITIES];
+
+	extern void syslog_parse_hdr(const char *msg, size_t len,
+		struct log_hdr *hdr);
+	extern int syslog_parse_severity(const char *name);
+
+#endif /* SYSLOG_PARSE_H */
@@ -0,0 +1,369 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "log.h"
+#include "stats.h"
+#include "syslog.h"
+#include "syslog_tcp.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+/*
+ * TCP message handling (RFC 6587).
+ *
+ * All connections are served by a single thread with epoll, and each
+ * connection has its own reassembly buffer. Both framing methods are
+ * supported, and detected per message: a frame starting with a digit
+ * is octet-counted ('MSG-LEN SP SYSLOG-MSG'), otherwise it is
+ * LF-terminated ('non-transparent framing'). Complete messages go to
+ * the same FIFO as the UDP ones.
+ */
+
+struct tcp_conn {
+	int fd;
+	size_t len;      /* Pending bytes in 'buf'.                 */
+	size_t skip;     /* Octet-counted bytes left to discard.    */
+	int skip_line;   /* Discarding everything up to the next LF. */
+	char buf[SYSLOG_TCP_BUF_SIZE];
+};
+
+static int listen_fd;
+static int epoll_fd;
+static int max_conns;
+static pthread_t tcp_thread;
+
+/* Statistics. */
+static stat_t st_accepted;
+static stat_t st_rejected;
+static stat_t st_active;
+static stat_t st_msgs;
+static stat_t st_bytes;
+static stat_t st_truncated;
+
+/**
+ * @brief Dumps the TCP statistics.
+ */
+static void tcp_dump_stats(void)
+{
+	log_msg("  connections     : %lu\n", stat_get(st_accepted));
+	log_msg("  rejected conns  : %lu\n", stat_get(st_rejected));
+	log_msg("  active conns    : %lu\n", stat_get(st_active));
+	log_msg("  recv messages   : %lu\n", stat_get(st_msgs));
+	log_msg("  recv bytes      : %lu\n", stat_get(st_bytes));
+	log_msg("  truncated msgs  : %lu\n", stat_get(st_truncated));
+}
+
+/**
+ * @brief Adds the framed message @p msg of length @p len to the
+ * message queue.
+ *
+ * The message lives in the reassembly buffer, so instead of copying
+ * it, the byte right after it is temporarily replaced by a NUL.
+ */
+static void tcp_deliver(char *msg, size_t len, time_t ts)
+{
+	char save;
+
+	save = msg[len];
+	msg[len] = '\0';
+	syslog_ingest_msg(msg, len, ts);
+	msg[len] = save;
+
+	stat_inc(st_msgs);
+}
+
+/**
+ * @brief Parses an octet-counting 'MSG-LEN SP' prefix from @p p.
+ *
+ * @param p   Frame start.
+ * @param end Pending data end.
+ * @param n   Parsed message length (output).
+ *
+ * @return Returns the message start if a valid prefix was found,
+ * @p end if more data is needed, or NULL if this is not an
+ * octet-counted frame.
+ */
+static char *tcp_parse_octet_count(char *p, char *end, size_t *n)
+{
+	char *q;
+
+	*n = 0;
+	for (q = p; q < end && isdigit((unsigned char)*q); q++) {
+		if (q - p == SYSLOG_TCP_LEN_DIGITS)
+			return NULL;
+		*n = (*n * 10) + (*q - '0');
+	}
+
+	if (q == end)
+		return end;
+	if (*q != ' ' || !*n)
+		return NULL;
+	return q + 1;
+}
+
+/**
+ * @brief Extracts and delivers all complete messages pending in the
+ * connection @p c buffer, keeping any partial message for the next
+ * read.
+ *
+ * Messages longer than MSG_MAX-1 are truncated, the same way UDP
+ * ones are, and their remaining bytes discarded.
+ *
+ * @param c  Connection.
+ * @param ts Reception timestamp.
+ */
+static void tcp_parse(struct tcp_conn *c, time_t ts)
+{
+	char *p   = c->buf;
+	char *end = c->buf + c->len;
+	char *msg, *q;
+	size_t n;
+
+	while (p < end) {
+		/* Leftovers of a truncated message. */
+		if (c->skip) {
+			n = MIN(c->skip, (size_t)(end - p));
+			c->skip -= n;
+			p += n;
+			continue;
+		}
+		if (c->skip_line) {
+			if (!(q = memchr(p, '\n', end - p))) {
+				p = end;
+				break;
+			}
+			c->skip_line = 0;
+			p = q + 1;
+			continue;
+		}
+
+		/* Octet-counting. */
+		if (isdigit((unsigned char)*p) &&
+			(msg = tcp_parse_octet_count(p, end, &n)))
+		{
+			if (msg == end)
+				break;
+
+			if ((size_t)(end - msg) >= n) {
+				tcp_deliver(msg, n, ts);
+				p = msg + n;
+				continue;
+			}
+
+			if (n <= MSG_MAX - 1 || end - msg < MSG_MAX - 1)
+				break;
+
+			tcp_deliver(msg, MSG_MAX - 1, ts);
+			stat_inc(st_truncated);
+			c->skip = n - (MSG_MAX - 1);
+			p = msg + MSG_MAX - 1;
+			continue;
+		}
+
+		/* Non-transparent framing. */
+		if (!(q = memchr(p, '\n', end - p))) {
+			if (end - p < MSG_MAX - 1)
+				break;
+
+			tcp_deliver(p, MSG_MAX - 1, ts);
+			stat_inc(st_truncated);
+			c->skip_line = 1;
+			p += MSG_MAX - 1;
+			continue;
+		}
+
+		n = q - p;
+		if (n && p[n - 1] == '\r')
+			n--;
+		if (n > MSG_MAX - 1) {
+			n = MSG_MAX - 1;
+			stat_inc(st_truncated);
+		}
+		if (n)
+			tcp_deliver(p, n, ts);
+		p = q + 1;
+	}
+
+	c->len = end - p;
+	memmove(c->buf, p, c->len);
+}
+
+/**
+ * @brief Closes the connection @p c and releases its resources.
+ */
+static void tcp_close(struct tcp_conn *c)
+{
+	close(c->fd);
+	free(c);
+	stat_add(st_active, -1);
+}
+
+/**
+ * @brief Accepts all pending connections on the listening socket.
+ */
+static void tcp_accept(void)
+{
+	struct epoll_event ev;
+	struct tcp_conn *c;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+		SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0)
+	{
+		if (stat_get(st_active) >= (unsigned long)max_conns ||
+			!(c = calloc(1, sizeof(*c))))
+		{
+			stat_inc(st_rejected);
+			close(fd);
+			continue;
+		}
+
+		c->fd     = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			log_msg("Unable to watch TCP connection: %s\n",
+				strerror(errno));
+			close(fd);
+			free(c);
+			continue;
+		}
+
+		stat_inc(st_accepted);
+		stat_inc(st_active);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		log_msg("Unable to accept TCP connection: %s\n", strerror(errno));
+}
+
+/**
+ * @brief Reads whatever is available on the connection @p c and
+ * delivers the complete messages.
+ *
+ * @return Returns 0 if success, -1 if the connection was closed.
+ */
+static int tcp_read(struct tcp_conn *c, time_t ts)
+{
+	ssize_t ret;
+
+	ret = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	if (ret <= 0) {
+		tcp_close(c);
+		return -1;
+	}
+
+	stat_add(st_bytes, ret);
+	c->len += ret;
+	tcp_parse(c, ts);
+	return 0;
+}
+
+/**
+ * @brief TCP thread: serves all the connections.
+ */
+static void *tcp_loop(void *p)
+{
+	struct epoll_event events[SYSLOG_TCP_EVENTS];
+	int nevents;
+	time_t ts;
+	((void)p);
+
+	for (;;) {
+		nevents = epoll_wait(epoll_fd, events, SYSLOG_TCP_EVENTS, -1);
+		if (nevents < 0) {
+			if (errno == EINTR)
+				continue;
+			panic_errno("epoll_wait failed");
+		}
+
+		ts = time(NULL);
+		for (int i = 0; i < nevents; i++) {
+			if (!events[i].data.ptr)
+				tcp_accept();
+			else
+				tcp_read(events[i].data.ptr, ts);
+		}
+
+		/* Single wakeup for everything read in this round. */
+		syslog_ingest_done();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Initializes the TCP listener (if enabled via the
+ * SYSLOG_TCP environment var) and starts its thread.
+ *
+ * Must be called after the message queue initialization,
+ * see syslog_init_receivers().
+ *
+ * @return Returns 0 if success.
+ */
+int syslog_tcp_init(void)
+{
+	struct sockaddr_in svaddr;
+	struct epoll_event ev;
+	int yes;
+
+	if (!syslog_get_env_int("SYSLOG_TCP", 1, 0, 1)) {
+		log_msg("TCP listener: disabled\n");
+		return 0;
+	}
+
+	max_conns = syslog_get_env_int("SYSLOG_TCP_CONNS",
+		SYSLOG_TCP_CONNS_DEFAULT, 1, SYSLOG_TCP_CONNS_MAX);
+
+	listen_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		panic_errno("Unable to create TCP socket...");
+
+	yes = 1;
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes,
+		sizeof(yes)) < 0) {
+		panic_errno("Unable to reuse address...");
+	}
+
+	memset(&svaddr, 0, sizeof(svaddr));
+	svaddr.sin_family      = AF_INET;
+	svaddr.sin_addr.s_addr = INADDR_ANY;
+	svaddr.sin_port        = htons(SYSLOG_PORT);
+
+	if (bind(listen_fd, (const struct sockaddr *)&svaddr, sizeof(svaddr)) < 0)
+		panic_errno("Unable to bind TCP socket...");
+	if (listen(listen_fd, SOMAXCONN) < 0)
+		panic_errno("Unable to listen...");
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		panic_errno("Unable to create epoll instance...");
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+		panic_errno("Unable to watch TCP socket...");
+
+	if (pthread_create(&tcp_thread, NULL, tcp_loop, NULL))
+		panic_errno("Unable to create TCP thread!");
+
+	stats_register("syslog-tcp", tcp_dump_stats);
+	log_msg("TCP listener: enabled, max connections: %d\n", max_conns);
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef SYSLOG_TCP_H
+#define SYSLOG_TCP_H
+
+	#include "events.h"
+
+	/* Maximum (and default) amount of simultaneous TCP connections. */
+	#define SYSLOG_TCP_CONNS_MAX     1024
+	#define SYSLOG_TCP_CONNS_DEFAULT 64
+
+	/* Events handled per epoll_wait() call. */
+	#define SYSLOG_TCP_EVENTS 64
+
+	/*
+	 * Reassembly buffer: the largest pending frame is an octet-counted
+	 * one, i.e., 'MSG-LEN SP' (up to 9 digits) plus the message, which
+	 * is truncated to MSG_MAX-1 bytes. The last byte is reserved for
+	 * the NUL terminator.
+	 */
+	#define SYSLOG_TCP_LEN_DIGITS 9
+	#define SYSLOG_TCP_BUF_SIZE   (MSG_MAX + SYSLOG_TCP_LEN_DIGITS + 1)
+
+	extern int syslog_tcp_init(void);
+
+#endif /* SYSLOG_TCP_H */
@@ -0,0 +1,82 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Benchmarks corpus: a few typical RouterOS lines, or any file with
+ * one message per line.
+ */
+
+static const char *default_corpus[] = {
+	"system,info,account user admin logged in from 10.0.0.2 via winbox",
+	"system,info,account user admin logged out from 10.0.0.2 via winbox",
+	"system,error,critical login failure for user admin from 10.0.0.5 via ssh",
+	"interface,info ether2 link up (speed 1000Mbps, full duplex)",
+	"interface,info ether3 link down",
+	"dhcp,info dhcp1 assigned 192.168.88.254 to 4C:5E:0C:11:22:33",
+	"dhcp,info dhcp1 deassigned 192.168.88.254 from 4C:5E:0C:11:22:33",
+	"wireless,info 4C:5E:0C:11:22:33@wlan1: connected, signal strength -61",
+	"wireless,info 4C:5E:0C:11:22:33@wlan1: disconnected, unicast key "
+		"exchange timeout, signal strength -71",
+	"firewall,info input: in:ether1 out:(unknown 0), src-mac "
+		"00:11:22:33:44:55, proto TCP (SYN), 1.2.3.4:5555->10.0.0.1:22, len 60",
+	"firewall,info forward: in:ether1 out:bridge, src-mac 00:11:22:33:44:55, "
+		"proto UDP, 8.8.8.8:53->192.168.88.10:51234, len 120",
+	"system,info device changed by admin",
+	"system,info,account user admin logged in from 192.168.88.2 via ssh",
+	"script,info backup done",
+	"ipsec,error phase1 negotiation failed due to time up 1.2.3.4[500]",
+	"dns,packet --- sending udp query to 8.8.8.8:53:",
+	"ovpn,info ovpn-out1: connecting...",
+	"pppoe,ppp,info pppoe-out1: initializing...",
+	"system,info router rebooted",
+	"interface,info ether5 link up (speed 100Mbps, full duplex)",
+};
+#define DEFAULT_CORPUS_LEN (sizeof(default_corpus) / sizeof(default_corpus[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Reads the corpus from @p file, one line per message.
+ */
+static char **read_corpus(const char *file, size_t *n)
+{
+	char **lines = NULL;
+	size_t cap = 0, len;
+	char buf[2048];
+	FILE *f;
+
+	if (!(f = fopen(file, "r"))) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+
+	*n = 0;
+	while (fgets(buf, sizeof buf, f)) {
+		len = strcspn(buf, "\r\n");
+		buf[len] = '\0';
+		if (*n == cap) {
+			cap   = cap ? cap * 2 : 64;
+			lines = realloc(lines, cap * sizeof(*lines));
+		}
+		lines[(*n)++] = strdup(buf);
+	}
+	fclose(f);
+	return lines;
+}
+
+#endif /* CORPUS_H */
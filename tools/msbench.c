@@ -0,0 +1,121 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../memsearch.h"
+#include "corpus.h"
+
+/*
+ * Substring search benchmark: searches a corpus of RouterOS lines for
+ * a few rule-like substrings (and the separators the event handlers
+ * look for), with libc and with each search kernel supported by the
+ * running CPU, and checks that all agree.
+ *
+ * Usage: ./msbench [corpus-file] [rounds]
+ */
+
+static const char *needles[] = {
+	"unicast key exchange timeout",
+	"login failure",
+	"link down",
+	"src-mac",
+	"via ssh",
+	"dhcp1 assigned",
+};
+#define NUM_NEEDLES (sizeof(needles) / sizeof(needles[0]))
+
+static const char separators[] = {'@', ':', ','};
+#define NUM_SEPARATORS (sizeof(separators) / sizeof(separators[0]))
+
+int main(int argc, char **argv)
+{
+	const char **corpus = default_corpus;
+	size_t corpus_len   = DEFAULT_CORPUS_LEN;
+	size_t *lens, total = 0;
+	unsigned long found, disagree = 0;
+	double t0, t_mem[MS_IMPLS_LEN + 1], t_chr[MS_IMPLS_LEN + 1];
+	const char *p, *q;
+	long rounds = 200000;
+	int impl;
+
+	if (argc > 1) {
+		corpus = (const char **)read_corpus(argv[1], &corpus_len);
+		rounds = 2000;
+	}
+	if (argc > 2)
+		rounds = atol(argv[2]);
+
+	lens = malloc(corpus_len * sizeof(*lens));
+	for (size_t l = 0; l < corpus_len; l++)
+		total += (lens[l] = strlen(corpus[l]));
+
+	printf("corpus: %zu lines (avg %.1f bytes), %zu needles, %ld rounds\n",
+		corpus_len, (double)total / corpus_len, NUM_NEEDLES, rounds);
+
+	/* Index 0 is libc, then the kernels. */
+	for (int e = 0; e <= MS_IMPLS_LEN; e++) {
+		impl = e - 1;
+		if (impl >= 0 && ms_select(impl) < 0)
+			continue;
+
+		/* Agreement. */
+		for (size_t l = 0; l < corpus_len; l++) {
+			for (size_t i = 0; i < NUM_NEEDLES; i++) {
+				p = memmem(corpus[l], lens[l], needles[i], strlen(needles[i]));
+				q = ms_memmem(corpus[l], lens[l], needles[i], strlen(needles[i]));
+				if (impl >= 0 && p != q) {
+					disagree++;
+					printf("disagree (%s): '%s' on '%s'\n", ms_impls_str[impl],
+						needles[i], corpus[l]);
+				}
+			}
+		}
+
+		found = 0;
+		t0    = now();
+		for (long k = 0; k < rounds; k++) {
+			for (size_t l = 0; l < corpus_len; l++) {
+				for (size_t i = 0; i < NUM_NEEDLES; i++) {
+					if (impl < 0)
+						found += !!memmem(corpus[l], lens[l], needles[i],
+							strlen(needles[i]));
+					else
+						found += !!ms_memmem(corpus[l], lens[l], needles[i],
+							strlen(needles[i]));
+				}
+			}
+		}
+		t_mem[e] = now() - t0;
+
+		t0 = now();
+		for (long k = 0; k < rounds; k++) {
+			for (size_t l = 0; l < corpus_len; l++) {
+				for (size_t i = 0; i < NUM_SEPARATORS; i++) {
+					if (impl < 0)
+						found += !!memchr(corpus[l], separators[i], lens[l]);
+					else
+						found += !!ms_memchr(corpus[l], separators[i], lens[l]);
+				}
+			}
+		}
+		t_chr[e] = now() - t0;
+
+		printf("%-7s: memmem: %6.1f ns/line/needle (%5.2fx), "
+			"memchr: %5.1f ns/line/char (%5.2fx), found: %lu\n",
+			(impl < 0) ? "libc" : ms_impls_str[impl],
+			t_mem[e] * 1e9 / ((double)rounds * corpus_len * NUM_NEEDLES),
+			t_mem[0] / t_mem[e],
+			t_chr[e] * 1e9 / ((double)rounds * corpus_len * NUM_SEPARATORS),
+			t_chr[0] / t_chr[e], found);
+	}
+
+	printf("disagreements: %lu\n", disagree);
+	return (disagree != 0);
+}
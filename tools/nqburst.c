@@ -0,0 +1,254 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../notifiers.h"
+#include "../notify_queue.h"
+
+/*
+ * Notification queue burst test: queues a burst of requests to a
+ * local webhook that answers each of them after DELAY_MS, with a
+ * small NOTIFY_INFLIGHT, and checks that each pending request starts
+ * as soon as a slot frees: request i (in submit order) should take
+ * about (i / slots + 1) * DELAY_MS, and not wait for the notification
+ * thread to wake up on its own. Both with a single notifier (which
+ * gets all the slots) and with two of them (which share them).
+ *
+ * Usage: ./nqburst [requests] [inflight]
+ */
+
+#define DELAY_MS 50
+#define SLACK_MS 250
+
+static int port;
+static int num_done;
+static unsigned long *latency;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond  = PTHREAD_COND_INITIALIZER;
+
+/* Stub: the real one lives in syslog.c, with all its dependencies. */
+long syslog_get_env_int(const char *var, long def, long min, long max)
+{
+	char *env = getenv(var);
+	long val  = env ? atol(env) : def;
+	return (val < min) ? min : (val > max) ? max : val;
+}
+
+/**
+ * @brief Serves the requests of the connection @p p, answering each
+ * one after DELAY_MS.
+ */
+static void *conn_thread(void *p)
+{
+	int fd = (int)(intptr_t)p;
+	char buf[4096];
+	size_t len = 0;
+	char *end, *cl;
+	size_t body;
+	ssize_t r;
+
+	static const char resp[] =
+		"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+
+	while ((r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += r;
+		buf[len] = '\0';
+
+		/* Whole requests only: headers and body. */
+		while ((end = strstr(buf, "\r\n\r\n"))) {
+			cl   = strcasestr(buf, "Content-Length:");
+			body = (cl && cl < end) ? (size_t)atol(cl + 15) : 0;
+			if ((size_t)(end + 4 - buf) + body > len)
+				break;
+
+			usleep(DELAY_MS * 1000);
+			if (write(fd, resp, sizeof(resp) - 1) < 0)
+				goto out;
+
+			body += end + 4 - buf;
+			memmove(buf, buf + body, len - body);
+			len -= body;
+			buf[len] = '\0';
+		}
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+/**
+ * @brief Webhook thread: accepts connections, each one served by its
+ * own thread.
+ */
+static void *server_thread(void *p)
+{
+	int srv = (int)(intptr_t)p;
+	pthread_t thread;
+	int fd;
+
+	while ((fd = accept(srv, NULL, NULL)) >= 0) {
+		pthread_create(&thread, NULL, conn_thread, (void *)(intptr_t)fd);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Starts the local webhook, on any free port.
+ */
+static void start_server(void)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int srv;
+
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((srv = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(srv, 64) < 0 ||
+		getsockname(srv, (struct sockaddr *)&addr, &len) < 0)
+	{
+		perror("webhook");
+		exit(EXIT_FAILURE);
+	}
+
+	port = ntohs(addr.sin_port);
+	pthread_create(&thread, NULL, server_thread, (void *)(intptr_t)srv);
+}
+
+/**
+ * @brief Discards the response bodies.
+ */
+static size_t discard(char *ptr, size_t size, size_t nmemb, void *p)
+{
+	((void)ptr);
+	((void)p);
+	return size * nmemb;
+}
+
+/**
+ * @brief Completion callback: keeps the latency of each request.
+ */
+static void done(const struct notify_result *res)
+{
+	pthread_mutex_lock(&mutex);
+		latency[(intptr_t)res->data] = (res->code == CURLE_OK &&
+			res->status == 200) ? res->latency_ms : (unsigned long)-1;
+		num_done++;
+		pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * @brief Queues @p num requests, each one through the notifier
+ * (Generic1 or Generic2) chosen by @p pick, waits for all of them, and
+ * checks their latencies against @p slots requests in flight.
+ *
+ * @return Returns the amount of late (or failed) requests.
+ */
+static int burst(const char *name, int num, int slots, int (*pick)(int))
+{
+	char url[64];
+	unsigned long expected, max = 0;
+	int late = 0;
+	CURL *hnd;
+	int idx;
+
+	snprintf(url, sizeof url, "http://127.0.0.1:%d/", port);
+	num_done = 0;
+
+	for (int i = 0; i < num; i++) {
+		idx = pick(i);
+		if (!(hnd = notify_handle(idx))) {
+			fprintf(stderr, "notify_handle failed\n");
+			exit(EXIT_FAILURE);
+		}
+		curl_easy_setopt(hnd, CURLOPT_URL, url);
+		curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, "{\"text\": \"burst\"}");
+		curl_easy_setopt(hnd, CURLOPT_WRITEFUNCTION, discard);
+		if (notify_submit(hnd, NULL, idx, done, (void *)(intptr_t)i) < 0) {
+			fprintf(stderr, "notify_submit failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_mutex_lock(&mutex);
+		while (num_done < num)
+			pthread_cond_wait(&cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+
+	for (int i = 0; i < num; i++) {
+		expected = (i / slots + 1) * DELAY_MS + SLACK_MS;
+		if (latency[i] > expected) {
+			late++;
+			printf("late: request %d took %lu ms, expected up to %lu ms\n",
+				i, latency[i], expected);
+		}
+		if (latency[i] > max)
+			max = latency[i];
+	}
+
+	printf("%-12s: %d requests, %d in flight, max latency %lu ms, "
+		"late: %d\n", name, num, slots, max, late);
+	return late;
+}
+
+/**
+ * @brief Always Generic1.
+ */
+static int pick_one(int i)
+{
+	((void)i);
+	return NOTIFY_IDX_GENRC1;
+}
+
+/**
+ * @brief Alternates Generic1 and Generic2.
+ */
+static int pick_two(int i)
+{
+	return (i & 1) ? NOTIFY_IDX_GENRC2 : NOTIFY_IDX_GENRC1;
+}
+
+int main(int argc, char **argv)
+{
+	int num   = 16;
+	int slots = 2;
+	char env[16];
+	int late;
+
+	if (argc > 1)
+		num = atoi(argv[1]);
+	if (argc > 2)
+		slots = atoi(argv[2]);
+
+	snprintf(env, sizeof env, "%d", slots);
+	setenv("NOTIFY_INFLIGHT", env, 1);
+	setenv("NOTIFY_QUEUE", "4096", 1);
+
+	if (!(latency = calloc(num, sizeof(*latency))))
+		return EXIT_FAILURE;
+
+	start_server();
+	notify_queue_init();
+
+	/* A lone notifier gets all the slots. */
+	late  = burst("one notifier", num, slots, pick_one);
+	late += burst("two notifiers", num, slots, pick_two);
+	return (late != 0);
+}
@@ -0,0 +1,76 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../events.h"
+
+/*
+ * Regex prefilter check: for each pattern, a line that libc's
+ * regexec() matches must also pass the prefilter (i.e., contain all
+ * the required factors extracted from the pattern), even for the
+ * less usual ERE syntax, like stacked quantifiers or '{,m}' bounds.
+ *
+ * Usage: ./pfcheck
+ */
+
+static const struct {
+	const char *regex;
+	const char *line;
+} cases[] = {
+	{"login failure for user ([a-z]+) from (.*) via ssh",
+		"login failure for user bob from 10.0.0.1 via ssh"},
+	{"ether[0-9]+ link (up|down)", "ether1 link down"},
+	{"fail(ed){,1} login", "user fail login from x"},
+	{"fail(ed){,1} login", "user failed login from x"},
+	{"session x{,3}closed", "session closed"},
+	{"session x{,}closed", "session closed"},
+	{"session (by ){,2}admin", "session admin"},
+	{"port a+?down", "port aadown"},
+	{"link x*{2}up", "link up"},
+	{"port aa{1}down", "port aadown"},
+	{"port ab{0}down", "port adown"},
+	{"config\\.bak{0,1} saved", "config.ba saved"},
+};
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+int main(void)
+{
+	struct prefilter pf[NUM_CASES];
+	struct log_event ev = {0};
+	regex_t posix;
+	int failed = 0;
+	int match;
+
+	for (size_t i = 0; i < NUM_CASES; i++)
+		prefilter_init(&pf[i], "check", cases[i].regex, 0);
+	ac_build();
+	ac_hits_init(&ev.substr_hits);
+
+	for (size_t i = 0; i < NUM_CASES; i++) {
+		if (regcomp(&posix, cases[i].regex, REG_EXTENDED | REG_NOSUB)) {
+			fprintf(stderr, "regcomp failed: %s\n", cases[i].regex);
+			return EXIT_FAILURE;
+		}
+		match = !regexec(&posix, cases[i].line, 0, NULL, 0);
+		regfree(&posix);
+
+		ev.msg = cases[i].line;
+		ev.len = strlen(cases[i].line);
+		ac_scan(&ev);
+
+		if (!match || !prefilter_pass(&pf[i], &ev)) {
+			failed++;
+			printf("failed: /%s/ on '%s': regexec %d, factors %d, pass 0\n",
+				cases[i].regex, cases[i].line, match, pf[i].num_factors);
+		}
+	}
+
+	printf("prefilter: %zu cases, failed: %d\n", NUM_CASES, failed);
+	return (failed != 0);
+}
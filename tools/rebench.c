@@ -0,0 +1,230 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+#include <time.h>
+
+#include "../re.h"
+#include "corpus.h"
+
+/*
+ * Regex engines benchmark: matches a corpus of RouterOS lines against
+ * a few rule-like patterns, with both libc and the built-in engine
+ * (one pattern at a time, and all of them as a set), and checks that
+ * all agree. Before that, a small differential check: random patterns
+ * on random inputs, against regexec().
+ *
+ * Usage: ./rebench [corpus-file] [rounds]
+ */
+
+static const char *patterns[] = {
+	"login failure for user ([A-Za-z]+) from ([0-9]{1,3}.*) via ssh",
+	"([a-zA-Z0-9]+) link up \\(speed ([0-9]+Mbps), full duplex\\)",
+	"input: in:.*src-mac [0-9a-f:]+, proto [^,]+, (([0-9]{1,3}\\.?)+):"
+		"([0-9]{1,5})->(([0-9]{1,3}\\.?)+):([0-9]{1,5})",
+	"user ([a-z]+) logged (in|out) from ([0-9.]+)",
+	"(disconnected|connected), (signal strength|reason) [-a-z0-9 ]+",
+	"^dhcp[0-9]* (assigned|deassigned) ([0-9.]+) (to|from) ([0-9A-F:]+)",
+};
+#define NUM_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+/* Differential check: pieces of the random patterns and inputs. */
+static const char *atoms[] = {
+	"a", "b", "1", " ", ".", "[ab]", "[^a]", "[0-9]", "[[:space:]]",
+	"\\.", "\\d", "\\s", "\\w", "^", "$", "(a|b1)", "(b*|1)", "()",
+};
+static const char *quants[] = {
+	"", "", "", "*", "+", "?", "{2}", "{0,2}", "{,2}", "{,}",
+};
+static const char input_chars[] = "ab1 .d";
+
+#define NUM_ATOMS  (sizeof(atoms) / sizeof(atoms[0]))
+#define NUM_QUANTS (sizeof(quants) / sizeof(quants[0]))
+#define DIFF_PATTERNS 4000
+#define DIFF_INPUTS   16
+
+/**
+ * @brief Builds a random pattern into @p buf: a few atoms, each with
+ * an optional quantifier, and maybe an alternation.
+ */
+static void random_pattern(char *buf, size_t size)
+{
+	int n = 1 + rand() % 4;
+	buf[0] = '\0';
+
+	for (int i = 0; i < n; i++) {
+		if (i && rand() % 8 == 0)
+			strncat(buf, "|", size - strlen(buf) - 1);
+		strncat(buf, atoms[rand() % NUM_ATOMS], size - strlen(buf) - 1);
+		strncat(buf, quants[rand() % NUM_QUANTS], size - strlen(buf) - 1);
+	}
+}
+
+/**
+ * @brief Differential check: matches random patterns against random
+ * inputs (the empty one included) with regexec(), and checks that the
+ * built-in engine and a set agree on all patterns that re_check()
+ * accepts as libc-compatible.
+ *
+ * @return Returns the amount of disagreements.
+ */
+static unsigned long differential(void)
+{
+	unsigned long disagree = 0, checked = 0, skipped = 0;
+	char pattern[128], input[16];
+	const char *pp = pattern;
+	unsigned long hits[RE_SET_WORDS];
+	regex_t posix;
+	struct re *re, *set;
+	const char *err;
+	int r[3], len;
+
+	srand(1);
+	for (int i = 0; i < DIFF_PATTERNS; i++) {
+		random_pattern(pattern, sizeof pattern);
+		if (re_check(pattern, &err) != 0 ||
+			regcomp(&posix, pattern, REG_EXTENDED | REG_NOSUB))
+		{
+			skipped++;
+			continue;
+		}
+		re  = re_compile(pattern, &err);
+		set = re_set_compile(&pp, 1, &err);
+		if (!re || !set) {
+			fprintf(stderr, "re_compile failed: %s: %s\n", pattern, err);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int k = 0; k < DIFF_INPUTS; k++) {
+			len = k ? rand() % (int)sizeof(input) : 0;
+			for (int c = 0; c < len; c++)
+				input[c] = input_chars[rand() % (sizeof(input_chars) - 1)];
+			input[len] = '\0';
+
+			memset(hits, 0, sizeof(hits));
+			r[0] = !regexec(&posix, input, 0, NULL, 0);
+			r[1] = !re_exec(re, input, 0, NULL);
+			r[2] = re_set_match(set, input, len, hits) > 0;
+			if (r[0] != r[1] || r[0] != r[2]) {
+				disagree++;
+				printf("disagree: /%s/ on '%s': libc %d, builtin %d, set %d\n",
+					pattern, input, r[0], r[1], r[2]);
+			}
+			checked++;
+		}
+		regfree(&posix);
+		re_free(re);
+		re_free(set);
+	}
+
+	printf("differential: %lu checks, %lu patterns skipped, "
+		"disagreements: %lu\n", checked, skipped, disagree);
+	return disagree;
+}
+
+int main(int argc, char **argv)
+{
+	const char **corpus = default_corpus;
+	size_t corpus_len   = DEFAULT_CORPUS_LEN;
+	regex_t posix[NUM_PATTERNS];
+	struct re *re[NUM_PATTERNS];
+	struct re *set;
+	regmatch_t pm[32];
+	unsigned long hits[RE_SET_WORDS];
+	unsigned long matches[3] = {0};
+	unsigned long disagree = 0;
+	double t0, t[3];
+	const char *err;
+	long rounds = 20000;
+	int r[2];
+
+	if (argc > 1) {
+		corpus = (const char **)read_corpus(argv[1], &corpus_len);
+		rounds = 200;
+	}
+	if (argc > 2)
+		rounds = atol(argv[2]);
+
+	for (size_t i = 0; i < NUM_PATTERNS; i++) {
+		if (regcomp(&posix[i], patterns[i], REG_EXTENDED)) {
+			fprintf(stderr, "regcomp failed: %s\n", patterns[i]);
+			return EXIT_FAILURE;
+		}
+		if (!(re[i] = re_compile(patterns[i], &err))) {
+			fprintf(stderr, "re_compile failed: %s: %s\n", patterns[i], err);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!(set = re_set_compile(patterns, NUM_PATTERNS, &err))) {
+		fprintf(stderr, "re_set_compile failed: %s\n", err);
+		return EXIT_FAILURE;
+	}
+
+	disagree = differential();
+
+	/* Agreement. */
+	for (size_t l = 0; l < corpus_len; l++) {
+		memset(hits, 0, sizeof(hits));
+		re_set_match(set, corpus[l], strlen(corpus[l]), hits);
+		for (size_t i = 0; i < NUM_PATTERNS; i++) {
+			r[0] = regexec(&posix[i], corpus[l], 32, pm, 0);
+			r[1] = re_exec(re[i], corpus[l], 32, pm);
+			if ((r[0] == 0) != (r[1] == 0) ||
+				(r[0] == 0) != (int)((hits[i / RE_WORD_BITS] >> (i % RE_WORD_BITS)) & 1))
+			{
+				disagree++;
+				printf("disagree: /%s/ on '%s'\n", patterns[i], corpus[l]);
+			}
+		}
+	}
+
+	/* Decision only, as most lines do not match. */
+	for (int e = 0; e < 2; e++) {
+		t0 = now();
+		for (long k = 0; k < rounds; k++) {
+			for (size_t l = 0; l < corpus_len; l++) {
+				for (size_t i = 0; i < NUM_PATTERNS; i++) {
+					if (e == 0)
+						matches[e] += !regexec(&posix[i], corpus[l], 0, NULL, 0);
+					else
+						matches[e] += !re_exec(re[i], corpus[l], 0, NULL);
+				}
+			}
+		}
+		t[e] = now() - t0;
+	}
+
+	/* All patterns at once. */
+	t0 = now();
+	for (long k = 0; k < rounds; k++) {
+		for (size_t l = 0; l < corpus_len; l++) {
+			memset(hits, 0, sizeof(hits));
+			matches[2] += re_set_match(set, corpus[l], strlen(corpus[l]), hits);
+		}
+	}
+	t[2] = now() - t0;
+
+	printf("corpus: %zu lines, %zu patterns, %ld rounds\n",
+		corpus_len, NUM_PATTERNS, rounds);
+	for (int e = 0; e < 3; e++) {
+		printf("%-8s: %8.3f s, %8.1f ns/line/pattern, matches: %lu\n",
+			(e < 2) ? re_engines_str[e] : "set", t[e],
+			t[e] * 1e9 / ((double)rounds * corpus_len * NUM_PATTERNS),
+			matches[e]);
+	}
+	printf("speedup : %.2fx (builtin), %.2fx (set), disagreements: %lu\n",
+		t[0] / t[1], t[0] / t[2], disagree);
+
+	for (size_t i = 0; i < NUM_PATTERNS; i++) {
+		regfree(&posix[i]);
+		re_free(re[i]);
+	}
+	re_free(set);
+	return (disagree != 0);
+}
@@ -0,0 +1,81 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../events.h"
+
+/*
+ * Rule index check: files a few rules (with mixed-case topics and
+ * hosts, as they may come from the environment) and checks that each
+ * message finds exactly the expected rules, in rule order.
+ *
+ * Usage: ./richeck
+ */
+
+/* Stub: the real one lives in workers.c, with all its dependencies. */
+_Thread_local int worker_self;
+
+static const struct rule_filter rules[] = {
+	{"Wireless", NULL,      -1},          /* 0 */
+	{"wireless", NULL,      -1},          /* 1 */
+	{"FIREWALL", NULL,      SEV_WARNING}, /* 2 */
+	{"System",   "Router1", -1},          /* 3 */
+	{NULL,       NULL,      -1},          /* 4 */
+};
+#define NUM_RULES (sizeof(rules) / sizeof(rules[0]))
+
+static const struct {
+	const char *msg;
+	const char *expected; /* Rule ids found, in order. */
+} cases[] = {
+	{"wireless,info wlan1: connected, signal strength -60", "0 1 4"},
+	{"firewall,warning input: in:ether1 out:(unknown 0)",   "2 4"},
+	{"firewall,info input: in:ether1 out:(unknown 0)",      "4"},
+	{"<14>Jan  1 00:00:00 router1 system,info,account user admin logged in",
+		"3 4"},
+	{"<14>Jan  1 00:00:00 router2 system,info,account user admin logged in",
+		"4"},
+	{"dhcp,info dhcp1 assigned 10.0.0.2", "4"},
+};
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+int main(void)
+{
+	struct rule_index ri = {0};
+	struct log_event ev  = {0};
+	char found[64];
+	const int *ids;
+	int failed = 0;
+	int n, off;
+
+	for (size_t i = 0; i < NUM_RULES; i++)
+		rule_index_add(&ri, (int)i, &rules[i]);
+	rule_index_build(&ri, "check");
+
+	for (size_t i = 0; i < NUM_CASES; i++) {
+		ev.msg = cases[i].msg;
+		ev.len = strlen(cases[i].msg);
+		syslog_parse_hdr(ev.msg, ev.len, &ev.hdr);
+
+		n   = rule_index_lookup(&ri, &ev, &ids);
+		off = 0;
+		found[0] = '\0';
+		for (int j = 0; j < n; j++)
+			off += snprintf(found + off, sizeof(found) - off, "%s%d",
+				j ? " " : "", ids[j]);
+
+		if (strcmp(found, cases[i].expected)) {
+			failed++;
+			printf("failed: '%s': found '%s', expected '%s'\n",
+				cases[i].msg, found, cases[i].expected);
+		}
+	}
+
+	printf("rule index: %zu cases, failed: %d\n", NUM_CASES, failed);
+	return (failed != 0);
+}
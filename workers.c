@@ -0,0 +1,460 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aho_corasick.h"
+#include "dedup.h"
+#include "digest.h"
+#include "env_events.h"
+#include "events.h"
+#include "log.h"
+#include "notifiers.h"
+#include "outbox.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "syslog.h"
+#include "workers.h"
+
+/*
+ * Matcher workers
+ *
+ * Matching a message against hundreds of rules takes much longer than
+ * receiving it, so it is spread over a pool of workers (MATCH_WORKERS):
+ * the handler thread copies each message into a job, any idle worker
+ * matches it, and a single emitter thread then writes its log output
+ * and sends its notifications.
+ *
+ * Workers do not write anything themselves: their log output is
+ * captured into the job (see log_capture()), and so are notifications
+ * (see worker_notify()), so that the emitter can replay everything in
+ * the order messages arrived, just like a single thread would
+ * (MATCH_ORDER=strict, the default). With 'relaxed', jobs are emitted
+ * as soon as they are done, so a slow message does not hold back the
+ * ones after it.
+ *
+ * Jobs live in a ring, indexed by their sequence number: when all of
+ * them are in flight, the handler waits, and the new messages wait in
+ * the message queue.
+ */
+
+/* Job states. */
+#define JOB_FREE   0
+#define JOB_QUEUED 1
+#define JOB_BUSY   2
+#define JOB_DONE   3
+
+/* Queued notification. */
+struct job_notif {
+	unsigned notifiers; /* Notifiers mask.               */
+	int    rl_id;    /* Rule, for its rate limit.        */
+	uint64_t key;    /* Alert key, for dedup.            */
+	size_t log_off;  /* Log output before it, in bytes.  */
+	size_t text_off; /* Message, in the job texts.       */
+};
+
+struct job {
+	int    state;
+	int    handled;
+	time_t timestamp;
+	size_t len;
+	struct log_hdr hdr;
+	char   msg[MSG_MAX];
+
+	struct log_buf log;    /* Captured log output.         */
+	struct log_buf texts;  /* Notification messages.       */
+	struct job_notif *notifs;
+	int num_notifs;
+	int max_notifs;
+};
+
+static struct worker {
+	pthread_t thread;
+	struct log_event ev;   /* Current message, and its hits. */
+	struct job *job;       /* Current job.                   */
+
+	/* Statistics. */
+	stat_t jobs;
+	stat_t busy_us;
+} workers[MAX_WORKERS];
+
+static const char *const orders_str[ORDERS_LEN] = {"strict", "relaxed"};
+
+static int num_workers;
+static int order;
+
+static struct job *jobs;
+static unsigned num_jobs;       /* Power of 2.                    */
+static unsigned long next_seq;  /* Next job to dispatch.          */
+static unsigned long next_take; /* Next job to match.             */
+static unsigned long next_emit; /* Next job to emit, if strict.   */
+static unsigned *done_jobs;     /* Done jobs ring, if relaxed.    */
+static unsigned long done_head;
+static unsigned long done_tail;
+static unsigned num_done;       /* Done, but not emitted yet.     */
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_free   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  job_ready  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  job_done   = PTHREAD_COND_INITIALIZER;
+
+_Thread_local int worker_self;
+
+/* Statistics. */
+static stat_t dispatch_waits;   /* Handler waited for a free job. */
+static stat_t reorder_waits;    /* Emitter waited for an older job. */
+static struct timespec stats_last;
+
+/**
+ * @brief Returns the microseconds elapsed from @p t0 to @p t1.
+ */
+static inline unsigned long
+elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000UL +
+		(t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/**
+ * @brief Dumps the workers statistics.
+ */
+static void workers_dump_stats(void)
+{
+	static unsigned long last_busy[MAX_WORKERS];
+	unsigned long busy, us;
+	struct timespec now;
+
+	/* Busy time wraps around, but not within an interval. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = elapsed_us(&stats_last, &now);
+	stats_last = now;
+
+	for (int i = 0; i < num_workers; i++) {
+		busy = stat_get(workers[i].busy_us);
+		log_msg("  worker%-2d jobs/busy: %lu / %.1f%%\n", i,
+			stat_get(workers[i].jobs),
+			us ? 100.0 * (busy - last_busy[i]) / us : 0.0);
+		last_busy[i] = busy;
+	}
+	log_msg("  output order    : %s\n",  orders_str[order]);
+	log_msg("  dispatch waits  : %lu\n", stat_get(dispatch_waits));
+	log_msg("  reorder waits   : %lu\n", stat_get(reorder_waits));
+}
+
+/**
+ * @brief Queues the notification @p msg, to be sent through the
+ * notifiers @p notifiers once the current job of the calling worker
+ * is emitted, unless a repeat (see dedup.c) or over its rate limit.
+ * The message is kept once, whatever the amount of notifiers.
+ *
+ * @param rl_id     Rule id, as returned by rl_rule_add().
+ * @param notifiers Notifiers mask (see NOTIFIER_BIT()).
+ * @param key       Alert key (see dedup_key()).
+ * @param msg       Notification message.
+ */
+void worker_notify(int rl_id, unsigned notifiers, uint64_t key,
+	const char *msg)
+{
+	struct job *job = workers[worker_self].job;
+	char names[NOTIFIERS_NAMES_LEN];
+	struct job_notif *n;
+	size_t len, cap;
+	void *p;
+
+	if (job->num_notifs == job->max_notifs) {
+		cap = job->max_notifs ? job->max_notifs * 2 : 4;
+		if (!(p = realloc(job->notifs, cap * sizeof(*job->notifs))))
+			goto oom;
+		job->notifs     = p;
+		job->max_notifs = cap;
+	}
+
+	len = strlen(msg) + 1;
+	if (job->texts.len + len > job->texts.cap) {
+		for (cap = job->texts.cap ? job->texts.cap : 256;
+			cap < job->texts.len + len; cap *= 2);
+		if (!(p = realloc(job->texts.data, cap)))
+			goto oom;
+		job->texts.data = p;
+		job->texts.cap  = cap;
+	}
+
+	n = &job->notifs[job->num_notifs++];
+	n->notifiers = notifiers;
+	n->rl_id     = rl_id;
+	n->key       = key;
+	n->log_off   = job->log.len;
+	n->text_off  = job->texts.len;
+	memcpy(job->texts.data + job->texts.len, msg, len);
+	job->texts.len += len;
+	return;
+oom:
+	log_msg("unable to queue the notification through %s\n",
+		notifiers_names(notifiers, names));
+}
+
+/**
+ * @brief Matches the message of the job @p job against all events,
+ * on the worker @p w.
+ */
+static void match_job(struct worker *w, struct job *job)
+{
+	struct log_event *ev = &w->ev;
+
+	w->job           = job;
+	job->log.len     = 0;
+	job->texts.len   = 0;
+	job->num_notifs  = 0;
+
+	ev->msg       = job->msg;
+	ev->len       = job->len;
+	ev->timestamp = job->timestamp;
+	ev->hdr       = job->hdr;
+
+	log_capture(&job->log);
+		ac_scan(ev);
+		rule_hits_reset(&ev->regex_hits);
+		job->handled  = process_static_event(ev);
+		job->handled += process_environment_event(ev);
+	log_capture(NULL);
+}
+
+/**
+ * @brief Worker thread: matches jobs, in the order they were
+ * dispatched, as soon as they are available.
+ */
+static void *worker_thread(void *p)
+{
+	struct worker *w = p;
+	struct timespec t0, t1;
+	struct job *job;
+
+	worker_self = w - workers;
+	re_set_thread(worker_self);
+
+	while (1) {
+		pthread_mutex_lock(&pool_mutex);
+			while (next_take == next_seq)
+				pthread_cond_wait(&job_ready, &pool_mutex);
+			job = &jobs[next_take++ & (num_jobs - 1)];
+			job->state = JOB_BUSY;
+		pthread_mutex_unlock(&pool_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		match_job(w, job);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		stat_inc(w->jobs);
+		stat_add(w->busy_us, elapsed_us(&t0, &t1));
+
+		pthread_mutex_lock(&pool_mutex);
+			job->state = JOB_DONE;
+			if (order == ORDER_RELAXED)
+				done_jobs[done_tail++ & (num_jobs - 1)] = job - jobs;
+			num_done++;
+			pthread_cond_signal(&job_done);
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Sends the alert @p text, of the rule @p rl_id and with the
+ * alert key @p key, through each of the notifiers @p notifiers, or
+ * coalesces it into their digests if over the rule or notifier rate
+ * limits.
+ */
+void workers_emit(int rl_id, unsigned notifiers, uint64_t key,
+	const char *text)
+{
+	unsigned allowed;
+	int limit;
+
+	allowed = rl_allow(rl_id, notifiers, &limit);
+
+	for (int i = 0; i < NUM_NOTIFIERS; i++) {
+		if (!(notifiers & NOTIFIER_BIT(i)))
+			continue;
+
+		if (!(allowed & NOTIFIER_BIT(i))) {
+			log_msg("> Notification through %s %s, reason: %s rate limit!\n",
+				notifiers_str[i],
+				digest_add(rl_id, key, i, text) ? "suppressed" :
+					"deferred to digest",
+				(limit == RL_LIMIT_RULE) ? "rule" : "notifier");
+			continue;
+		}
+
+		if (outbox_send(i, text) < 0) {
+			log_msg("unable to send the notification through %s\n",
+				notifiers_str[i]);
+		}
+	}
+}
+
+/**
+ * @brief Writes the log output of the job @p job and emits its
+ * notifications, but their repeats.
+ */
+static void emit_job(struct job *job)
+{
+	char names[NOTIFIERS_NAMES_LEN];
+	struct log_event ev = {0};
+	struct job_notif *n;
+	const char *text;
+	size_t off = 0;
+
+	ev.msg       = job->msg;
+	ev.len       = job->len;
+	ev.timestamp = job->timestamp;
+	print_log_event(&ev);
+
+	for (int i = 0; i < job->num_notifs; i++) {
+		n = &job->notifs[i];
+		if (n->log_off > off)
+			log_write(job->log.data + off, n->log_off - off);
+		off = n->log_off;
+
+		text = job->texts.data + n->text_off;
+		if (dedup_seen(n->key, n->rl_id, n->notifiers, text)) {
+			log_msg("> Notification through %s suppressed, reason: "
+				"repeated alert\n", notifiers_names(n->notifiers, names));
+			continue;
+		}
+		workers_emit(n->rl_id, n->notifiers, n->key, text);
+	}
+	if (job->log.len > off)
+		log_write(job->log.data + off, job->log.len - off);
+
+	if (!job->handled)
+		log_msg("> Not handled!\n");
+}
+
+/**
+ * @brief Emitter thread: emits the done jobs, either in arrival
+ * order or as they are done, and frees them.
+ */
+static void *emitter_thread(void *p)
+{
+	((void)p);
+	struct job *job;
+
+	while (1) {
+		pthread_mutex_lock(&pool_mutex);
+			if (order == ORDER_STRICT) {
+				job = &jobs[next_emit & (num_jobs - 1)];
+				if (job->state != JOB_DONE && num_done)
+					stat_inc(reorder_waits);
+				while (job->state != JOB_DONE)
+					pthread_cond_wait(&job_done, &pool_mutex);
+				next_emit++;
+			} else {
+				while (done_head == done_tail)
+					pthread_cond_wait(&job_done, &pool_mutex);
+				job = &jobs[done_jobs[done_head++ & (num_jobs - 1)]];
+			}
+			num_done--;
+		pthread_mutex_unlock(&pool_mutex);
+
+		emit_job(job);
+
+		pthread_mutex_lock(&pool_mutex);
+			job->state = JOB_FREE;
+			pthread_cond_signal(&job_free);
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Hands the log event @p ev over to the workers, waiting
+ * for a free job if all of them are in flight. The event might be
+ * released as soon as this returns.
+ *
+ * @param ev Log event, already parsed.
+ */
+void workers_dispatch(const struct log_event *ev)
+{
+	struct job *job;
+	size_t len;
+
+	pthread_mutex_lock(&pool_mutex);
+		job = &jobs[next_seq & (num_jobs - 1)];
+		if (job->state != JOB_FREE) {
+			stat_inc(dispatch_waits);
+			while (job->state != JOB_FREE)
+				pthread_cond_wait(&job_free, &pool_mutex);
+		}
+	pthread_mutex_unlock(&pool_mutex);
+
+	len = (ev->len < MSG_MAX) ? ev->len : MSG_MAX - 1;
+	memcpy(job->msg, ev->msg, len);
+	job->msg[len]  = '\0';
+	job->len       = len;
+	job->timestamp = ev->timestamp;
+	job->hdr       = ev->hdr;
+
+	pthread_mutex_lock(&pool_mutex);
+		job->state = JOB_QUEUED;
+		next_seq++;
+		pthread_cond_signal(&job_ready);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * @brief Reads the MATCH_WORKERS and MATCH_ORDER environment vars
+ * (if any) and starts the workers and the emitter: must be called
+ * after all events were initialized.
+ */
+void workers_init(void)
+{
+	pthread_t emitter;
+	char *env;
+	int i;
+
+	num_workers = syslog_get_env_int("MATCH_WORKERS", 1, 1, MAX_WORKERS);
+
+	order = ORDER_STRICT;
+	if ((env = getenv("MATCH_ORDER"))) {
+		for (order = 0; order < ORDERS_LEN; order++)
+			if (!strcmp(env, orders_str[order]))
+				break;
+		if (order == ORDERS_LEN)
+			panic("Invalid MATCH_ORDER (%s)!\n", env);
+	}
+
+	for (num_jobs = 4; num_jobs < (unsigned)num_workers * WORKER_JOBS;
+		num_jobs *= 2);
+
+	jobs      = calloc(num_jobs, sizeof(*jobs));
+	done_jobs = calloc(num_jobs, sizeof(*done_jobs));
+	if (!jobs || !done_jobs)
+		panic("Unable to allocate the worker jobs!\n");
+
+	for (i = 0; i < num_workers; i++) {
+		ac_hits_init(&workers[i].ev.substr_hits);
+		if (rule_hits_init(&workers[i].ev.regex_hits) < 0)
+			panic("Unable to allocate regex set hits!\n");
+	}
+
+	log_msg("Matcher workers: %d, output order: %s\n\n", num_workers,
+		orders_str[order]);
+
+	clock_gettime(CLOCK_MONOTONIC, &stats_last);
+	stats_register("workers", workers_dump_stats);
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+			&workers[i]))
+		{
+			panic_errno("Unable to create worker thread!");
+		}
+	}
+	if (pthread_create(&emitter, NULL, emitter_thread, NULL))
+		panic_errno("Unable to create emitter thread!");
+}
@@ -0,0 +1,35 @@
+/*
+ * Alertik: a tiny 'syslog' server & notification tool for Mikrotik routers.
+ * This is free and unencumbered software released into the public domain.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+	#include <stdint.h>
+	#include "re.h"
+
+	struct log_event;
+
+	/* Maximum amount of matcher workers (MATCH_WORKERS env var). */
+	#define MAX_WORKERS RE_MAX_THREADS
+
+	/* Jobs in flight, per worker. */
+	#define WORKER_JOBS 4
+
+	/* Output order (MATCH_ORDER env var). */
+	#define ORDER_STRICT  0 /* Same as the arrival order.    */
+	#define ORDER_RELAXED 1 /* As soon as each one is done.  */
+	#define ORDERS_LEN    2
+
+	/* Calling worker id, 0 for any other thread. */
+	extern _Thread_local int worker_self;
+
+	extern void workers_init(void);
+	extern void workers_dispatch(const struct log_event *ev);
+	extern void worker_notify(int rl_id, unsigned notifiers, uint64_t key,
+		const char *msg);
+	extern void workers_emit(int rl_id, unsigned notifiers, uint64_t key,
+		const char *text);
+
+#endif /* WORKERS_H */